@@ -1,26 +1,91 @@
 #include <iostream>
 #include <fstream>
-#include <sstream>
 #include <vector>
 #include <string>
-#include <iomanip>
+#include <string_view>
+#include <memory>
+#include <deque>
+#include <unordered_map>
+#include <array>
+#include <utility>
+#include <cstdint>
 #include <cctype>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <charconv>
+#include <chrono>
+#include <zlib.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <cerrno>
+#include <csignal>
+#define LAYOUT2PDF_HAVE_MMAP 1
+#define LAYOUT2PDF_HAVE_SOCKETS 1
+#define LAYOUT2PDF_HAVE_ASYNC_WRITE 1
+#endif
+
+// io_uring for file output, through the system calls themselves (no liburing)
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define LAYOUT2PDF_HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+// Line scanner instruction set; define LAYOUT2PDF_NO_SIMD for the scalar one
+#if !defined(LAYOUT2PDF_NO_SIMD)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LAYOUT2PDF_SCAN_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define LAYOUT2PDF_SCAN_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define LAYOUT2PDF_SCAN_NEON 1
+#endif
+#endif
 
 // --- Helpers: trimming, lowercase, splitting ---
 
-static std::string Trim(const std::string &s) {
+// Same set as std::isspace in the "C" locale, without the locale lookup
+static inline bool IsSpace(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static std::string_view Trim(std::string_view s) {
     std::size_t start = 0;
-    while (start < s.size() && std::isspace(static_cast<unsigned char>(s[start]))) {
+    while (start < s.size() && IsSpace(s[start])) {
         start++;
     }
     std::size_t end = s.size();
-    while (end > start && std::isspace(static_cast<unsigned char>(s[end - 1]))) {
+    while (end > start && IsSpace(s[end - 1])) {
         end--;
     }
     return s.substr(start, end - start);
 }
 
-static std::string ToLower(const std::string &s) {
+static std::string ToLower(std::string_view s) {
     std::string out;
     out.reserve(s.size());
     for (std::size_t i = 0; i < s.size(); ++i) {
@@ -29,35 +94,501 @@ static std::string ToLower(const std::string &s) {
     return out;
 }
 
-static std::vector<std::string> SplitByComma(const std::string &s) {
-    std::vector<std::string> parts;
-    std::string current;
+// Commas inside parentheses, as in rgb(R, G, B), do not split
+static std::vector<std::string_view> SplitByComma(std::string_view s) {
+    std::vector<std::string_view> parts;
+    std::size_t start = 0;
+    int depth = 0;
     for (std::size_t i = 0; i < s.size(); ++i) {
-        char c = s[i];
-        if (c == ',') {
-            parts.push_back(Trim(current));
-            current.clear();
-        } else {
-            current.push_back(c);
+        if (s[i] == '(') {
+            depth++;
+        } else if (s[i] == ')' && depth > 0) {
+            depth--;
+        } else if (s[i] == ',' && depth == 0) {
+            parts.push_back(Trim(s.substr(start, i - start)));
+            start = i + 1;
         }
     }
-    if (!current.empty()) {
-        parts.push_back(Trim(current));
+    if (start < s.size()) {
+        parts.push_back(Trim(s.substr(start)));
     }
     return parts;
 }
 
-// Escape characters that are special in PDF literal strings
-static std::string EscapePdfString(const std::string &in) {
-    std::string out;
-    for (std::size_t i = 0; i < in.size(); ++i) {
-        char c = in[i];
-        if (c == '(' || c == ')' || c == '\\') {
-            out.push_back('\\');
+// --- Statistics ---
+// Stage timers and counters behind --stats. Each thread adds to its own
+// block, so the hot paths never contend, and the blocks are summed for the
+// report. Nothing is recorded, and the clock is never read, unless
+// statsEnabled is set; building with LAYOUT2PDF_NO_STATS removes the
+// scopes and counters altogether. A scope's time leaves out the scopes
+// nested in it, so the stage times add up to the threads' busy time.
+
+enum StatStage {
+    STAGE_READ,        // reading and indexing the layout text
+    STAGE_PARSE,
+    STAGE_LAYOUT,
+    STAGE_SERIALIZE,   // content streams
+    STAGE_COMPRESS,
+    STAGE_CACHE,       // page cache keys, lookups and stores
+    STAGE_ASSEMBLE,    // page objects, page tree, batching
+    STAGE_WRITE,       // objects, xref and trailer to the output
+    STAGE_WAIT,        // calling thread waiting for the pool
+    STAGE_COUNT
+};
+
+enum StatCounter {
+    STAT_INPUT_BYTES,
+    STAT_LINES,
+    STAT_PARSED_PAGES,
+    STAT_PAGES,
+    STAT_CONTENT_BYTES,   // content streams built, before compression
+    STAT_STREAM_BYTES,    // content streams as written
+    STAT_SHARED_STREAMS,  // pages reusing an identical content stream
+    STAT_CACHE_HITS,
+    STAT_ELIDED_OPS,      // Tf and rg left out as unchanged
+    STAT_OBJECTS,
+    STAT_OUTPUT_BYTES,
+    STAT_ALLOCATIONS,     // buffer and arena growth
+    STAT_COUNT
+};
+
+enum StatPeak {
+    PEAK_BUFFER,          // largest output or stream buffer
+    PEAK_STREAM,          // largest content stream
+    PEAK_COUNT
+};
+
+static const char *const stageNames[STAGE_COUNT] = {
+    "read", "parse", "layout", "serialize", "compress", "cache", "assemble", "write", "wait"
+};
+static const char *const counterNames[STAT_COUNT] = {
+    "input_bytes", "lines", "parsed_pages", "pages", "content_bytes", "stream_bytes",
+    "shared_streams", "cache_hits", "elided_operators", "objects", "output_bytes", "allocations"
+};
+static const char *const peakNames[PEAK_COUNT] = {
+    "peak_buffer_bytes", "peak_stream_bytes"
+};
+
+static bool statsEnabled = false;   // set once, before any worker starts
+
+#if !defined(LAYOUT2PDF_NO_STATS)
+struct StatsBlock {
+    std::atomic<std::uint64_t> stageNanos[STAGE_COUNT];
+    std::atomic<std::uint64_t> counters[STAT_COUNT];
+    std::atomic<std::uint64_t> peaks[PEAK_COUNT];
+};
+
+static std::mutex statsMutex;
+static std::vector<std::unique_ptr<StatsBlock> > statsBlocks;
+
+// Only the owning thread writes a block; the atomics let the report read
+// it at any time
+static StatsBlock &ThreadStats() {
+    thread_local StatsBlock *block = nullptr;
+    if (!block) {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        statsBlocks.emplace_back(new StatsBlock());
+        block = statsBlocks.back().get();
+    }
+    return *block;
+}
+
+static inline void StatsBump(std::atomic<std::uint64_t> &v, std::uint64_t n) {
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static inline void StatsAdd(StatCounter counter, std::uint64_t n) {
+    StatsBump(ThreadStats().counters[counter], n);
+}
+
+static inline void StatsPeak(StatPeak peak, std::uint64_t v) {
+    std::atomic<std::uint64_t> &p = ThreadStats().peaks[peak];
+    if (v > p.load(std::memory_order_relaxed)) {
+        p.store(v, std::memory_order_relaxed);
+    }
+}
+
+static inline std::uint64_t StatsNow() {
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Times its stage from construction to destruction, pausing the enclosing
+// scope of the same thread meanwhile
+class StatsScope {
+public:
+    explicit StatsScope(StatStage stage)
+        : stage(stage), parent(nullptr), start(0), active(statsEnabled) {
+        if (!active) {
+            return;
+        }
+        std::uint64_t now = StatsNow();
+        parent = Current();
+        if (parent) {
+            parent->Charge(now);
         }
-        out.push_back(c);
+        start = now;
+        Current() = this;
     }
-    return out;
+
+    ~StatsScope() {
+        if (!active) {
+            return;
+        }
+        std::uint64_t now = StatsNow();
+        Charge(now);
+        Current() = parent;
+        if (parent) {
+            parent->start = now;
+        }
+    }
+
+    StatsScope(const StatsScope &) = delete;
+    StatsScope &operator=(const StatsScope &) = delete;
+
+private:
+    static StatsScope *&Current() {
+        thread_local StatsScope *current = nullptr;
+        return current;
+    }
+
+    void Charge(std::uint64_t now) {
+        StatsBump(ThreadStats().stageNanos[stage], now - start);
+    }
+
+    StatStage stage;
+    StatsScope *parent;
+    std::uint64_t start;
+    bool active;
+};
+
+
+struct StatsTotals {
+    std::uint64_t stageNanos[STAGE_COUNT];
+    std::uint64_t counters[STAT_COUNT];
+    std::uint64_t peaks[PEAK_COUNT];
+};
+
+static void SumStats(StatsTotals &t) {
+    std::memset(&t, 0, sizeof(t));
+    std::lock_guard<std::mutex> lock(statsMutex);
+    for (std::size_t b = 0; b < statsBlocks.size(); ++b) {
+        const StatsBlock &block = *statsBlocks[b];
+        for (int i = 0; i < STAGE_COUNT; ++i) {
+            t.stageNanos[i] += block.stageNanos[i].load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i < STAT_COUNT; ++i) {
+            t.counters[i] += block.counters[i].load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i < PEAK_COUNT; ++i) {
+            std::uint64_t v = block.peaks[i].load(std::memory_order_relaxed);
+            if (v > t.peaks[i]) t.peaks[i] = v;
+        }
+    }
+}
+
+#define STATS_JOIN2(a, b) a##b
+#define STATS_JOIN(a, b) STATS_JOIN2(a, b)
+#define STATS_SCOPE(stage) StatsScope STATS_JOIN(statsScope, __LINE__)(stage)
+#define STATS_ADD(counter, n) \
+    do { if (statsEnabled) StatsAdd(counter, static_cast<std::uint64_t>(n)); } while (0)
+#define STATS_PEAK(peak, v) \
+    do { if (statsEnabled) StatsPeak(peak, static_cast<std::uint64_t>(v)); } while (0)
+#else
+#define STATS_SCOPE(stage) ((void)0)
+#define STATS_ADD(counter, n) ((void)0)
+#define STATS_PEAK(peak, v) ((void)0)
+#endif
+
+// Report on stderr, since stdout may carry the PDF
+static void PrintStats(bool json, double wallSeconds) {
+#if defined(LAYOUT2PDF_NO_STATS)
+    std::fprintf(stderr, "statistics not compiled in (LAYOUT2PDF_NO_STATS)\n");
+    (void)json;
+    (void)wallSeconds;
+#else
+    StatsTotals t;
+    SumStats(t);
+    std::uint64_t busy = 0;
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        busy += t.stageNanos[i];
+    }
+
+    if (json) {
+        std::fprintf(stderr, "{\"wall_seconds\": %.6f, \"busy_seconds\": %.6f, \"stages\": {",
+                     wallSeconds, busy / 1e9);
+        for (int i = 0; i < STAGE_COUNT; ++i) {
+            std::fprintf(stderr, "%s\"%s\": %.6f", i ? ", " : "", stageNames[i],
+                         t.stageNanos[i] / 1e9);
+        }
+        std::fprintf(stderr, "}, \"counters\": {");
+        for (int i = 0; i < STAT_COUNT; ++i) {
+            std::fprintf(stderr, "%s\"%s\": %llu", i ? ", " : "", counterNames[i],
+                         static_cast<unsigned long long>(t.counters[i]));
+        }
+        for (int i = 0; i < PEAK_COUNT; ++i) {
+            std::fprintf(stderr, ", \"%s\": %llu", peakNames[i],
+                         static_cast<unsigned long long>(t.peaks[i]));
+        }
+        std::fprintf(stderr, "}}\n");
+        return;
+    }
+
+    std::fprintf(stderr, "%-18s %10s %7s\n", "stage", "seconds", "share");
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        std::fprintf(stderr, "%-18s %10.6f %6.1f%%\n", stageNames[i], t.stageNanos[i] / 1e9,
+                     busy ? 100.0 * t.stageNanos[i] / busy : 0.0);
+    }
+    std::fprintf(stderr, "%-18s %10.6f\n", "busy (all threads)", busy / 1e9);
+    std::fprintf(stderr, "%-18s %10.6f\n", "wall", wallSeconds);
+    for (int i = 0; i < STAT_COUNT; ++i) {
+        std::fprintf(stderr, "%-18s %10llu\n", counterNames[i],
+                     static_cast<unsigned long long>(t.counters[i]));
+    }
+    for (int i = 0; i < PEAK_COUNT; ++i) {
+        std::fprintf(stderr, "%-18s %10llu\n", peakNames[i],
+                     static_cast<unsigned long long>(t.peaks[i]));
+    }
+    std::uint64_t streams = t.counters[STAT_PAGES] - t.counters[STAT_SHARED_STREAMS];
+    if (streams > 0) {
+        std::fprintf(stderr, "%-18s %10llu\n", "bytes_per_stream",
+                     static_cast<unsigned long long>(t.counters[STAT_STREAM_BYTES] / streams));
+    }
+#endif
+}
+
+// --- Output buffer ---
+// Append-only byte buffer for content streams and PDF objects. Numbers are
+// formatted with std::to_chars, which is locale-free and much cheaper than
+// iostreams. Clear() keeps the allocation, so a buffer reused from page to
+// page stops allocating once it has grown to fit the largest page.
+
+class ByteBuffer {
+public:
+    ByteBuffer() : length(0) {}
+
+    const char *Data() const { return bytes.data(); }
+    char *Data() { return bytes.data(); }
+    std::size_t Size() const { return length; }
+    bool Empty() const { return length == 0; }
+    void Clear() { length = 0; }
+
+    void Swap(ByteBuffer &other) {
+        bytes.swap(other.bytes);
+        std::swap(length, other.length);
+    }
+
+    // Make room for n more bytes and return where they go; Commit(n) after
+    // filling them in.
+    char *Reserve(std::size_t n) {
+        if (length + n > bytes.size()) {
+            std::size_t grown = bytes.size() * 2;
+            if (grown < length + n) grown = length + n;
+            if (grown < 256) grown = 256;
+            bytes.resize(grown);
+            STATS_ADD(STAT_ALLOCATIONS, 1);
+            STATS_PEAK(PEAK_BUFFER, grown);
+        }
+        return bytes.data() + length;
+    }
+
+    void Commit(std::size_t n) { length += n; }
+
+    // Shrink back to n bytes (n <= Size())
+    void Truncate(std::size_t n) { length = n; }
+
+    void Append(const char *data, std::size_t n) {
+        std::memcpy(Reserve(n), data, n);
+        length += n;
+    }
+
+    void Append(const char *str) { Append(str, std::strlen(str)); }
+    void Append(const std::string &str) { Append(str.data(), str.size()); }
+    void Append(const ByteBuffer &other) { Append(other.Data(), other.Size()); }
+
+    void Append(char c) {
+        *Reserve(1) = c;
+        length++;
+    }
+
+    void AppendInt(long v) {
+        char *p = Reserve(24);
+        std::to_chars_result res = std::to_chars(p, p + 24, v);
+        length += static_cast<std::size_t>(res.ptr - p);
+    }
+
+    // A value given in thousandths, written as a PDF real without trailing
+    // zeros (never in exponent form, which PDF does not allow)
+    void AppendMilli(long milli) {
+        if (milli < 0) {
+            Append('-');
+            milli = -milli;
+        }
+        AppendInt(milli / 1000);
+        long frac = milli % 1000;
+        if (frac != 0) {
+            char digits[4] = { '.',
+                               static_cast<char>('0' + frac / 100),
+                               static_cast<char>('0' + frac / 10 % 10),
+                               static_cast<char>('0' + frac % 10) };
+            std::size_t len = 4;
+            while (digits[len - 1] == '0') {
+                len--;
+            }
+            Append(digits, len);
+        }
+    }
+
+    // Zero-padded 10-digit offset for an xref entry
+    void AppendXrefOffset(long v) {
+        char *p = Reserve(10);
+        for (int i = 9; i >= 0; --i) {
+            p[i] = static_cast<char>('0' + v % 10);
+            v /= 10;
+        }
+        length += 10;
+    }
+
+private:
+    std::vector<char> bytes;
+    std::size_t length;
+};
+
+// --- PDF strings ---
+// PDF string operands. Most text needs no escaping at all, which one
+// vectorised pass finds out; it is then copied as is. Otherwise the
+// escaped literal is written, or a hex string when that is shorter (text
+// dense with parentheses, backslashes or control characters). Control
+// characters are always escaped: a raw CR in a literal would read back as
+// a newline.
+
+// Bytes an escape adds to character c in a literal string
+static constexpr std::array<std::uint8_t, 256> MakePdfEscapeExtra() {
+    std::array<std::uint8_t, 256> extra = {};
+    for (int c = 0; c < 256; ++c) {
+        if (c == '(' || c == ')' || c == '\\' || c == '\n' || c == '\r' || c == '\t' ||
+            c == '\b' || c == '\f') {
+            extra[static_cast<std::size_t>(c)] = 1;            // \( \n ...
+        } else if (c < 0x20 || c == 0x7f) {
+            extra[static_cast<std::size_t>(c)] = 3;            // \ddd
+        }
+    }
+    return extra;
+}
+
+static constexpr std::array<std::uint8_t, 256> pdfEscapeExtra = MakePdfEscapeExtra();
+
+// True if any byte of [p, p+n) has to be escaped in a literal string
+static inline bool NeedsEscape(const unsigned char *p, std::size_t n) {
+    std::size_t i = 0;
+#if defined(LAYOUT2PDF_SCAN_AVX2)
+    const __m256i open = _mm256_set1_epi8('('), close = _mm256_set1_epi8(')');
+    const __m256i backslash = _mm256_set1_epi8('\\'), del = _mm256_set1_epi8(0x7f);
+    const __m256i control = _mm256_set1_epi8(0x1f);
+    __m256i any = _mm256_setzero_si256();
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, open), _mm256_cmpeq_epi8(v, close));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, backslash));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, del));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v));
+        any = _mm256_or_si256(any, m);
+    }
+    if (_mm256_movemask_epi8(any) != 0) {
+        return true;
+    }
+#elif defined(LAYOUT2PDF_SCAN_SSE2)
+    const __m128i open = _mm_set1_epi8('('), close = _mm_set1_epi8(')');
+    const __m128i backslash = _mm_set1_epi8('\\'), del = _mm_set1_epi8(0x7f);
+    const __m128i control = _mm_set1_epi8(0x1f);
+    __m128i any = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, open), _mm_cmpeq_epi8(v, close));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, backslash));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, del));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+        any = _mm_or_si128(any, m);
+    }
+    if (_mm_movemask_epi8(any) != 0) {
+        return true;
+    }
+#elif defined(LAYOUT2PDF_SCAN_NEON)
+    uint8x16_t any = vdupq_n_u8(0);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(p + i);
+        uint8x16_t m = vorrq_u8(vceqq_u8(v, vdupq_n_u8('(')), vceqq_u8(v, vdupq_n_u8(')')));
+        m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\\')));
+        m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(0x7f)));
+        m = vorrq_u8(m, vcleq_u8(v, vdupq_n_u8(0x1f)));
+        any = vorrq_u8(any, m);
+    }
+    if (vmaxvq_u8(any) != 0) {
+        return true;
+    }
+#endif
+    std::uint8_t extra = 0;
+    for (; i < n; ++i) {
+        extra |= pdfEscapeExtra[p[i]];
+    }
+    return extra != 0;
+}
+
+// Write [src, src+n) as a string operand, delimiters included, to dst,
+// which must have room for 2n + 2 bytes; returns the length written
+static std::size_t WritePdfString(const unsigned char *src, std::size_t n, char *dst) {
+    std::size_t extra = 0;
+    if (NeedsEscape(src, n)) {
+        for (std::size_t i = 0; i < n; ++i) {
+            extra += pdfEscapeExtra[src[i]];
+        }
+    }
+    char *q = dst;
+    if (extra > n) {
+        static const char hex[] = "0123456789ABCDEF";
+        *q++ = '<';
+        for (std::size_t i = 0; i < n; ++i) {
+            q[0] = hex[src[i] >> 4];
+            q[1] = hex[src[i] & 0xf];
+            q += 2;
+        }
+        *q++ = '>';
+        return static_cast<std::size_t>(q - dst);
+    }
+    *q++ = '(';
+    if (extra == 0) {
+        if (n > 0) {
+            std::memcpy(q, src, n);
+        }
+        q += n;
+    } else {
+        for (std::size_t i = 0; i < n; ++i) {
+            const unsigned char c = src[i];
+            const std::uint8_t e = pdfEscapeExtra[c];
+            if (e == 0) {
+                *q++ = static_cast<char>(c);
+            } else if (e == 1) {
+                q[0] = '\\';
+                q[1] = c == '\n' ? 'n' : c == '\r' ? 'r' : c == '\t' ? 't' : c == '\b' ? 'b'
+                     : c == '\f' ? 'f' : static_cast<char>(c);
+                q += 2;
+            } else {
+                q[0] = '\\';
+                q[1] = static_cast<char>('0' + (c >> 6));
+                q[2] = static_cast<char>('0' + (c >> 3 & 7));
+                q[3] = static_cast<char>('0' + (c & 7));
+                q += 4;
+            }
+        }
+    }
+    *q++ = ')';
+    return static_cast<std::size_t>(q - dst);
+}
+
+// text as a PDF string operand, ( ) or < > included
+static void AppendPdfString(ByteBuffer &out, std::string_view text) {
+    char *dst = out.Reserve(2 * text.size() + 2);
+    out.Commit(WritePdfString(reinterpret_cast<const unsigned char *>(text.data()), text.size(), dst));
 }
 
 // --- Layout structs ---
@@ -68,43 +599,154 @@ enum TextAlign {
     ALIGN_RIGHT
 };
 
-struct LineSpec {
-    std::string text;
+struct TextStyle {
     int fontSize;
     float r;
     float g;
     float b;
     TextAlign align;
-    bool bottomAnchor;   // NEW: true = anchor near bottom of page
+    bool bottomAnchor;   // true = anchor near bottom of page
+
+    bool operator==(const TextStyle &o) const {
+        return fontSize == o.fontSize && r == o.r && g == o.g && b == o.b &&
+               align == o.align && bottomAnchor == o.bottomAnchor;
+    }
 };
 
-struct PageSpec {
-    std::vector<LineSpec> lines;
+// Named colors, found through a perfect hash of the lowercased name: its
+// first and second-to-last characters and its length pick one of 16 slots,
+// and the static_assert below keeps the names from colliding
+struct NamedColor {
+    const char *name;
+    float r, g, b;
 };
 
-// Map color names to RGB
-static void ColorFromName(const std::string &name, float &r, float &g, float &b) {
-    std::string n = ToLower(Trim(name));
-    if (n == "black") {
-        r = 0.0f; g = 0.0f; b = 0.0f;
-    } else if (n == "white") {
-        r = 1.0f; g = 1.0f; b = 1.0f;
-    } else if (n == "red") {
-        r = 1.0f; g = 0.0f; b = 0.0f;
-    } else if (n == "green") {
-        r = 0.0f; g = 1.0f; b = 0.0f;
-    } else if (n == "blue") {
-        r = 0.0f; g = 0.0f; b = 1.0f;
-    } else if (n == "gray" || n == "grey") {
-        r = 0.5f; g = 0.5f; b = 0.5f;
+static constexpr NamedColor namedColors[] = {
+    { "black", 0.0f, 0.0f, 0.0f },
+    { "white", 1.0f, 1.0f, 1.0f },
+    { "red",   1.0f, 0.0f, 0.0f },
+    { "green", 0.0f, 1.0f, 0.0f },
+    { "blue",  0.0f, 0.0f, 1.0f },
+    { "gray",  0.5f, 0.5f, 0.5f },
+    { "grey",  0.5f, 0.5f, 0.5f },
+};
+
+static const std::size_t colorSlotCount = 16;
+static const std::size_t maxColorName = 8;
+
+static constexpr std::size_t ColorSlot(const char *name, std::size_t n) {
+    return (static_cast<unsigned char>(name[0]) + 3u * static_cast<unsigned char>(name[n - 2]) + n) %
+           colorSlotCount;
+}
+
+struct ColorSlots {
+    const NamedColor *slot[colorSlotCount];
+    bool perfect;
+};
+
+static constexpr ColorSlots MakeColorSlots() {
+    ColorSlots slots = {};
+    slots.perfect = true;
+    for (const NamedColor &c : namedColors) {
+        std::size_t n = 0;
+        while (c.name[n] != '\0') {
+            n++;
+        }
+        std::size_t h = ColorSlot(c.name, n);
+        if (slots.slot[h] != nullptr || n < 2 || n > maxColorName) {
+            slots.perfect = false;
+        }
+        slots.slot[h] = &c;
+    }
+    return slots;
+}
+
+static constexpr ColorSlots colorSlots = MakeColorSlots();
+static_assert(colorSlots.perfect, "color names must hash to distinct slots");
+
+static int HexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// #rgb or #rrggbb
+static bool ColorFromHex(std::string_view hex, float &r, float &g, float &b) {
+    int v[6];
+    if (hex.size() != 3 && hex.size() != 6) {
+        return false;
+    }
+    for (std::size_t i = 0; i < hex.size(); ++i) {
+        v[i] = HexDigit(hex[i]);
+        if (v[i] < 0) {
+            return false;
+        }
+    }
+    if (hex.size() == 3) {
+        r = v[0] * 17 / 255.0f;
+        g = v[1] * 17 / 255.0f;
+        b = v[2] * 17 / 255.0f;
     } else {
-        // default to black
-        r = 0.0f; g = 0.0f; b = 0.0f;
+        r = (v[0] * 16 + v[1]) / 255.0f;
+        g = (v[2] * 16 + v[3]) / 255.0f;
+        b = (v[4] * 16 + v[5]) / 255.0f;
+    }
+    return true;
+}
+
+// rgb(R, G, B) with components 0-255
+static bool ColorFromRgb(std::string_view args, float &r, float &g, float &b) {
+    float *out[3] = { &r, &g, &b };
+    std::size_t start = 0;
+    for (int i = 0; i < 3; ++i) {
+        std::size_t end = i < 2 ? args.find(',', start) : args.size();
+        if (end == std::string_view::npos) {
+            return false;
+        }
+        std::string_view part = Trim(args.substr(start, end - start));
+        int v = -1;
+        std::from_chars_result res = std::from_chars(part.data(), part.data() + part.size(), v);
+        if (part.empty() || res.ptr != part.data() + part.size() || v < 0 || v > 255) {
+            return false;
+        }
+        *out[i] = v / 255.0f;
+        start = end + 1;
+    }
+    return true;
+}
+
+// Map a color name, #rgb, #rrggbb or rgb(R, G, B) to RGB; anything else is
+// black
+static void ColorFromName(std::string_view name, float &r, float &g, float &b) {
+    r = 0.0f; g = 0.0f; b = 0.0f;
+    name = Trim(name);
+    if (!name.empty() && name[0] == '#') {
+        ColorFromHex(name.substr(1), r, g, b);
+        return;
+    }
+    if (name.size() > 5 && name.back() == ')' && ToLower(name.substr(0, 4)) == "rgb(") {
+        if (!ColorFromRgb(name.substr(4, name.size() - 5), r, g, b)) {
+            r = 0.0f; g = 0.0f; b = 0.0f;
+        }
+        return;
+    }
+    if (name.size() < 2 || name.size() > maxColorName) {
+        return;
+    }
+    char lower[maxColorName];
+    for (std::size_t i = 0; i < name.size(); ++i) {
+        lower[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(name[i])));
+    }
+    const NamedColor *c = colorSlots.slot[ColorSlot(lower, name.size())];
+    if (c && std::strlen(c->name) == name.size() &&
+        std::memcmp(c->name, lower, name.size()) == 0) {
+        r = c->r; g = c->g; b = c->b;
     }
 }
 
 // Map alignment name
-static TextAlign AlignFromName(const std::string &name) {
+static TextAlign AlignFromName(std::string_view name) {
     std::string n = ToLower(Trim(name));
     if (n == "center") {
         return ALIGN_CENTER;
@@ -114,381 +756,7141 @@ static TextAlign AlignFromName(const std::string &name) {
     return ALIGN_LEFT;
 }
 
-// --- Parse layout file into pages/lines ---
-static bool ParseLayoutFile(const std::string &filename, std::vector<PageSpec> &pages) {
-    std::ifstream in(filename.c_str());
-    if (!in) {
-        std::cerr << "Failed to open layout file: " << filename << "\n";
-        return false;
+// Style from the parameters of a directive: size, color, align, [bottom].
+// No parameters gives the default style.
+static TextStyle ParseStyle(std::string_view params) {
+    TextStyle style;
+    style.fontSize = 12;
+    style.r = 0.0f; style.g = 0.0f; style.b = 0.0f;
+    style.align = ALIGN_LEFT;
+    style.bottomAnchor = false;
+    if (params.empty()) {
+        return style;
     }
 
-    std::string raw;
-    bool inPage = false;
-    PageSpec currentPage;
-
-    int currentFontSize = 12;
-    float currentR = 0.0f, currentG = 0.0f, currentB = 0.0f;
-    TextAlign currentAlign = ALIGN_LEFT;
-    bool currentBottomAnchor = false;   // NEW
-
-    while (std::getline(in, raw)) {
-        // strip inline comments
-        std::size_t commentPos = raw.find("//");
-        std::string beforeComment = (commentPos == std::string::npos)
-                                    ? raw
-                                    : raw.substr(0, commentPos);
-
-        std::string line = Trim(beforeComment);
+    std::vector<std::string_view> parts = SplitByComma(params);
+    if (parts.size() >= 1) {
+        style.fontSize = 0;
+        std::from_chars(parts[0].data(), parts[0].data() + parts[0].size(), style.fontSize);
+        if (style.fontSize <= 0) style.fontSize = 12;
+    }
+    if (parts.size() >= 2) {
+        ColorFromName(parts[1], style.r, style.g, style.b);
+    }
+    if (parts.size() >= 3) {
+        style.align = AlignFromName(parts[2]);
+    }
+    // optional 4th parameter: "bottom"
+    if (parts.size() >= 4) {
+        style.bottomAnchor = (ToLower(parts[3]) == "bottom");
+    }
+    return style;
+}
 
-        // --- handle blank lines for spacing ---
-        if (line.empty()) {
-            bool isPureComment = (commentPos != std::string::npos) &&
-                                 Trim(beforeComment).empty();
-
-            if (inPage && !isPureComment) {
-                LineSpec ls;
-                ls.text = "";
-                ls.fontSize = currentFontSize;
-                ls.r = currentR;
-                ls.g = currentG;
-                ls.b = currentB;
-                ls.align = currentAlign;
-                ls.bottomAnchor = currentBottomAnchor; // respect mode
-                currentPage.lines.push_back(ls);
-            }
-            continue;
+struct TextStyleHasher {
+    std::size_t operator()(const TextStyle &s) const {
+        std::uint32_t bits[3];
+        std::memcpy(&bits[0], &s.r, 4);
+        std::memcpy(&bits[1], &s.g, 4);
+        std::memcpy(&bits[2], &s.b, 4);
+        std::uint64_t h = static_cast<std::uint32_t>(s.fontSize) |
+                          static_cast<std::uint64_t>(s.align) << 32 |
+                          static_cast<std::uint64_t>(s.bottomAnchor) << 34;
+        for (int i = 0; i < 3; ++i) {
+            h = (h ^ bits[i]) * 0x9e3779b97f4a7c15ull;
+            h ^= h >> 29;
         }
+        return static_cast<std::size_t>(h);
+    }
+};
 
-        // Page directive or closing tag
-        if (line.size() > 0 && line[0] == '[') {
-            if (line.size() > 1 && line[1] == '/') {
-                // Closing tag [/pageX]
-                if (inPage) {
-                    pages.push_back(currentPage);
-                    currentPage.lines.clear();
-                    inPage = false;
-                }
-                continue;
-            } else {
-                // Opening or style change: [pageX] size, color, align, [bottom]
-                std::size_t closePos = line.find(']');
-                if (closePos == std::string::npos) {
-                    continue; // malformed, skip
-                }
-
-                std::string params;
-                if (closePos + 1 < line.size()) {
-                    params = Trim(line.substr(closePos + 1));
-                }
+// Every distinct style of a document, stored once; lines refer to them by
+// a 16-bit index. Directives are also remembered by their parameter text,
+// so a directive seen before costs one hash lookup instead of a parse.
+// Entries never move, so references to them last until Clear().
+class StyleTable {
+public:
+    static const std::size_t maxStyles = 65536;
 
-                // Start a new page if not already in one
-                if (!inPage) {
-                    inPage = true;
-                    currentPage.lines.clear();
-                }
+    StyleTable() : count(0) {}
 
-                // Reset / update style
-                if (!params.empty()) {
-                    std::vector<std::string> parts = SplitByComma(params);
+    // Index of the style a directive's parameters give; false when the
+    // table is full
+    bool FromDirective(std::string_view params, std::uint16_t &index) {
+        probe.assign(params.data(), params.size());
+        auto known = byDirective.find(probe);
+        if (known != byDirective.end()) {
+            index = known->second;
+            return true;
+        }
 
-                    if (parts.size() >= 1) {
-                        currentFontSize = std::atoi(parts[0].c_str());
-                        if (currentFontSize <= 0) currentFontSize = 12;
-                    }
-                    if (parts.size() >= 2) {
-                        ColorFromName(parts[1], currentR, currentG, currentB);
-                    } else {
-                        ColorFromName("black", currentR, currentG, currentB);
-                    }
-                    if (parts.size() >= 3) {
-                        currentAlign = AlignFromName(parts[2]);
-                    } else {
-                        currentAlign = ALIGN_LEFT;
-                    }
-                    // NEW: optional 4th parameter: "bottom"
-                    if (parts.size() >= 4) {
-                        std::string pos = ToLower(Trim(parts[3]));
-                        currentBottomAnchor = (pos == "bottom");
-                    } else {
-                        currentBottomAnchor = false;
-                    }
-                } else {
-                    // No params, default style (optional)
-                    currentFontSize = 12;
-                    ColorFromName("black", currentR, currentG, currentB);
-                    currentAlign = ALIGN_LEFT;
-                    currentBottomAnchor = false;
-                }
-                continue;
-            }
+        if (!Intern(ParseStyle(params), index)) {
+            return false;
         }
+        byDirective.emplace(probe, index);
+        return true;
+    }
 
-        // Regular text line
-        if (inPage) {
-            LineSpec ls;
-            ls.text = line;
-            ls.fontSize = currentFontSize;
-            ls.r = currentR;
-            ls.g = currentG;
-            ls.b = currentB;
-            ls.align = currentAlign;
-            ls.bottomAnchor = currentBottomAnchor;
-            currentPage.lines.push_back(ls);
+    // Index of style, adding it if it is new; false when the table is full
+    bool Intern(const TextStyle &style, std::uint16_t &index) {
+        auto it = byValue.find(style);
+        if (it != byValue.end()) {
+            index = it->second;
+            return true;
         }
+        if (count == maxStyles) {
+            return false;
+        }
+        if (count % chunkSize == 0 && count / chunkSize == chunks.size()) {
+            chunks.emplace_back(new TextStyle[chunkSize]);
+        }
+        index = static_cast<std::uint16_t>(count);
+        chunks[count / chunkSize][count % chunkSize] = style;
+        count++;
+        byValue.emplace(style, index);
+        return true;
     }
 
-    if (inPage && !currentPage.lines.empty()) {
-        pages.push_back(currentPage);
+    const TextStyle &Get(std::uint16_t index) const {
+        return chunks[index / chunkSize][index % chunkSize];
     }
 
-    return true;
-}
+    std::size_t Size() const {
+        return count;
+    }
 
-// --- Build PDF content stream for one page ---
-static std::string BuildPageContent(const PageSpec &page) {
-    const float pageWidth  = 612.0f;  // 8.5" at 72 dpi
-    const float pageHeight = 792.0f;  // 11"
-    const float leftMargin   = 72.0f;
-    const float rightMargin  = 72.0f;
-    const float topMarginY   = 750.0f;  // starting Y for top text
-    const float bottomMarginY = 72.0f;  // base margin for footer
+    bool Full() const {
+        return count == maxStyles;
+    }
 
-    const float usableWidth = pageWidth - leftMargin - rightMargin;
+    // Keeps the chunks for the next document
+    void Clear() {
+        count = 0;
+        byValue.clear();
+        byDirective.clear();
+    }
 
-    struct PositionedLine {
-        LineSpec ls;
-        float x;
-        float y;
-    };
+private:
+    static const std::size_t chunkSize = 256;
+
+    // Fixed-size chunks, so entries never move and lookups are a shift and
+    // a mask
+    std::vector<std::unique_ptr<TextStyle[]> > chunks;
+    std::size_t count;
+    std::unordered_map<TextStyle, std::uint16_t, TextStyleHasher> byValue;
+    std::unordered_map<std::string, std::uint16_t> byDirective;
+    std::string probe;       // lookup key, reused to avoid allocating
+};
 
-    std::vector<PositionedLine> positioned;
-    positioned.reserve(page.lines.size());
+// Owns line text in a few large blocks. Blocks never move, so views into
+// them stay valid when the owning page is moved; Clear() keeps the blocks
+// for reuse.
+class TextArena {
+public:
+    TextArena() : current(0), used(0) {}
 
-    auto computeX = [&](const LineSpec &ls, float textWidth) -> float {
-        float x = leftMargin;
-        if (ls.align == ALIGN_CENTER) {
-            x = (pageWidth - textWidth) / 2.0f;
-            if (x < leftMargin) x = leftMargin;
-        } else if (ls.align == ALIGN_RIGHT) {
-            x = pageWidth - rightMargin - textWidth;
-            if (x < leftMargin) x = leftMargin;
+    std::string_view Store(std::string_view s) {
+        if (s.empty()) {
+            return std::string_view();
         }
-        return x;
-    };
-
-    // --- Separate into top lines and bottom-anchored lines ---
-    std::vector<const LineSpec*> topLines;
-    std::vector<const LineSpec*> bottomLines;
+        while (current < blocks.size() && used + s.size() > blocks[current].size) {
+            current++;
+            used = 0;
+        }
+        if (current == blocks.size()) {
+            Block block;
+            block.size = s.size() > blockSize ? s.size() : blockSize;
+            block.data.reset(new char[block.size]);
+            STATS_ADD(STAT_ALLOCATIONS, 1);
+            blocks.push_back(std::move(block));
+            used = 0;
+        }
+        char *dst = blocks[current].data.get() + used;
+        std::memcpy(dst, s.data(), s.size());
+        used += s.size();
+        return std::string_view(dst, s.size());
+    }
 
-    for (std::size_t i = 0; i < page.lines.size(); ++i) {
-        const LineSpec &ls = page.lines[i];
-        if (ls.bottomAnchor) bottomLines.push_back(&ls);
-        else                 topLines.push_back(&ls);
+    void Clear() {
+        current = 0;
+        used = 0;
     }
 
-    // --- Layout top lines from topMargin down ---
-    float yTop = topMarginY;
-    for (std::size_t i = 0; i < topLines.size(); ++i) {
-        const LineSpec &ls = *topLines[i];
+private:
+    static const std::size_t blockSize = 16 * 1024;
 
-        float approxCharWidth = static_cast<float>(ls.fontSize) * 0.5f;
-        float textWidth = approxCharWidth * static_cast<float>(ls.text.size());
+    struct Block {
+        std::unique_ptr<char[]> data;
+        std::size_t size;
+    };
 
-        float x = computeX(ls, textWidth);
+    std::vector<Block> blocks;
+    std::size_t current;
+    std::size_t used;
+};
 
-        PositionedLine pl;
-        pl.ls = ls;
-        pl.x = x;
-        pl.y = yTop;
-        positioned.push_back(pl);
+// One line of a page, in 16 bytes. Text lives in the page's arena, or
+// directly in the mapped layout file when the reader is Stable(). style
+// indexes the document's StyleTable. A [use NAME] line has no text and
+// refers to a fragment instead.
+struct LineSpec {
+    const char *textData;
+    std::uint32_t textLength;
+    std::uint16_t style;
+    std::uint16_t fragment;  // 0, or 1 + index into the FragmentTable
 
-        // Move down for next line (even if text is empty)
-        yTop -= static_cast<float>(ls.fontSize + 4);
+    std::string_view Text() const {
+        return std::string_view(textData, textLength);
     }
+};
 
-    // --- Layout bottom lines from bottomMargin up ---
-    float yBottom = bottomMarginY;
-    // Process in reverse so the last footer line in the file appears closest to the bottom
-    for (int i = static_cast<int>(bottomLines.size()) - 1; i >= 0; --i) {
-        const LineSpec &ls = *bottomLines[static_cast<std::size_t>(i)];
-
-        float approxCharWidth = static_cast<float>(ls.fontSize) * 0.5f;
-        float textWidth = approxCharWidth * static_cast<float>(ls.text.size());
+struct PageSpec {
+    PageSpec() : styleTable(nullptr) {}
 
-        float x = computeX(ls, textWidth);
+    std::vector<LineSpec> lines;
+    const StyleTable *styleTable;   // of the document the page belongs to
+    TextArena arena;
 
-        PositionedLine pl;
-        pl.ls = ls;
-        pl.x = x;
-        pl.y = yBottom;
-        positioned.push_back(pl);
+    const TextStyle &StyleOf(const LineSpec &ls) const {
+        return styleTable->Get(ls.style);
+    }
 
-        yBottom += static_cast<float>(ls.fontSize + 4);
+    void Clear() {
+        lines.clear();
+        arena.Clear();
     }
+};
 
-    // --- Emit PDF text operators ---
+// Lines of text at their final positions, one array per field, so each
+// pass over them reads only what it needs; text may be part of a wrapped
+// line. Clear() keeps the capacity, so a reused buffer stops allocating.
+struct LineBuffer {
+    std::vector<const char *> text;
+    std::vector<std::uint32_t> length;
+    std::vector<std::uint16_t> style;   // StyleTable index
+    std::vector<std::uint8_t> align;    // TextAlign of the style
+    std::vector<float> x;               // the text's width until AlignLines
+    std::vector<float> y;
 
-    std::ostringstream out;
-    out << "BT\n";
+    std::size_t Size() const {
+        return y.size();
+    }
 
-    for (std::size_t i = 0; i < positioned.size(); ++i) {
-        const PositionedLine &pl = positioned[i];
-        const LineSpec &ls = pl.ls;
+    bool Empty() const {
+        return y.empty();
+    }
 
-        out << "/F1 " << ls.fontSize << " Tf\n";
-        out << ls.r << " " << ls.g << " " << ls.b << " rg\n";
-        out << "1 0 0 1 " << pl.x << " " << pl.y << " Tm\n";
+    std::string_view Text(std::size_t i) const {
+        return std::string_view(text[i], length[i]);
+    }
 
-        std::string escaped = EscapePdfString(ls.text);
-        out << "(" << escaped << ") Tj\n";
+    void Push(std::string_view t, std::uint16_t styleIndex, TextAlign a, float width, float py) {
+        text.push_back(t.data());
+        length.push_back(static_cast<std::uint32_t>(t.size()));
+        style.push_back(styleIndex);
+        align.push_back(static_cast<std::uint8_t>(a));
+        x.push_back(width);
+        y.push_back(py);
     }
 
-    out << "ET\n";
-    return out.str();
-}
+    void Push(const LineBuffer &from, std::size_t i) {
+        text.push_back(from.text[i]);
+        length.push_back(from.length[i]);
+        style.push_back(from.style[i]);
+        align.push_back(from.align[i]);
+        x.push_back(from.x[i]);
+        y.push_back(from.y[i]);
+    }
 
-// --- Main: assemble full PDF from pages ---
+    void Append(const LineBuffer &from) {
+        text.insert(text.end(), from.text.begin(), from.text.end());
+        length.insert(length.end(), from.length.begin(), from.length.end());
+        style.insert(style.end(), from.style.begin(), from.style.end());
+        align.insert(align.end(), from.align.begin(), from.align.end());
+        x.insert(x.end(), from.x.begin(), from.x.end());
+        y.insert(y.end(), from.y.begin(), from.y.end());
+    }
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        std::cerr << "Usage: layout2pdf <filename>\n";
-        return 1;
+    void Clear() {
+        text.clear();
+        length.clear();
+        style.clear();
+        align.clear();
+        x.clear();
+        y.clear();
     }
+};
 
-    std::string layoutFile = argv[1];
-    std::string outputFile = layoutFile + ".pdf";
+// A named block of lines, defined once per document with [fragment NAME]
+// and placed on pages with [use NAME]. It is laid out once and drawn from a
+// Form XObject; only lines with a {page} field are drawn on each page.
+// Positions are relative to the fragment's origin: the first line's
+// baseline for a top-flow fragment, the last line's for a bottom-anchored
+// one.
+struct Fragment {
+    std::string name;
+    int id;                   // index in the table, also its resource name /Fr<id>
+    PageSpec spec;
+    bool bottomAnchor;        // from the style the fragment opens with
 
-    layoutFile += ".txt";
+    // Filled in by LayoutFragment
+    bool laidOut;
+    LineBuffer fixed;         // drawn by the XObject
+    LineBuffer fields;        // drawn per page; x is recomputed
+    float height;             // vertical space taken on the page
+    float lastStep;           // step of the last line, which ends height
+    float minY, maxY;         // extent, for the XObject's /BBox
+    int objNum;
+};
 
-    std::vector<PageSpec> pages;
-    if (!ParseLayoutFile(layoutFile, pages)) {
-        return 1;
-    }
+class FragmentTable {
+public:
+    // LineSpec::fragment holds 1 + the index in 16 bits
+    static const std::size_t maxFragments = 65535;
 
-    if (pages.empty()) {
-        std::cerr << "No pages parsed from layout file.\n";
-        return 1;
+    Fragment &Add(std::string_view name) {
+        items.emplace_back(new Fragment());
+        Fragment &f = *items.back();
+        f.name.assign(name.data(), name.size());
+        f.id = static_cast<int>(items.size()) - 1;
+        f.bottomAnchor = false;
+        f.laidOut = false;
+        f.height = 0.0f;
+        f.lastStep = 0.0f;
+        f.minY = 0.0f;
+        f.maxY = 0.0f;
+        f.objNum = 0;
+        return f;
     }
 
-    // Prepare PDF objects
-    std::vector<std::string> objects;
-    objects.push_back(""); // dummy index 0
+    // Latest definition of name, or -1
+    int Find(std::string_view name) const {
+        for (std::size_t i = items.size(); i-- > 0;) {
+            if (items[i]->name == name) {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    std::size_t Size() const {
+        return items.size();
+    }
+
+    bool Full() const {
+        return items.size() == maxFragments;
+    }
+
+    // Move fragments [begin, end) of other to the end, renumbering them.
+    // Moved entries of other are left empty, so only Clear() it afterwards.
+    void Append(FragmentTable &other, std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            items.push_back(std::move(other.items[i]));
+            items.back()->id = static_cast<int>(items.size()) - 1;
+        }
+    }
+
+    Fragment &Get(std::size_t i) {
+        return *items[i];
+    }
+
+    const Fragment &Get(std::size_t i) const {
+        return *items[i];
+    }
+
+    void Clear() {
+        items.clear();
+    }
+
+private:
+    std::vector<std::unique_ptr<Fragment> > items;
+};
+
+// --- Line scanner ---
+// Splits a block of layout text into lines in one vectorised pass. Each
+// 64-byte chunk is classified into a newline mask and a '/' mask; walking
+// the set bits yields line ends and the first "//" of every line, and the
+// leading '[' check only looks at a line's first non-blank byte.
+
+enum {
+    LINE_DIRECTIVE = 1   // first non-blank byte before any comment is '['
+};
+
+struct LineRecord {
+    std::uint32_t begin;    // offset from the start of the scanned block
+    std::uint32_t length;   // excluding the newline
+    std::uint32_t comment;  // offset of "//" within the line, or length
+    std::uint32_t flags;    // LINE_* bits
+};
+
+static inline int LowestBit(std::uint64_t v) {
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanForward64(&idx, v);
+    return static_cast<int>(idx);
+#else
+    return __builtin_ctzll(v);
+#endif
+}
+
+#if defined(LAYOUT2PDF_SCAN_NEON)
+// movemask for one 16-byte compare result
+static inline std::uint64_t NeonMask16(uint8x16_t cmp) {
+    static const std::uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+                                              1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t bits = vandq_u8(cmp, vld1q_u8(weights));
+    std::uint64_t lo = vaddv_u8(vget_low_u8(bits));
+    std::uint64_t hi = vaddv_u8(vget_high_u8(bits));
+    return lo | (hi << 8);
+}
+#endif
+
+// Bit i of newlines/slashes is set when p[i] is '\n' / '/'
+static inline void ClassifyChunk(const char *p, std::uint64_t &newlines, std::uint64_t &slashes) {
+#if defined(LAYOUT2PDF_SCAN_AVX2)
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i sl = _mm256_set1_epi8('/');
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32));
+    newlines = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl))) |
+               (static_cast<std::uint64_t>(static_cast<std::uint32_t>(
+                    _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl)))) << 32);
+    slashes = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, sl))) |
+              (static_cast<std::uint64_t>(static_cast<std::uint32_t>(
+                   _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, sl)))) << 32);
+#elif defined(LAYOUT2PDF_SCAN_SSE2)
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i sl = _mm_set1_epi8('/');
+    newlines = 0;
+    slashes = 0;
+    for (int i = 0; i < 4; ++i) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * i));
+        newlines |= static_cast<std::uint64_t>(
+            static_cast<std::uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)))) << (16 * i);
+        slashes |= static_cast<std::uint64_t>(
+            static_cast<std::uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, sl)))) << (16 * i);
+    }
+#elif defined(LAYOUT2PDF_SCAN_NEON)
+    const uint8x16_t nl = vdupq_n_u8('\n');
+    const uint8x16_t sl = vdupq_n_u8('/');
+    newlines = 0;
+    slashes = 0;
+    for (int i = 0; i < 4; ++i) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const std::uint8_t *>(p + 16 * i));
+        newlines |= NeonMask16(vceqq_u8(v, nl)) << (16 * i);
+        slashes |= NeonMask16(vceqq_u8(v, sl)) << (16 * i);
+    }
+#else
+    newlines = 0;
+    slashes = 0;
+    for (int i = 0; i < 64; ++i) {
+        newlines |= static_cast<std::uint64_t>(p[i] == '\n') << i;
+        slashes |= static_cast<std::uint64_t>(p[i] == '/') << i;
+    }
+#endif
+}
+
+static inline void PushLine(const char *data, std::size_t begin, std::size_t end,
+                            std::size_t comment, std::vector<LineRecord> &index) {
+    LineRecord rec;
+    rec.begin = static_cast<std::uint32_t>(begin);
+    rec.length = static_cast<std::uint32_t>(end - begin);
+    rec.comment = static_cast<std::uint32_t>((comment < end ? comment : end) - begin);
+    rec.flags = 0;
+    std::size_t first = begin;
+    std::size_t stop = begin + rec.comment;
+    while (first < stop && IsSpace(data[first])) {
+        first++;
+    }
+    if (first < stop && data[first] == '[') {
+        rec.flags |= LINE_DIRECTIVE;
+    }
+    index.push_back(rec);
+}
+
+// Append a record for every newline-terminated line in [data, data+size) to
+// index, plus the unterminated tail when final is set. Returns the number of
+// bytes covered by the records.
+static std::size_t ScanLines(const char *data, std::size_t size, bool final,
+                             std::vector<LineRecord> &index) {
+    const std::size_t none = static_cast<std::size_t>(-1);
+    std::size_t lineStart = 0;
+    std::size_t comment = none;
+    std::uint64_t prevSlash = 0;   // last byte of the previous chunk was '/'
+
+    for (std::size_t base = 0; base < size; base += 64) {
+        std::uint64_t newlines, slashes;
+        if (size - base >= 64) {
+            ClassifyChunk(data + base, newlines, slashes);
+        } else {
+            char tail[64] = { 0 };
+            std::memcpy(tail, data + base, size - base);
+            ClassifyChunk(tail, newlines, slashes);
+        }
+
+        // Bit i set: bytes i-1 and i are both '/'
+        std::uint64_t pairs = slashes & ((slashes << 1) | prevSlash);
+        prevSlash = slashes >> 63;
+
+        std::uint64_t events = newlines | pairs;
+        while (events) {
+            int bit = LowestBit(events);
+            events &= events - 1;
+            std::size_t pos = base + static_cast<std::size_t>(bit);
+            if (newlines & (static_cast<std::uint64_t>(1) << bit)) {
+                PushLine(data, lineStart, pos, comment, index);
+                lineStart = pos + 1;
+                comment = none;
+            } else if (comment == none) {
+                comment = pos - 1;
+            }
+        }
+    }
+
+    if (final && lineStart < size) {
+        PushLine(data, lineStart, size, comment, index);
+        lineStart = size;
+    }
+    return lineStart;
+}
+
+// True when no byte of [p, p+n) has the high bit set, i.e. the text is
+// plain ASCII and needs no UTF-8 decoding. Lines are short, so the vectors
+// are ORed together and tested once rather than branching on each.
+static inline bool IsAscii(const char *p, std::size_t n) {
+    std::size_t i = 0;
+#if defined(LAYOUT2PDF_SCAN_AVX2)
+    __m256i any = _mm256_setzero_si256();
+    for (; i + 32 <= n; i += 32) {
+        any = _mm256_or_si256(any, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i)));
+    }
+    if (_mm256_movemask_epi8(any) != 0) {
+        return false;
+    }
+#elif defined(LAYOUT2PDF_SCAN_SSE2)
+    __m128i any = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        any = _mm_or_si128(any, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i)));
+    }
+    if (_mm_movemask_epi8(any) != 0) {
+        return false;
+    }
+#elif defined(LAYOUT2PDF_SCAN_NEON)
+    uint8x16_t any = vdupq_n_u8(0);
+    for (; i + 16 <= n; i += 16) {
+        any = vorrq_u8(any, vld1q_u8(reinterpret_cast<const std::uint8_t *>(p + i)));
+    }
+    if (vmaxvq_u8(any) >= 0x80) {
+        return false;
+    }
+#endif
+    std::uint64_t high = 0;
+    for (; i + 8 <= n; i += 8) {
+        std::uint64_t w;
+        std::memcpy(&w, p + i, 8);
+        high |= w;
+    }
+    for (; i < n; ++i) {
+        high |= static_cast<unsigned char>(p[i]);
+    }
+    return (high & 0x8080808080808080ULL) == 0;
+}
+
+// --- Layout input ---
+// Hands out the layout one line at a time as views, with the comment and
+// directive positions found by the line scanner. Regular files are
+// memory-mapped and scanned in place, so line views stay valid for the
+// reader's lifetime and never need copying. Anything that cannot be mapped
+// (pipes, special files) is read through a buffer, and its views are only
+// valid until the buffer is refilled.
+
+struct LayoutLine {
+    std::string_view text;
+    std::size_t commentPos;   // start of "//", or npos
+    bool directive;           // starts with '[' (after blanks)
+};
+
+class LayoutReader {
+public:
+    LayoutReader()
+        : mapData(nullptr), mapSize(0), mapSkip(0), pos(0), mapped(false), borrowed(false),
+          file(nullptr), bufStart(0), bufEnd(0), eof(false),
+          indexBase(nullptr), indexPos(0) {}
+
+    ~LayoutReader() {
+        Close();
+    }
+
+    // Release the current input; buffers keep their capacity, so a reader
+    // can be reopened for the next document
+    void Close() {
+#ifdef LAYOUT2PDF_HAVE_MMAP
+        if (mapped && !borrowed && mapSize + mapSkip > 0) {
+            munmap(const_cast<char *>(mapData - mapSkip), mapSize + mapSkip);
+        }
+#endif
+        if (file && file != stdin) {
+            std::fclose(file);
+        }
+        borrowed = false;
+        mapData = nullptr;
+        mapSize = 0;
+        mapSkip = 0;
+        pos = 0;
+        mapped = false;
+        file = nullptr;
+        bufStart = 0;
+        bufEnd = 0;
+        eof = false;
+        index.clear();
+        indexBase = nullptr;
+        indexPos = 0;
+    }
+
+    // "-" reads standard input, from wherever it has been read up to
+    bool Open(const std::string &filename) {
+        Close();
+#ifdef LAYOUT2PDF_HAVE_MMAP
+        const bool fromStdin = filename == "-";
+        int fd = fromStdin ? ::dup(STDIN_FILENO) : ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        off_t start = fromStdin ? ::lseek(fd, 0, SEEK_CUR) : 0;
+        if (MapFile(fd, start < 0 ? 0 : start)) {
+            ::close(fd);
+            return true;
+        }
+        // Not mappable: read through the same descriptor, since reopening
+        // a pipe would lose its writer
+        file = fdopen(fd, "rb");
+        if (!file) {
+            ::close(fd);
+        }
+#else
+        file = filename == "-" ? stdin : std::fopen(filename.c_str(), "rb");
+#endif
+        return file != nullptr;
+    }
+
+    // Read layout text already in memory; data must outlive the reader's use
+    void OpenMemory(const char *data, std::size_t n) {
+        Close();
+        mapData = data;
+        mapSize = n;
+        mapped = true;
+        borrowed = true;
+    }
+
+    // True when line views stay valid until the reader is destroyed
+    bool Stable() const {
+        return mapped;
+    }
+
+    // The whole input of a Stable() reader
+    std::string_view Contents() const {
+        return mapped ? std::string_view(mapData, mapSize) : std::string_view();
+    }
+
+    // Next line without its newline; false once the input is exhausted.
+    // A final line without a trailing newline is still returned.
+    bool NextLine(LayoutLine &line) {
+        if (indexPos == index.size()) {
+            index.clear();
+            indexPos = 0;
+            if (!(mapped ? ScanMapped() : ScanBuffered())) {
+                return false;
+            }
+        }
+        const LineRecord &rec = index[indexPos++];
+        line.text = std::string_view(indexBase + rec.begin, rec.length);
+        line.commentPos = rec.comment < rec.length ? rec.comment : std::string_view::npos;
+        line.directive = (rec.flags & LINE_DIRECTIVE) != 0;
+        return true;
+    }
+
+private:
+    static const std::size_t scanWindow = 1024 * 1024;
+
+#ifdef LAYOUT2PDF_HAVE_MMAP
+    // Map the file from byte start to its end. The mapping itself begins at
+    // the page boundary below start; mapSkip counts the bytes before it.
+    bool MapFile(int fd, off_t start) {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            return false;
+        }
+        if (start > st.st_size) {
+            start = st.st_size;
+        }
+        const off_t pageSize = static_cast<off_t>(::sysconf(_SC_PAGESIZE));
+        const off_t aligned = start - start % pageSize;
+        std::size_t length = static_cast<std::size_t>(st.st_size - aligned);
+        std::size_t skip = static_cast<std::size_t>(start - aligned);
+        if (length > 0) {
+            void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, aligned);
+            if (p == MAP_FAILED) {
+                return false;
+            }
+            madvise(p, length, MADV_SEQUENTIAL);
+            mapData = static_cast<const char *>(p) + skip;
+        } else {
+            skip = 0;
+        }
+        mapSize = length - skip;
+        mapSkip = skip;
+        mapped = true;
+        return true;
+    }
+#endif
+
+    // Index the next window of the mapping, widening it until it holds at
+    // least one whole line
+    bool ScanMapped() {
+        STATS_SCOPE(STAGE_READ);
+        std::size_t window = scanWindow;
+        while (pos < mapSize) {
+            std::size_t n = mapSize - pos < window ? mapSize - pos : window;
+            std::size_t used = ScanLines(mapData + pos, n, pos + n == mapSize, index);
+            if (!index.empty()) {
+                STATS_ADD(STAT_INPUT_BYTES, used);
+                STATS_ADD(STAT_LINES, index.size());
+                indexBase = mapData + pos;
+                pos += used;
+                return true;
+            }
+            window *= 2;
+        }
+        return false;
+    }
+
+    // Refill the buffer behind any partial line and index what it holds
+    bool ScanBuffered() {
+        STATS_SCOPE(STAGE_READ);
+        const std::size_t readSize = 64 * 1024;
+        for (;;) {
+            std::size_t pending = bufEnd - bufStart;
+            if (bufStart > 0) {
+                std::memmove(buf.data(), buf.data() + bufStart, pending);
+                bufStart = 0;
+                bufEnd = pending;
+            }
+            if (pending == 0 && eof) {
+                return false;
+            }
+            if (!eof) {
+                if (buf.size() < bufEnd + readSize) {
+                    buf.resize(bufEnd + readSize);
+                }
+                std::size_t got = std::fread(buf.data() + bufEnd, 1, readSize, file);
+                bufEnd += got;
+                if (got < readSize) {
+                    eof = true;
+                }
+            }
+
+            std::size_t used = ScanLines(buf.data(), bufEnd, eof, index);
+            bufStart = used;
+            if (!index.empty()) {
+                STATS_ADD(STAT_INPUT_BYTES, used);
+                STATS_ADD(STAT_LINES, index.size());
+                indexBase = buf.data();
+                return true;
+            }
+        }
+    }
+
+    // Mapped input
+    const char *mapData;
+    std::size_t mapSize;
+    std::size_t mapSkip;     // mapped bytes before mapData, for page alignment
+    std::size_t pos;
+    bool mapped;
+    bool borrowed;           // memory input, not owned by the reader
+
+    // Buffered fallback
+    std::FILE *file;
+    std::vector<char> buf;
+    std::size_t bufStart;
+    std::size_t bufEnd;
+    bool eof;
+
+    // Lines of the block being handed out
+    std::vector<LineRecord> index;
+    const char *indexBase;
+    std::size_t indexPos;
+};
+
+// Called with each page as soon as its closing tag is read. The handler may
+// swap the page for a spent one; it is cleared and reused afterwards.
+// Return false to stop parsing.
+typedef std::function<bool(PageSpec &page)> PageHandler;
+
+// What the parser of one chunk of a layout records for merging it with
+// the chunks before (see ParallelParser). [use NAME] lines naming a
+// fragment it has not seen are left as blank placeholder lines, at
+// lines[line] of the page-th page handed on, to be resolved or dropped.
+// fragmentPages holds, for each fragment defined, how many pages had been
+// handed on before it. endsOpen is set when the last page was handed on
+// only because the input ended inside it.
+struct ChunkNotes {
+    ChunkNotes() : endsOpen(false) {}
+
+    struct Use {
+        std::uint32_t page;
+        std::uint32_t line;
+        std::uint32_t name;   // index into names
+    };
+    std::vector<std::string> names;
+    std::vector<Use> uses;
+    std::vector<std::uint32_t> fragmentPages;
+    bool endsOpen;
+
+    void AddUse(std::size_t page, std::size_t line, std::string_view name) {
+        std::size_t n = 0;
+        while (n < names.size() && names[n] != name) {
+            n++;
+        }
+        if (n == names.size()) {
+            names.emplace_back(name);
+        }
+        Use use = { static_cast<std::uint32_t>(page), static_cast<std::uint32_t>(line),
+                    static_cast<std::uint32_t>(n) };
+        uses.push_back(use);
+    }
+
+    void Clear() {
+        names.clear();
+        uses.clear();
+        fragmentPages.clear();
+        endsOpen = false;
+    }
+};
+
+// --- Parse layout file into pages/lines ---
+// Fragments are defined outside pages, between [fragment NAME] and
+// [/fragment], and added to fragments as they are read; a [use NAME] line
+// in a page refers to the latest definition of NAME before it; one with no
+// definition is dropped, or left to the caller in notes if given. Styles
+// are interned into styles. Fails when that table or fragments is full.
+static bool ParseLayoutFile(LayoutReader &in, StyleTable &styles, FragmentTable &fragments,
+                            const PageHandler &onPage, ChunkNotes *notes = nullptr) {
+    STATS_SCOPE(STAGE_PARSE);
+    const bool stableText = in.Stable();
+    LayoutLine raw;
+    bool inPage = false;
+    std::size_t pagesDone = 0;
+    PageSpec currentPage;
+    Fragment *fragment = nullptr;   // being defined
+
+    std::uint16_t current = 0;
+    if (!styles.FromDirective(std::string_view(), current)) {
+        return false;
+    }
+
+    auto addLine = [&](std::string_view text, std::uint16_t fragmentRef) {
+        PageSpec &target = fragment ? fragment->spec : currentPage;
+        if (!stableText) {
+            text = target.arena.Store(text);
+        }
+        LineSpec ls;
+        ls.textData = text.data();
+        ls.textLength = static_cast<std::uint32_t>(text.size());
+        ls.style = current;
+        ls.fragment = fragmentRef;
+        target.lines.push_back(ls);
+    };
+
+    while (in.NextLine(raw)) {
+        // strip inline comments
+        std::size_t commentPos = raw.commentPos;
+        std::string_view beforeComment = raw.text.substr(0, commentPos);
+
+        std::string_view line = Trim(beforeComment);
+
+        // --- handle blank lines for spacing ---
+        if (line.empty()) {
+            bool isPureComment = (commentPos != std::string_view::npos);
+
+            if ((inPage || fragment) && !isPureComment) {
+                addLine(std::string_view(), 0); // respect mode
+            }
+            continue;
+        }
+
+        // Page directive or closing tag
+        if (raw.directive) {
+            if (line.size() > 1 && line[1] == '/') {
+                // Closing tag [/pageX] or [/fragment]
+                if (fragment) {
+                    fragment = nullptr;
+                } else if (inPage) {
+                    STATS_ADD(STAT_PARSED_PAGES, 1);
+                    if (!onPage(currentPage)) {
+                        return false;
+                    }
+                    pagesDone++;
+                    currentPage.Clear();
+                    inPage = false;
+                }
+                continue;
+            } else {
+                // Opening or style change: [pageX] size, color, align, [bottom]
+                std::size_t closePos = line.find(']');
+                if (closePos == std::string_view::npos) {
+                    continue; // malformed, skip
+                }
+
+                std::string_view tag = Trim(line.substr(1, closePos - 1));
+                std::string_view params = Trim(line.substr(closePos + 1));
+
+                // [use NAME] places a fragment; it leaves the style alone
+                if (tag.size() > 4 && tag.substr(0, 4) == "use ") {
+                    std::string_view name = Trim(tag.substr(4));
+                    int index = fragments.Find(name);
+                    if (inPage && !fragment && index >= 0) {
+                        addLine(std::string_view(), static_cast<std::uint16_t>(index + 1));
+                    } else if (inPage && !fragment && notes) {
+                        addLine(std::string_view(), 0);
+                        notes->AddUse(pagesDone, currentPage.lines.size() - 1, name);
+                    }
+                    continue;
+                }
+
+                if (tag.size() > 9 && tag.substr(0, 9) == "fragment ") {
+                    if (inPage || fragment) {
+                        continue; // fragments are defined outside pages
+                    }
+                    if (fragments.Full()) {
+                        return false;
+                    }
+                    fragment = &fragments.Add(Trim(tag.substr(9)));
+                    fragment->spec.styleTable = &styles;
+                    if (notes) {
+                        notes->fragmentPages.push_back(static_cast<std::uint32_t>(pagesDone));
+                    }
+                } else if (!inPage && !fragment) {
+                    // Start a new page if not already in one
+                    inPage = true;
+                    currentPage.Clear();
+                    currentPage.styleTable = &styles;
+                }
+
+                // Reset / update style
+                if (!styles.FromDirective(params, current)) {
+                    return false;
+                }
+                if (fragment && fragment->spec.lines.empty()) {
+                    fragment->bottomAnchor = styles.Get(current).bottomAnchor;
+                }
+                continue;
+            }
+        }
+
+        // Regular text line
+        if (inPage || fragment) {
+            addLine(line, 0);
+        }
+    }
+
+    if (inPage && !currentPage.lines.empty()) {
+        STATS_ADD(STAT_PARSED_PAGES, 1);
+        if (notes) {
+            notes->endsOpen = true;
+        }
+        if (!onPage(currentPage)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// --- Font metrics ---
+// Glyph widths from the Adobe AFM files of the standard 14 fonts, in
+// thousandths of an em, indexed by WinAnsiEncoding code, which the font
+// dictionary names. Codes the encoding leaves undefined get the font's
+// average width.
+
+struct FontMetrics {
+    const char *baseFont;
+    std::array<std::uint16_t, 256> widths;
+};
+
+// ASCII 32..126 in code order
+static constexpr std::uint16_t helveticaAscii[95] = {
+    278, 278, 355, 556, 556, 889, 667, 222, 333, 333, 389, 584, 278, 333, 278, 278,  //  !"#$%&'()*+,-./
+    556, 556, 556, 556, 556, 556, 556, 556, 556, 556, 278, 278, 584, 584, 584, 556,  // 0-9 :;<=>?
+    1015, 667, 667, 722, 722, 667, 611, 778, 722, 278, 500, 667, 556, 833, 722, 778, // @A-O
+    667, 778, 722, 667, 611, 722, 667, 944, 667, 667, 611, 278, 278, 278, 469, 556,  // P-Z [\]^_
+    222, 556, 556, 500, 556, 556, 278, 556, 556, 222, 222, 500, 222, 833, 556, 556,  // `a-o
+    556, 556, 333, 500, 278, 556, 500, 722, 500, 500, 500, 334, 260, 334, 584        // p-z {|}~
+};
+
+// WinAnsiEncoding 128..255 in code order; 0 where the code is undefined
+static constexpr std::uint16_t helveticaHigh[128] = {
+    556, 0, 222, 556, 333, 1000, 556, 556, 333, 1000, 667, 333, 1000, 0, 611, 0,     // 0x80
+    0, 222, 222, 333, 333, 350, 556, 1000, 333, 1000, 500, 333, 944, 0, 500, 667,    // 0x90
+    278, 333, 556, 556, 556, 556, 260, 556, 333, 737, 370, 556, 584, 333, 737, 333,  // 0xa0
+    400, 584, 333, 333, 333, 556, 537, 278, 333, 333, 365, 556, 834, 834, 834, 611,  // 0xb0
+    667, 667, 667, 667, 667, 667, 1000, 722, 667, 667, 667, 667, 278, 278, 278, 278, // 0xc0
+    722, 722, 778, 778, 778, 778, 778, 584, 778, 722, 722, 722, 722, 667, 667, 611,  // 0xd0
+    556, 556, 556, 556, 556, 556, 889, 500, 556, 556, 556, 556, 278, 278, 278, 278,  // 0xe0
+    556, 556, 556, 556, 556, 556, 556, 584, 611, 556, 556, 556, 556, 500, 556, 500   // 0xf0
+};
+
+static constexpr FontMetrics MakeFontMetrics(const char *baseFont, const std::uint16_t (&ascii)[95],
+                                             const std::uint16_t (&high)[128],
+                                             std::uint16_t missingWidth) {
+    FontMetrics m = { baseFont, {} };
+    for (int c = 0; c < 256; ++c) {
+        if (c >= 32 && c <= 126) {
+            m.widths[static_cast<std::size_t>(c)] = ascii[c - 32];
+        } else if (c >= 128) {
+            const std::uint16_t w = high[c - 128];
+            m.widths[static_cast<std::size_t>(c)] = w != 0 ? w : missingWidth;
+        } else {
+            m.widths[static_cast<std::size_t>(c)] = 0;   // control codes draw nothing
+        }
+    }
+    return m;
+}
+
+static constexpr FontMetrics helveticaMetrics =
+    MakeFontMetrics("Helvetica", helveticaAscii, helveticaHigh, 556);
+
+// The characters WinAnsiEncoding puts at 0x80..0x9f; 0 where undefined.
+// 0xa0..0xff are the same as Latin-1.
+static constexpr std::uint16_t winAnsiC1[32] = {
+    0x20ac, 0, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+    0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0, 0x017d, 0,
+    0, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+    0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0, 0x017e, 0x0178
+};
+
+// WinAnsiEncoding code of a character; '?' for one it does not have
+static inline unsigned char WinAnsiCode(std::uint32_t codepoint) {
+    if (codepoint < 0x80 || (codepoint >= 0xa0 && codepoint <= 0xff)) {
+        return static_cast<unsigned char>(codepoint);
+    }
+    for (int k = 0; k < 32; ++k) {
+        if (winAnsiC1[k] != 0 && winAnsiC1[k] == codepoint) {
+            return static_cast<unsigned char>(0x80 + k);
+        }
+    }
+    return '?';
+}
+
+// --- TrueType fonts ---
+// A TrueType font given with --font is embedded instead of using
+// Helvetica. Text is drawn with the font's own glyph ids through a Type0
+// font with Identity-H, so a page's content stream does not depend on which
+// glyphs the rest of the document uses. Layout notes the glyphs of every
+// page's text in a per-worker GlyphSet; when the document is done, the union
+// is written out as a subset of the font program: glyph ids unchanged, every
+// glyph not used left without an outline, and the tables cut off after the
+// last glyph used.
+
+// Glyph ids, one bit each
+class GlyphSet {
+public:
+    void Add(std::uint32_t gid) {
+        const std::size_t word = gid >> 6;
+        if (word >= bits.size()) {
+            bits.resize(word + 1, 0);
+        }
+        bits[word] |= 1ULL << (gid & 63);
+    }
+
+    bool Has(std::uint32_t gid) const {
+        const std::size_t word = gid >> 6;
+        return word < bits.size() && (bits[word] >> (gid & 63) & 1) != 0;
+    }
+
+    void Merge(const GlyphSet &other) {
+        if (other.bits.size() > bits.size()) {
+            bits.resize(other.bits.size(), 0);
+        }
+        for (std::size_t i = 0; i < other.bits.size(); ++i) {
+            bits[i] |= other.bits[i];
+        }
+    }
+
+    // True if every glyph in other is also in the set
+    bool Covers(const GlyphSet &other) const {
+        for (std::size_t i = 0; i < other.bits.size(); ++i) {
+            if ((other.bits[i] & ~(i < bits.size() ? bits[i] : 0)) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void Clear() {
+        std::fill(bits.begin(), bits.end(), 0);
+    }
+
+    // One past the highest glyph id in the set, 0 if it is empty
+    std::uint32_t End() const {
+        for (std::size_t i = bits.size(); i-- > 0;) {
+            if (bits[i] != 0) {
+                int top = 63;
+                while ((bits[i] >> top & 1) == 0) {
+                    top--;
+                }
+                return static_cast<std::uint32_t>(i * 64 + static_cast<std::size_t>(top) + 1);
+            }
+        }
+        return 0;
+    }
+
+    const std::vector<std::uint64_t> &Words() const {
+        return bits;
+    }
+
+private:
+    std::vector<std::uint64_t> bits;
+};
+
+static inline void AppendU16(ByteBuffer &out, std::uint32_t v) {
+    char b[2] = { static_cast<char>(v >> 8 & 0xff), static_cast<char>(v & 0xff) };
+    out.Append(b, 2);
+}
+
+static inline void AppendU32(ByteBuffer &out, std::uint32_t v) {
+    char b[4] = { static_cast<char>(v >> 24 & 0xff), static_cast<char>(v >> 16 & 0xff),
+                  static_cast<char>(v >> 8 & 0xff), static_cast<char>(v & 0xff) };
+    out.Append(b, 4);
+}
+
+// Four hex digits, as in <hex> strings and CMaps
+static inline void AppendHex16(ByteBuffer &out, std::uint32_t v) {
+    static const char hex[] = "0123456789ABCDEF";
+    char b[4] = { hex[v >> 12 & 0xf], hex[v >> 8 & 0xf], hex[v >> 4 & 0xf], hex[v & 0xf] };
+    out.Append(b, 4);
+}
+
+static inline void StoreU16(char *p, std::uint32_t v) {
+    p[0] = static_cast<char>(v >> 8 & 0xff);
+    p[1] = static_cast<char>(v & 0xff);
+}
+
+static inline void StoreU32(char *p, std::uint32_t v) {
+    StoreU16(p, v >> 16);
+    StoreU16(p + 2, v & 0xffff);
+}
+
+static std::uint32_t TableChecksum(const char *data, std::size_t n) {
+    std::uint32_t sum = 0;
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    for (std::size_t i = 0; i < n; i += 4) {
+        std::uint32_t word = 0;
+        for (std::size_t k = 0; k < 4; ++k) {
+            word = (word << 8) | (i + k < n ? p[i + k] : 0u);
+        }
+        sum += word;
+    }
+    return sum;
+}
+
+class TrueTypeFont {
+public:
+    TrueTypeFont()
+        : unitsPerEm(1000), numGlyphs(0), numHMetrics(0), longLoca(false), ascent(0),
+          descent(0), capHeight(0), italicAngle(0.0f), fixedPitch(false) {
+        bbox[0] = bbox[1] = bbox[2] = bbox[3] = 0;
+    }
+
+    // Read and check a .ttf file; error says what is wrong with it
+    bool Load(const std::string &path, std::string &error) {
+        file.Clear();
+        tables.clear();
+        std::FILE *f = std::fopen(path.c_str(), "rb");
+        if (!f) {
+            error = "Failed to open font file: " + path;
+            return false;
+        }
+        char chunk[16 * 1024];
+        std::size_t got;
+        while ((got = std::fread(chunk, 1, sizeof(chunk), f)) > 0) {
+            file.Append(chunk, got);
+        }
+        std::fclose(f);
+
+        error = "Not a usable TrueType font: " + path;
+        const std::uint32_t version = U32(0);
+        if (version == 0x4f54544f) {   // 'OTTO'
+            error += " (CFF outlines are not supported)";
+            return false;
+        }
+        if (version == 0x74746366) {   // 'ttcf'
+            error += " (font collections are not supported)";
+            return false;
+        }
+        if (version != 0x00010000 && version != 0x74727565) {   // 1.0 or 'true'
+            return false;
+        }
+        const std::uint32_t count = U16(4);
+        for (std::uint32_t i = 0; i < count; ++i) {
+            const std::size_t at = 12 + 16 * static_cast<std::size_t>(i);
+            Table t;
+            t.offset = U32(at + 8);
+            t.length = U32(at + 12);
+            if (at + 16 > file.Size() || t.offset > file.Size() || t.length > file.Size() - t.offset) {
+                return false;
+            }
+            tables[U32(at)] = t;
+        }
+        const char *required[] = { "head", "hhea", "hmtx", "maxp", "loca", "glyf", "cmap" };
+        for (const char *tag : required) {
+            if (!FindTable(tag)) {
+                error += std::string(" (no ") + tag + " table)";
+                return false;
+            }
+        }
+        const Table head = *FindTable("head");
+        const Table hhea = *FindTable("hhea");
+        const Table maxp = *FindTable("maxp");
+        if (head.length < 54 || hhea.length < 36 || maxp.length < 6) {
+            return false;
+        }
+        unitsPerEm = U16(head.offset + 18);
+        numGlyphs = U16(maxp.offset + 4);
+        numHMetrics = U16(hhea.offset + 34);
+        longLoca = S16(head.offset + 50) != 0;
+        if (unitsPerEm == 0 || numGlyphs == 0 || numHMetrics == 0 || numHMetrics > numGlyphs) {
+            return false;
+        }
+        for (int k = 0; k < 4; ++k) {
+            bbox[k] = Scale(S16(head.offset + 36 + 2 * static_cast<std::size_t>(k)));
+        }
+        ascent = Scale(S16(hhea.offset + 4));
+        descent = Scale(S16(hhea.offset + 6));
+        capHeight = ascent;
+        if (const Table *os2 = FindTable("OS/2")) {
+            const std::uint32_t fsType = U16(os2->offset + 8);
+            if ((fsType & 0x000f) == 0x0002) {
+                error = "Font does not permit embedding: " + path;
+                return false;
+            }
+            if (os2->length >= 90 && U16(os2->offset) >= 2) {
+                capHeight = Scale(S16(os2->offset + 88));
+            }
+        }
+        if (const Table *post = FindTable("post")) {
+            if (post->length >= 16) {
+                italicAngle = static_cast<float>(static_cast<std::int32_t>(U32(post->offset + 4))) / 65536.0f;
+                fixedPitch = U32(post->offset + 12) != 0;
+            }
+        }
+
+        if (!ReadMetrics() || !ReadLoca() || !ReadCmap()) {
+            return false;
+        }
+        ReadPostScriptName();
+        error.clear();
+        return true;
+    }
+
+    // 0 (.notdef) for characters the font has no glyph for
+    std::uint16_t GlyphOf(std::uint32_t codepoint) const {
+        if (codepoint < bmpGlyphs.size()) {
+            return bmpGlyphs[codepoint];
+        }
+        std::unordered_map<std::uint32_t, std::uint16_t>::const_iterator it = otherGlyphs.find(codepoint);
+        return it == otherGlyphs.end() ? 0 : it->second;
+    }
+
+    // Advance width in thousandths of an em
+    std::uint16_t Advance(std::uint32_t gid) const {
+        return gid < advances.size() ? advances[gid] : 0;
+    }
+
+    // The character gid was first mapped from, 0 if none
+    std::uint32_t UnicodeOf(std::uint32_t gid) const {
+        return gid < unicodes.size() ? unicodes[gid] : 0;
+    }
+
+    std::uint32_t NumGlyphs() const { return numGlyphs; }
+    const std::string &PostScriptName() const { return postScriptName; }
+    const ByteBuffer &File() const { return file; }
+
+    // Font descriptor values, in thousandths of an em
+    int Ascent() const { return ascent; }
+    int Descent() const { return descent; }
+    int CapHeight() const { return capHeight; }
+    int BBox(int k) const { return bbox[k]; }
+    float ItalicAngle() const { return italicAngle; }
+    bool FixedPitch() const { return fixedPitch; }
+
+    // The font program with only the glyphs in used, .notdef and the
+    // components of any composite among them. Glyph ids are kept, so the
+    // tables run up to the highest one used and the other glyphs are empty.
+    void BuildSubset(const GlyphSet &used, ByteBuffer &out) const {
+        GlyphSet keep = used;
+        keep.Add(0);
+        std::vector<std::uint32_t> pending;
+        for (std::uint32_t gid = 0; gid < keep.End(); ++gid) {
+            if (keep.Has(gid)) {
+                pending.push_back(gid);
+            }
+        }
+        while (!pending.empty()) {
+            const std::uint32_t gid = pending.back();
+            pending.pop_back();
+            AddComponents(gid, keep, pending);
+        }
+        std::uint32_t n = std::min(keep.End(), numGlyphs);
+
+        const Table glyfTable = *FindTable("glyf");
+        ByteBuffer glyf, loca, hmtx;
+        AppendU32(loca, 0);
+        for (std::uint32_t gid = 0; gid < n; ++gid) {
+            if (keep.Has(gid)) {
+                glyf.Append(file.Data() + glyfTable.offset + glyphOffsets[gid],
+                            glyphOffsets[gid + 1] - glyphOffsets[gid]);
+                while (glyf.Size() % 4 != 0) {
+                    glyf.Append('\0');
+                }
+            }
+            AppendU32(loca, static_cast<std::uint32_t>(glyf.Size()));
+        }
+        const Table hmtxTable = *FindTable("hmtx");
+        for (std::uint32_t gid = 0; gid < n; ++gid) {
+            if (gid < numHMetrics) {
+                AppendU32(hmtx, U32(hmtxTable.offset + 4 * static_cast<std::size_t>(gid)));
+            } else {
+                AppendU16(hmtx, U16(hmtxTable.offset + 4 * static_cast<std::size_t>(numHMetrics - 1)));
+                AppendU16(hmtx, U16(hmtxTable.offset + 4 * static_cast<std::size_t>(numHMetrics) +
+                                    2 * static_cast<std::size_t>(gid - numHMetrics)));
+            }
+        }
+        ByteBuffer head, hhea, maxp;
+        AppendTable(head, "head");
+        AppendTable(hhea, "hhea");
+        AppendTable(maxp, "maxp");
+        char *headData = head.Data();
+        StoreU32(headData + 8, 0);     // checkSumAdjustment, filled in below
+        StoreU16(headData + 50, 1);    // long loca offsets
+        StoreU16(hhea.Data() + 34, n);
+        StoreU16(maxp.Data() + 4, n);
+        ByteBuffer cvt, fpgm, prep;   // hinting, copied as is
+        AppendTable(cvt, "cvt ");
+        AppendTable(fpgm, "fpgm");
+        AppendTable(prep, "prep");
+
+        // In tag order, as the directory must be
+        struct Entry { const char *tag; const ByteBuffer *data; };
+        const Entry all[] = { { "cvt ", &cvt }, { "fpgm", &fpgm }, { "glyf", &glyf },
+                              { "head", &head }, { "hhea", &hhea }, { "hmtx", &hmtx },
+                              { "loca", &loca }, { "maxp", &maxp }, { "prep", &prep } };
+        std::vector<Entry> entries;
+        for (const Entry &e : all) {
+            if (!e.data->Empty()) {
+                entries.push_back(e);
+            }
+        }
+        const std::uint32_t count = static_cast<std::uint32_t>(entries.size());
+        std::uint32_t pow2 = 1, log2 = 0;
+        while (pow2 * 2 <= count) {
+            pow2 *= 2;
+            log2++;
+        }
+        const std::size_t start = out.Size();
+        AppendU32(out, 0x00010000);
+        AppendU16(out, count);
+        AppendU16(out, pow2 * 16);
+        AppendU16(out, log2);
+        AppendU16(out, count * 16 - pow2 * 16);
+        std::uint32_t offset = 12 + 16 * count;
+        for (const Entry &e : entries) {
+            out.Append(e.tag, 4);
+            AppendU32(out, TableChecksum(e.data->Data(), e.data->Size()));
+            AppendU32(out, offset);
+            AppendU32(out, static_cast<std::uint32_t>(e.data->Size()));
+            offset += static_cast<std::uint32_t>((e.data->Size() + 3) & ~static_cast<std::size_t>(3));
+        }
+        std::size_t headAt = 0;
+        for (const Entry &e : entries) {
+            if (e.data == &head) {
+                headAt = out.Size();
+            }
+            out.Append(*e.data);
+            while ((out.Size() - start) % 4 != 0) {
+                out.Append('\0');
+            }
+        }
+        char *whole = out.Data() + start;
+        StoreU32(whole + (headAt - start) + 8,
+                 0xb1b0afbau - TableChecksum(whole, out.Size() - start));
+    }
+
+private:
+    struct Table {
+        std::uint32_t offset;
+        std::uint32_t length;
+    };
+
+    static std::uint32_t Tag(const char *tag) {
+        return static_cast<std::uint32_t>(static_cast<unsigned char>(tag[0])) << 24 |
+               static_cast<std::uint32_t>(static_cast<unsigned char>(tag[1])) << 16 |
+               static_cast<std::uint32_t>(static_cast<unsigned char>(tag[2])) << 8 |
+               static_cast<std::uint32_t>(static_cast<unsigned char>(tag[3]));
+    }
+
+    const Table *FindTable(const char *tag) const {
+        std::unordered_map<std::uint32_t, Table>::const_iterator it = tables.find(Tag(tag));
+        return it == tables.end() ? nullptr : &it->second;
+    }
+
+    void AppendTable(ByteBuffer &out, const char *tag) const {
+        if (const Table *t = FindTable(tag)) {
+            out.Append(file.Data() + t->offset, t->length);
+        }
+    }
+
+    // Reads past the end of the file give 0
+    std::uint32_t U16(std::size_t at) const {
+        if (at + 2 > file.Size()) {
+            return 0;
+        }
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(file.Data()) + at;
+        return static_cast<std::uint32_t>(p[0]) << 8 | p[1];
+    }
+
+    std::uint32_t U32(std::size_t at) const {
+        return U16(at) << 16 | U16(at + 2);
+    }
+
+    int S16(std::size_t at) const {
+        return static_cast<std::int16_t>(static_cast<std::uint16_t>(U16(at)));
+    }
+
+    int Scale(int units) const {
+        return static_cast<int>(std::lround(static_cast<double>(units) * 1000.0 / unitsPerEm));
+    }
+
+    bool ReadMetrics() {
+        const Table hmtx = *FindTable("hmtx");
+        if (hmtx.length < 4 * numHMetrics) {
+            return false;
+        }
+        advances.resize(numGlyphs);
+        for (std::uint32_t gid = 0; gid < numGlyphs; ++gid) {
+            const std::uint32_t m = std::min(gid, numHMetrics - 1);
+            advances[gid] = static_cast<std::uint16_t>(
+                Scale(static_cast<int>(U16(hmtx.offset + 4 * static_cast<std::size_t>(m)))));
+        }
+        return true;
+    }
+
+    bool ReadLoca() {
+        const Table loca = *FindTable("loca");
+        const Table glyf = *FindTable("glyf");
+        if (loca.length < (numGlyphs + 1) * (longLoca ? 4u : 2u)) {
+            return false;
+        }
+        glyphOffsets.resize(numGlyphs + 1);
+        for (std::uint32_t gid = 0; gid <= numGlyphs; ++gid) {
+            std::uint32_t at = longLoca ? U32(loca.offset + 4 * static_cast<std::size_t>(gid))
+                                        : 2 * U16(loca.offset + 2 * static_cast<std::size_t>(gid));
+            if (at > glyf.length || (gid > 0 && at < glyphOffsets[gid - 1])) {
+                return false;
+            }
+            glyphOffsets[gid] = at;
+        }
+        return true;
+    }
+
+    // The best Unicode subtable: format 12 (all of Unicode) over format 4
+    // (the BMP only)
+    bool ReadCmap() {
+        const Table cmap = *FindTable("cmap");
+        std::size_t best = 0;
+        int bestRank = 0;
+        const std::uint32_t count = U16(cmap.offset + 2);
+        for (std::uint32_t i = 0; i < count; ++i) {
+            const std::size_t rec = cmap.offset + 4 + 8 * static_cast<std::size_t>(i);
+            const std::uint32_t platform = U16(rec), encoding = U16(rec + 2);
+            const std::size_t sub = cmap.offset + U32(rec + 4);
+            const std::uint32_t format = U16(sub);
+            const bool unicode = platform == 0 || (platform == 3 && (encoding == 1 || encoding == 10));
+            int rank = !unicode ? 0 : format == 12 ? 2 : format == 4 ? 1 : 0;
+            if (rank > bestRank && sub < cmap.offset + cmap.length) {
+                best = sub;
+                bestRank = rank;
+            }
+        }
+        if (bestRank == 0) {
+            return false;
+        }
+        bmpGlyphs.assign(0x10000, 0);
+        otherGlyphs.clear();
+        unicodes.assign(numGlyphs, 0);
+        if (bestRank == 2) {
+            const std::uint32_t groups = U32(best + 12);
+            for (std::uint32_t g = 0; g < groups; ++g) {
+                const std::size_t at = best + 16 + 12 * static_cast<std::size_t>(g);
+                if (at + 12 > file.Size()) {
+                    return false;
+                }
+                const std::uint32_t first = U32(at), last = std::min(U32(at + 4), 0x10ffffu);
+                const std::uint32_t gid = U32(at + 8);
+                for (std::uint32_t c = first; c <= last && c >= first; ++c) {
+                    Map(c, gid + (c - first));
+                }
+            }
+        } else {
+            const std::uint32_t segX2 = U16(best + 6);
+            const std::size_t ends = best + 14;
+            const std::size_t starts = ends + segX2 + 2;
+            const std::size_t deltas = starts + segX2;
+            const std::size_t ranges = deltas + segX2;
+            if (ranges + segX2 > file.Size()) {
+                return false;
+            }
+            for (std::size_t s = 0; s < segX2 / 2; ++s) {
+                const std::uint32_t first = U16(starts + 2 * s), last = U16(ends + 2 * s);
+                const std::uint32_t delta = U16(deltas + 2 * s);
+                const std::uint32_t range = U16(ranges + 2 * s);
+                for (std::uint32_t c = first; c <= last && c != 0xffff; ++c) {
+                    std::uint32_t gid;
+                    if (range == 0) {
+                        gid = (c + delta) & 0xffff;
+                    } else {
+                        gid = U16(ranges + 2 * s + range + 2 * (c - first));
+                        if (gid != 0) {
+                            gid = (gid + delta) & 0xffff;
+                        }
+                    }
+                    Map(c, gid);
+                }
+            }
+        }
+        return true;
+    }
+
+    void Map(std::uint32_t codepoint, std::uint32_t gid) {
+        if (gid == 0 || gid >= numGlyphs) {
+            return;
+        }
+        if (codepoint < bmpGlyphs.size()) {
+            bmpGlyphs[codepoint] = static_cast<std::uint16_t>(gid);
+        } else {
+            otherGlyphs[codepoint] = static_cast<std::uint16_t>(gid);
+        }
+        if (unicodes[gid] == 0 || codepoint < unicodes[gid]) {
+            unicodes[gid] = codepoint;
+        }
+    }
+
+    // Name ID 6, reduced to the characters a PDF name can hold unescaped
+    void ReadPostScriptName() {
+        postScriptName.clear();
+        if (const Table *name = FindTable("name")) {
+            const std::uint32_t count = U16(name->offset + 2);
+            const std::size_t strings = name->offset + U16(name->offset + 4);
+            for (std::uint32_t i = 0; i < count && postScriptName.empty(); ++i) {
+                const std::size_t rec = name->offset + 6 + 12 * static_cast<std::size_t>(i);
+                const std::uint32_t platform = U16(rec);
+                if (U16(rec + 6) != 6 || (platform != 1 && platform != 3)) {
+                    continue;
+                }
+                const std::size_t length = U16(rec + 8);
+                const std::size_t at = strings + U16(rec + 10);
+                const std::size_t step = platform == 3 ? 2 : 1;
+                for (std::size_t k = 0; k + step <= length && at + k + step <= file.Size(); k += step) {
+                    unsigned c = static_cast<unsigned char>(file.Data()[at + k + step - 1]);
+                    if (step == 2 && file.Data()[at + k] != 0) {
+                        continue;
+                    }
+                    if (c > 32 && c < 127 && std::strchr("()<>[]{}/%#", static_cast<int>(c)) == nullptr) {
+                        postScriptName.push_back(static_cast<char>(c));
+                    }
+                }
+            }
+        }
+        if (postScriptName.empty()) {
+            postScriptName = "EmbeddedFont";
+        }
+    }
+
+    // Queue the components of a composite glyph that are not kept yet
+    void AddComponents(std::uint32_t gid, GlyphSet &keep, std::vector<std::uint32_t> &pending) const {
+        if (gid >= numGlyphs || glyphOffsets[gid + 1] - glyphOffsets[gid] < 10) {
+            return;
+        }
+        const std::size_t glyf = FindTable("glyf")->offset;
+        const std::size_t end = glyf + glyphOffsets[gid + 1];
+        std::size_t at = glyf + glyphOffsets[gid];
+        if (S16(at) >= 0) {
+            return;   // simple glyph
+        }
+        at += 10;
+        for (;;) {
+            if (at + 4 > end) {
+                return;
+            }
+            const std::uint32_t flags = U16(at);
+            const std::uint32_t component = U16(at + 2);
+            if (component < numGlyphs && !keep.Has(component)) {
+                keep.Add(component);
+                pending.push_back(component);
+            }
+            at += 4 + ((flags & 0x0001) ? 4 : 2);           // ARG_1_AND_2_ARE_WORDS
+            if (flags & 0x0008) at += 2;                    // WE_HAVE_A_SCALE
+            else if (flags & 0x0040) at += 4;               // WE_HAVE_AN_X_AND_Y_SCALE
+            else if (flags & 0x0080) at += 8;               // WE_HAVE_A_TWO_BY_TWO
+            if ((flags & 0x0020) == 0) {                    // MORE_COMPONENTS
+                return;
+            }
+        }
+    }
+
+    ByteBuffer file;
+    std::unordered_map<std::uint32_t, Table> tables;
+    std::uint32_t unitsPerEm;
+    std::uint32_t numGlyphs;
+    std::uint32_t numHMetrics;
+    bool longLoca;
+    std::vector<std::uint32_t> glyphOffsets;   // into glyf, numGlyphs + 1 of them
+    std::vector<std::uint16_t> advances;       // by glyph id, thousandths of an em
+    std::vector<std::uint16_t> bmpGlyphs;      // by code point, below U+10000
+    std::unordered_map<std::uint32_t, std::uint16_t> otherGlyphs;
+    std::vector<std::uint32_t> unicodes;       // by glyph id
+    std::string postScriptName;
+    int ascent;
+    int descent;
+    int capHeight;
+    int bbox[4];
+    float italicAngle;
+    bool fixedPitch;
+};
+
+// --- Text font ---
+// What layout and content streams know about the font text is set in.
+// Layout text is UTF-8, decoded into the font's own codes: WinAnsiEncoding
+// bytes for the unembedded Helvetica, 2-byte glyph ids for an embedded
+// TrueType font. ASCII is the same in both and takes a table lookup; a
+// line that is all ASCII, checked with IsAscii, is copied through as is.
+
+// One character of UTF-8 text at p[i], moving i past it. A byte that does
+// not start a well-formed sequence is taken on its own as Latin-1, so
+// layouts saved in Latin-1 still come out right.
+static inline std::uint32_t DecodeUtf8(const unsigned char *p, std::size_t &i, std::size_t n) {
+    const unsigned c = p[i];
+    if (c < 0x80) {
+        i++;
+        return c;
+    }
+    std::size_t len;
+    std::uint32_t cp;
+    std::uint32_t least;
+    if (c >= 0xc2 && c <= 0xdf) {
+        len = 2; cp = c & 0x1f; least = 0x80;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        len = 3; cp = c & 0x0f; least = 0x800;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        len = 4; cp = c & 0x07; least = 0x10000;
+    } else {
+        i++;
+        return c;
+    }
+    if (n - i < len) {
+        i++;
+        return c;
+    }
+    for (std::size_t k = 1; k < len; ++k) {
+        if ((p[i + k] & 0xc0) != 0x80) {
+            i++;
+            return c;
+        }
+        cp = (cp << 6) | (p[i + k] & 0x3f);
+    }
+    if (cp < least || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+        i++;
+        return c;
+    }
+    i += len;
+    return cp;
+}
+
+class TextFont {
+public:
+    TextFont() : trueType(nullptr) {
+        for (std::size_t c = 0; c < 256; ++c) {
+            widths[c] = c < 0x80 ? helveticaMetrics.widths[c] : leadByte;
+        }
+        asciiGlyphs.fill(0);
+    }
+
+    void Embed(const TrueTypeFont &font) {
+        trueType = &font;
+        for (std::uint32_t c = 0; c < 0x80; ++c) {
+            asciiGlyphs[c] = font.GlyphOf(c);
+            widths[c] = font.Advance(asciiGlyphs[c]);
+        }
+    }
+
+    // Null for Helvetica
+    const TrueTypeFont *Embedded() const {
+        return trueType;
+    }
+
+    // Width of the character at p[i] in thousandths of an em, moving i past
+    // it; the text ends at n
+    std::uint32_t Advance(const unsigned char *p, std::size_t &i, std::size_t n) const {
+        const std::uint32_t w = widths[p[i]];
+        if (w != leadByte) {
+            i++;
+            return w;
+        }
+        const std::uint32_t codepoint = DecodeUtf8(p, i, n);
+        return trueType ? trueType->Advance(trueType->GlyphOf(codepoint))
+                        : helveticaMetrics.widths[WinAnsiCode(codepoint)];
+    }
+
+    std::uint32_t SpaceAdvance() const {
+        return widths[' '];
+    }
+
+    // Width of text set at fontSize, in points
+    float TextWidth(std::string_view text, int fontSize) const {
+        std::uint32_t units = 0;
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(text.data());
+        for (std::size_t i = 0; i < text.size();) {
+            units += Advance(p, i, text.size());
+        }
+        return static_cast<float>(units) * static_cast<float>(fontSize) * 0.001f;
+    }
+
+    // Show text: "(codes) Tj" for Helvetica, the glyph ids as a hex string
+    // for a TrueType font
+    void AppendShow(std::string_view text, ByteBuffer &out) const {
+        if (trueType) {
+            AppendGlyphIds(text, out);
+            return;
+        }
+        if (IsAscii(text.data(), text.size())) {
+            AppendPdfString(out, text);
+        } else {
+            // The codes go where the string's last n bytes would, past the
+            // 2n + 2 it can take, and the string is written in front of them
+            const std::size_t n = text.size();
+            char *dst = out.Reserve(3 * n + 2);
+            unsigned char *codes = reinterpret_cast<unsigned char *>(dst + 2 * n + 2);
+            const unsigned char *p = reinterpret_cast<const unsigned char *>(text.data());
+            std::size_t count = 0;
+            for (std::size_t i = 0; i < n;) {
+                codes[count++] = WinAnsiCode(DecodeUtf8(p, i, n));
+            }
+            out.Commit(WritePdfString(codes, count, dst));
+        }
+        out.Append(" Tj\n");
+    }
+
+    // Note the glyph of every character of text in used (TrueType only)
+    void AddGlyphs(std::string_view text, GlyphSet &used) const {
+        if (!trueType) {
+            return;
+        }
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(text.data());
+        for (std::size_t i = 0; i < text.size();) {
+            used.Add(p[i] < 0x80 ? asciiGlyphs[p[i++]] : trueType->GlyphOf(DecodeUtf8(p, i, text.size())));
+        }
+    }
+
+private:
+    static const std::uint16_t leadByte = 0xffff;   // in widths: decode UTF-8 instead
+
+    void AppendGlyphIds(std::string_view text, ByteBuffer &out) const {
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(text.data());
+        const bool ascii = IsAscii(text.data(), text.size());
+        static const char hex[] = "0123456789ABCDEF";
+        char *dst = out.Reserve(text.size() * 4 + 6);
+        char *q = dst;
+        *q++ = '<';
+        for (std::size_t i = 0; i < text.size();) {
+            const std::uint32_t gid = ascii || p[i] < 0x80
+                                          ? asciiGlyphs[p[i++]]
+                                          : trueType->GlyphOf(DecodeUtf8(p, i, text.size()));
+            q[0] = hex[gid >> 12 & 0xf];
+            q[1] = hex[gid >> 8 & 0xf];
+            q[2] = hex[gid >> 4 & 0xf];
+            q[3] = hex[gid & 0xf];
+            q += 4;
+        }
+        std::memcpy(q, "> Tj\n", 5);
+        out.Commit(static_cast<std::size_t>(q + 5 - dst));
+    }
+
+    const TrueTypeFont *trueType;
+    std::array<std::uint16_t, 256> widths;        // by byte
+    std::array<std::uint16_t, 128> asciiGlyphs;   // TrueType glyph ids of ASCII
+};
+
+// --- Layout engine ---
+// Lays a parsed page out onto as many PDF pages as it needs. Lines wider
+// than the text column are word-wrapped (breaking inside a word only when
+// the word alone is too wide), and when the top-anchored text reaches the
+// footer a new page is started, with the same bottom-anchored lines. The
+// engine walks the page's lines once and resumes mid-line on the next page,
+// so it never looks back, however long the page is.
+
+static const float pageWidth  = 612.0f;  // 8.5" at 72 dpi
+static const float pageHeight = 792.0f;  // 11"
+static const float leftMargin   = 72.0f;
+static const float rightMargin  = 72.0f;
+static const float topMarginY   = 750.0f;  // starting Y for top text
+static const float bottomMarginY = 72.0f;  // base margin for footer
+
+static const float usableWidth = pageWidth - leftMargin - rightMargin;
+
+// A fragment drawn on a page, with its origin at y
+struct PlacedFragment {
+    const Fragment *fragment;
+    float y;
+};
+
+// Everything drawn on one PDF page
+struct PageLayout {
+    PageLayout() : styles(nullptr) {}
+
+    const StyleTable *styles;
+    LineBuffer lines;
+    std::vector<PlacedFragment> fragments;
+};
+
+static float LineX(const TextStyle &style, float textWidth) {
+    float x = leftMargin;
+    if (style.align == ALIGN_CENTER) {
+        x = (pageWidth - textWidth) / 2.0f;
+        if (x < leftMargin) x = leftMargin;
+    } else if (style.align == ALIGN_RIGHT) {
+        x = pageWidth - rightMargin - textWidth;
+        if (x < leftMargin) x = leftMargin;
+    }
+    return x;
+}
+
+// LineX over lines[from, Size()), turning each width into an x position.
+// Written with selects instead of branches so the loop can be vectorized.
+static void AlignLines(LineBuffer &lines, std::size_t from) {
+    float *x = lines.x.data();
+    const std::uint8_t *align = lines.align.data();
+    for (std::size_t i = from; i < lines.Size(); ++i) {
+        const float w = x[i];
+        const float center = (pageWidth - w) / 2.0f;
+        const float right = pageWidth - rightMargin - w;
+        float v = align[i] == ALIGN_CENTER ? center : align[i] == ALIGN_RIGHT ? right : leftMargin;
+        x[i] = v < leftMargin ? leftMargin : v;
+    }
+}
+
+// Take the next wrapped piece of text starting at offset, at most maxUnits
+// (font units times size) wide. Returns the piece and its width in units,
+// and moves offset past it and the spaces it broke at.
+static std::string_view NextSegment(const TextFont &font, std::string_view text,
+                                    std::size_t &offset, std::uint32_t maxUnits,
+                                    std::uint32_t &segUnits) {
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(text.data());
+    const std::size_t start = offset;
+    std::size_t end = start;        // end of the last word that fits
+    std::uint32_t endUnits = 0;
+    std::uint32_t units = 0;
+    std::size_t i = start;
+
+    while (i < text.size()) {
+        // Spaces before the next word
+        std::size_t wordStart = i;
+        std::uint32_t spaceUnits = 0;
+        while (wordStart < text.size() && p[wordStart] == ' ') {
+            spaceUnits += font.SpaceAdvance();
+            wordStart++;
+        }
+        if (wordStart == text.size()) {
+            break; // only trailing spaces left
+        }
+
+        std::size_t wordEnd = wordStart;
+        std::uint32_t wordUnits = 0;
+        while (wordEnd < text.size() && p[wordEnd] != ' ') {
+            wordUnits += font.Advance(p, wordEnd, text.size());
+        }
+
+        if (units + spaceUnits + wordUnits <= maxUnits) {
+            units += spaceUnits + wordUnits;
+            end = wordEnd;
+            endUnits = units;
+            i = wordEnd;
+            continue;
+        }
+
+        if (end == start) {
+            // First word does not fit on its own: break it where it overflows,
+            // keeping at least one character (never part of one)
+            std::size_t cut = wordStart;
+            units = spaceUnits;
+            while (cut < wordEnd) {
+                std::size_t next = cut;
+                const std::uint32_t w = font.Advance(p, next, wordEnd);
+                if (cut != wordStart && units + w > maxUnits) {
+                    break;
+                }
+                units += w;
+                cut = next;
+            }
+            end = cut;
+            endUnits = units;
+        }
+        break;
+    }
+
+    offset = end;
+    while (offset < text.size() && p[offset] == ' ') {
+        offset++;
+    }
+    segUnits = endUnits;
+    return text.substr(start, end - start);
+}
+
+static std::uint32_t MaxUnits(const TextStyle &style) {
+    return static_cast<std::uint32_t>(usableWidth * 1000.0f / static_cast<float>(style.fontSize));
+}
+
+static float UnitsToWidth(const TextStyle &style, std::uint32_t units) {
+    return static_cast<float>(units) * static_cast<float>(style.fontSize) * 0.001f;
+}
+
+// Lay a fragment's lines out relative to its origin, stacking them the way
+// the engine stacks top or bottom lines. Lines with a {page} field are not
+// wrapped, since their width changes from page to page.
+static void LayoutFragment(Fragment &f, const TextFont &font) {
+    const PageSpec &spec = f.spec;
+    f.fixed.Clear();
+    f.fields.Clear();
+
+    // Pieces top to bottom with their steps, then positions
+    LineBuffer pieces;
+    std::vector<char> isField;
+    std::vector<float> steps;
+    for (std::size_t i = 0; i < spec.lines.size(); ++i) {
+        const LineSpec &ls = spec.lines[i];
+        const TextStyle &style = spec.StyleOf(ls);
+        const float step = static_cast<float>(style.fontSize + 4);
+        const bool field = ls.Text().find("{page}") != std::string_view::npos;
+
+        std::size_t offset = 0;
+        do {
+            std::string_view piece;
+            std::uint32_t units = 0;
+            if (field) {
+                piece = ls.Text();
+                offset = ls.Text().size();
+            } else {
+                piece = NextSegment(font, ls.Text(), offset, MaxUnits(style), units);
+            }
+            pieces.Push(piece, ls.style, style.align, UnitsToWidth(style, units), 0.0f);
+            isField.push_back(field);
+            steps.push_back(step);
+        } while (offset < ls.Text().size());
+    }
+    AlignLines(pieces, 0);
+
+    float height = 0.0f;
+    for (std::size_t k = 0; k < steps.size(); ++k) {
+        height += steps[k];
+    }
+    // Top flow: each line drops by its own step below the previous one.
+    // Bottom: each line rises by the step of the line beneath it.
+    float y = f.bottomAnchor ? height : 0.0f;
+    for (std::size_t k = 0; k < pieces.Size(); ++k) {
+        if (f.bottomAnchor) {
+            y -= steps[k];
+        }
+        pieces.y[k] = y;
+        if (!f.bottomAnchor) {
+            y -= steps[k];
+        }
+    }
+
+    f.height = height;
+    f.lastStep = steps.empty() ? 0.0f : steps.back();
+    f.minY = 0.0f;
+    f.maxY = 0.0f;
+    for (std::size_t k = 0; k < pieces.Size(); ++k) {
+        if (pieces.length[k] == 0) {
+            continue;
+        }
+        const float size = static_cast<float>(spec.styleTable->Get(pieces.style[k]).fontSize);
+        if (!isField[k]) {
+            f.minY = std::min(f.minY, pieces.y[k] - size * 0.25f);
+            f.maxY = std::max(f.maxY, pieces.y[k] + size);
+        }
+        (isField[k] ? f.fields : f.fixed).Push(pieces, k);
+    }
+    f.laidOut = true;
+}
+
+class LayoutEngine {
+public:
+    LayoutEngine()
+        : page(nullptr), fragments(nullptr), font(nullptr), lineIndex(0), lineOffset(0),
+          footerTop(0.0f), pagesDone(0) {}
+
+    // fragments must all have been through LayoutFragment
+    void Begin(const PageSpec &spec, const FragmentTable &fragmentTable, const TextFont &textFont) {
+        page = &spec;
+        fragments = &fragmentTable;
+        font = &textFont;
+        lineIndex = 0;
+        lineOffset = 0;
+        pagesDone = 0;
+
+        topLines.clear();
+        bottomLines.clear();
+        for (std::size_t i = 0; i < spec.lines.size(); ++i) {
+            const LineSpec &ls = spec.lines[i];
+            bool bottom = ls.fragment ? FragmentOf(ls).bottomAnchor : spec.StyleOf(ls).bottomAnchor;
+            (bottom ? bottomLines : topLines).push_back(static_cast<std::uint32_t>(i));
+        }
+
+        // The footer is the same on every page, so lay it out once, from
+        // bottomMargin up. Process in reverse so the last footer line in the
+        // file appears closest to the bottom.
+        footer.Clear();
+        footerFragments.clear();
+        float yBottom = bottomMarginY;
+        for (std::size_t i = bottomLines.size(); i-- > 0;) {
+            const LineSpec &ls = spec.lines[bottomLines[i]];
+            if (ls.fragment) {
+                const Fragment &f = FragmentOf(ls);
+                PlacedFragment placed;
+                placed.fragment = &f;
+                placed.y = yBottom;
+                footerFragments.push_back(placed);
+                yBottom += f.height;
+                continue;
+            }
+            const TextStyle &style = spec.StyleOf(ls);
+            const float step = static_cast<float>(style.fontSize + 4);
+
+            std::size_t first = footer.Size();
+            std::size_t offset = 0;
+            do {
+                std::uint32_t units = 0;
+                std::string_view piece = NextSegment(*font, ls.Text(), offset, MaxUnits(style),
+                                                     units);
+                footer.Push(piece, ls.style, style.align, UnitsToWidth(style, units), 0.0f);
+            } while (offset < ls.Text().size());
+
+            // Wrapped pieces were added top to bottom; stack them upwards
+            for (std::size_t k = footer.Size(); k-- > first;) {
+                footer.y[k] = yBottom;
+                yBottom += step;
+            }
+        }
+        AlignLines(footer, 0);
+        footerTop = yBottom;
+    }
+
+    // Lay out the next PDF page; false once the whole spec has been placed.
+    // A spec always yields at least one page, even without any lines.
+    bool NextPage(PageLayout &out) {
+        out.styles = page->styleTable;
+        out.lines.Clear();
+        out.fragments.clear();
+        if (pagesDone > 0 && lineIndex >= topLines.size()) {
+            return false;
+        }
+
+        float yTop = topMarginY;
+        bool placedText = false;
+
+        while (lineIndex < topLines.size()) {
+            const LineSpec &ls = page->lines[topLines[lineIndex]];
+            const TextStyle &style = page->StyleOf(ls);
+            const float step = static_cast<float>(style.fontSize + 4);
+
+            if (ls.fragment) {
+                // Placed whole: moved to the next page unless its last line
+                // fits above the footer as a text line would, but always
+                // placed at the top of a page so every page makes progress
+                const Fragment &f = FragmentOf(ls);
+                if (placedText && yTop - f.height + f.lastStep < footerTop) {
+                    break;
+                }
+                PlacedFragment placed;
+                placed.fragment = &f;
+                placed.y = yTop;
+                out.fragments.push_back(placed);
+                placedText = true;
+                yTop -= placed.fragment->height;
+                lineIndex++;
+                continue;
+            }
+
+            if (ls.Text().empty()) {
+                // Blank line: only spacing, and none at the top of a
+                // continuation page or once the page is full, where it
+                // would be dropped from the next page anyway
+                if ((pagesDone > 0 && !placedText) || yTop < footerTop) {
+                    lineIndex++;
+                    continue;
+                }
+                yTop -= step;
+                lineIndex++;
+                continue;
+            }
+
+            // Page full; always place something so every page makes progress
+            if (placedText && yTop < footerTop) {
+                break;
+            }
+
+            std::uint32_t units = 0;
+            std::string_view piece = NextSegment(*font, ls.Text(), lineOffset, MaxUnits(style),
+                                                 units);
+            out.lines.Push(piece, ls.style, style.align, UnitsToWidth(style, units), yTop);
+            placedText = true;
+
+            // Move down for next line
+            yTop -= step;
+            if (lineOffset >= ls.Text().size()) {
+                lineIndex++;
+                lineOffset = 0;
+            }
+        }
+
+        AlignLines(out.lines, 0);
+        out.lines.Append(footer);
+        out.fragments.insert(out.fragments.end(), footerFragments.begin(), footerFragments.end());
+        pagesDone++;
+        return true;
+    }
+
+private:
+    const Fragment &FragmentOf(const LineSpec &ls) const {
+        return fragments->Get(ls.fragment - 1);
+    }
+
+    const PageSpec *page;
+    const FragmentTable *fragments;
+    const TextFont *font;
+    std::vector<std::uint32_t> topLines;      // indexes into page->lines
+    std::vector<std::uint32_t> bottomLines;
+    LineBuffer footer;                        // aligned already
+    std::vector<PlacedFragment> footerFragments;
+    std::size_t lineIndex;      // next top line to place
+    std::size_t lineOffset;     // where in it, when it wrapped onto a new page
+    float footerTop;            // top lines must stay at or above this
+    int pagesDone;
+};
+
+// --- Build PDF content stream for one page ---
+
+// Content stream numbers are written with three decimals at most
+static long ToMilli(float v) {
+    return std::lround(static_cast<double>(v) * 1000.0);
+}
+
+// ToMilli over n values, rounding half away from zero the same way; the
+// select and the 32-bit result let the loop be vectorized. Values are
+// clamped to +-2e6 points, far outside any page.
+static void ToMilliAll(const float *v, std::size_t n, std::int32_t *out) {
+    for (std::size_t i = 0; i < n; ++i) {
+        double d = static_cast<double>(v[i]) * 1000.0;
+        d = d < -2e9 ? -2e9 : d > 2e9 ? 2e9 : d;
+        out[i] = static_cast<std::int32_t>(d + (d < 0.0 ? -0.5 : 0.5));
+    }
+}
+
+// Per-worker scratch for building content streams
+struct ContentScratch {
+    std::vector<std::int32_t> x;
+    std::vector<std::int32_t> y;
+    std::string fieldText;
+};
+
+// Text state carried between the lines of one BT ... ET block
+struct TextState {
+    const TextFont &font;
+    int fontSize;
+    long r, g, b;
+    long x, y;
+    explicit TextState(const TextFont &font)
+        : font(font), fontSize(0), r(-1), g(-1), b(-1), x(0), y(0) {}
+};
+
+// Tf and rg are only written when they differ from the current text state,
+// and each line is placed with a Td relative to the previous one (BT starts
+// at the origin). Positions are in thousandths of a point so the relative
+// moves add up exactly.
+static void AppendTextLine(std::string_view text, const TextStyle &style, long x, long y,
+                           TextState &ts, ByteBuffer &out) {
+    if (style.fontSize != ts.fontSize) {
+        out.Append("/F1 ");
+        out.AppendInt(style.fontSize);
+        out.Append(" Tf\n");
+        ts.fontSize = style.fontSize;
+    } else {
+        STATS_ADD(STAT_ELIDED_OPS, 1);
+    }
+
+    long r = ToMilli(style.r), g = ToMilli(style.g), b = ToMilli(style.b);
+    if (r != ts.r || g != ts.g || b != ts.b) {
+        out.AppendMilli(r);
+        out.Append(' ');
+        out.AppendMilli(g);
+        out.Append(' ');
+        out.AppendMilli(b);
+        out.Append(" rg\n");
+        ts.r = r; ts.g = g; ts.b = b;
+    } else {
+        STATS_ADD(STAT_ELIDED_OPS, 1);
+    }
+
+    out.AppendMilli(x - ts.x);
+    out.Append(' ');
+    out.AppendMilli(y - ts.y);
+    out.Append(" Td\n");
+    ts.x = x; ts.y = y;
+
+    ts.font.AppendShow(text, out);
+}
+
+// Every non-empty line of lines; the positions are converted in one pass
+// before any text is written
+static void AppendLines(const LineBuffer &lines, const StyleTable &styles, ContentScratch &scratch,
+                        TextState &ts, ByteBuffer &out) {
+    const std::size_t n = lines.Size();
+    scratch.x.resize(n);
+    scratch.y.resize(n);
+    ToMilliAll(lines.x.data(), n, scratch.x.data());
+    ToMilliAll(lines.y.data(), n, scratch.y.data());
+    for (std::size_t i = 0; i < n; ++i) {
+        if (lines.length[i] == 0) {
+            continue; // nothing to draw, only the spacing matters
+        }
+        AppendTextLine(lines.Text(i), styles.Get(lines.style[i]), scratch.x[i], scratch.y[i], ts,
+                       out);
+    }
+}
+
+// Appends the content stream for one laid-out page to out. pageNumber
+// fills the {page} fields of the page's fragments.
+static void BuildPageContent(const PageLayout &layout, int pageNumber, const TextFont &font,
+                             ContentScratch &scratch, ByteBuffer &out) {
+    const StyleTable &styles = *layout.styles;
+    out.Append("BT\n");
+
+    TextState ts(font);
+    AppendLines(layout.lines, styles, scratch, ts, out);
+
+    std::string &fieldText = scratch.fieldText;
+    char number[16];
+    int numberLen = std::snprintf(number, sizeof(number), "%d", pageNumber);
+    for (std::size_t i = 0; i < layout.fragments.size(); ++i) {
+        const PlacedFragment &placed = layout.fragments[i];
+        const LineBuffer &fields = placed.fragment->fields;
+        for (std::size_t k = 0; k < fields.Size(); ++k) {
+            std::string_view text = fields.Text(k);
+            fieldText.assign(text.data(), text.size());
+            for (std::size_t at = fieldText.find("{page}"); at != std::string::npos;
+                 at = fieldText.find("{page}", at + static_cast<std::size_t>(numberLen))) {
+                fieldText.replace(at, 6, number, static_cast<std::size_t>(numberLen));
+            }
+            const TextStyle &style = styles.Get(fields.style[k]);
+            float x = LineX(style, font.TextWidth(fieldText, style.fontSize));
+            AppendTextLine(fieldText, style, ToMilli(x), ToMilli(placed.y + fields.y[k]), ts, out);
+        }
+    }
+
+    out.Append("ET\n");
+
+    for (std::size_t i = 0; i < layout.fragments.size(); ++i) {
+        const PlacedFragment &placed = layout.fragments[i];
+        if (placed.fragment->fixed.Empty()) {
+            continue;
+        }
+        out.Append("q 1 0 0 1 0 ");
+        out.AppendMilli(ToMilli(placed.y));
+        out.Append(" cm /Fr");
+        out.AppendInt(placed.fragment->id);
+        out.Append(" Do Q\n");
+    }
+}
+
+// Content stream of a fragment's Form XObject: its fixed lines, relative
+// to the fragment's origin
+static void BuildFragmentContent(const Fragment &f, const TextFont &font, ContentScratch &scratch,
+                                 ByteBuffer &out) {
+    out.Append("BT\n");
+    TextState ts(font);
+    AppendLines(f.fixed, *f.spec.styleTable, scratch, ts, out);
+    out.Append("ET\n");
+}
+
+// --- Compression ---
+
+// zlib/deflate encode data for a /FlateDecode stream
+static bool FlateEncode(const ByteBuffer &in, int level, ByteBuffer &out) {
+    STATS_SCOPE(STAGE_COMPRESS);
+    out.Clear();
+    uLongf outLen = compressBound(static_cast<uLong>(in.Size()));
+    char *dst = out.Reserve(static_cast<std::size_t>(outLen));
+    int rc = compress2(reinterpret_cast<Bytef *>(dst), &outLen,
+                       reinterpret_cast<const Bytef *>(in.Data()),
+                       static_cast<uLong>(in.Size()), level);
+    if (rc != Z_OK) {
+        return false;
+    }
+    out.Commit(static_cast<std::size_t>(outLen));
+    return true;
+}
+
+// --- Page cache ---
+// Finished content streams, keyed by everything that goes into them: the
+// page's lines and styles, the fragments it uses and the compression
+// level. Entries live in a directory, one file per parsed page, and are
+// reused across runs; identical streams within a document also share one
+// content object. Bump pageCacheVersion whenever the content a page
+// produces changes, so stale entries stop matching.
+
+static const char pageCacheVersion[] = "layout2pdf-page-cache-4";
+
+struct ContentHash {
+    std::uint64_t lo;
+    std::uint64_t hi;
+
+    bool operator==(const ContentHash &o) const {
+        return lo == o.lo && hi == o.hi;
+    }
+};
+
+struct ContentHashHasher {
+    std::size_t operator()(const ContentHash &h) const {
+        return static_cast<std::size_t>(h.lo);
+    }
+};
+
+static inline std::uint64_t Mix64(std::uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static std::uint64_t HashBytes(const char *data, std::size_t n, std::uint64_t seed) {
+    std::uint64_t h = seed ^ (static_cast<std::uint64_t>(n) * 0x9e3779b97f4a7c15ULL);
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        std::uint64_t w;
+        std::memcpy(&w, data + i, 8);
+        h ^= Mix64(w);
+        h = ((h << 27) | (h >> 37)) * 0x9e3779b97f4a7c15ULL + 0x52dce729ULL;
+    }
+    if (i < n) {
+        std::uint64_t w = 0;
+        std::memcpy(&w, data + i, n - i);
+        h ^= Mix64(w);
+    }
+    return Mix64(h);
+}
+
+static ContentHash HashContent(const char *data, std::size_t n) {
+    ContentHash h;
+    h.lo = HashBytes(data, n, 0x243f6a8885a308d3ULL);
+    h.hi = HashBytes(data, n, 0x13198a2e03707344ULL);
+    return h;
+}
+
+static ContentHash HashContent(const ByteBuffer &data) {
+    return HashContent(data.Data(), data.Size());
+}
+
+static void AppendKeyText(ByteBuffer &key, std::string_view text) {
+    key.AppendInt(static_cast<long>(text.size()));
+    key.Append(':');
+    if (!text.empty()) {
+        key.Append(text.data(), text.size());   // blank lines have no data
+    }
+}
+
+static void AppendKeyLines(ByteBuffer &key, const PageSpec &spec) {
+    for (std::size_t i = 0; i < spec.lines.size(); ++i) {
+        const LineSpec &ls = spec.lines[i];
+        const TextStyle &style = spec.StyleOf(ls);
+        key.Append('L');
+        key.AppendInt(static_cast<long>(ls.fragment));
+        key.Append(' ');
+        key.AppendInt(style.fontSize);
+        key.Append(' ');
+        key.AppendMilli(ToMilli(style.r));
+        key.Append(' ');
+        key.AppendMilli(ToMilli(style.g));
+        key.Append(' ');
+        key.AppendMilli(ToMilli(style.b));
+        key.Append(' ');
+        key.AppendInt(style.align);
+        key.Append(style.bottomAnchor ? 'b' : 't');
+        AppendKeyText(key, ls.Text());
+    }
+}
+
+// Everything the content streams of spec depend on. fontKey identifies an
+// embedded font, empty for Helvetica. pageDependent is set when a fragment
+// it uses has {page} fields; the caller must then add the first page number.
+static void BuildPageKey(const PageSpec &spec, const FragmentTable &fragments, int compressLevel,
+                         std::string_view fontKey, ByteBuffer &key, bool &pageDependent) {
+    key.Clear();
+    key.Append(pageCacheVersion);
+    key.Append(" z");
+    key.AppendInt(compressLevel);
+    if (!fontKey.empty()) {
+        key.Append(" f");
+        key.Append(fontKey.data(), fontKey.size());
+    }
+    key.Append('\n');
+    AppendKeyLines(key, spec);
+
+    pageDependent = false;
+    std::vector<std::uint32_t> used;   // each fragment once, in first-use order
+    for (std::size_t i = 0; i < spec.lines.size(); ++i) {
+        std::uint32_t ref = spec.lines[i].fragment;
+        if (ref == 0 || std::find(used.begin(), used.end(), ref) != used.end()) {
+            continue;
+        }
+        used.push_back(ref);
+        const Fragment &f = fragments.Get(ref - 1);
+        key.Append("\nF");
+        key.AppendInt(f.id);
+        key.Append(f.bottomAnchor ? 'b' : 't');
+        key.Append('\n');
+        AppendKeyLines(key, f.spec);
+        pageDependent = pageDependent || !f.fields.Empty();
+    }
+}
+
+// Little-endian 64-bit fields of page cache entries and layout indexes
+static void AppendLeU64(ByteBuffer &out, std::uint64_t v) {
+    for (int i = 0; i < 8; ++i) {
+        out.Append(static_cast<char>((v >> (8 * i)) & 0xff));
+    }
+}
+
+static bool ReadLeU64(const char *&p, const char *end, std::uint64_t &v) {
+    if (end - p < 8) {
+        return false;
+    }
+    v = 0;
+    for (int i = 0; i < 8; ++i) {
+        v |= static_cast<std::uint64_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+    }
+    p += 8;
+    return true;
+}
+
+// A name beside path for writing it before a rename: unique to this process
+// and call, so concurrent writers never share one
+static std::string TemporaryPathFor(const std::string &path) {
+    static std::atomic<unsigned long> serial(0);
+    std::string tmp = path + ".tmp";
+#ifdef LAYOUT2PDF_HAVE_MMAP
+    tmp += std::to_string(static_cast<long>(::getpid()));
+#endif
+    tmp += "-" + std::to_string(serial.fetch_add(1));
+    return tmp;
+}
+
+// Write data to path through a temporary file and a rename, so readers in
+// other threads or processes never see half of it. False if nothing was
+// written; path is then left as it was.
+static bool WriteFileAtomically(const std::string &path, const ByteBuffer &data) {
+    std::string tmp = TemporaryPathFor(path);
+    std::FILE *f = std::fopen(tmp.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    bool ok = std::fwrite(data.Data(), 1, data.Size(), f) == data.Size();
+    ok = (std::fclose(f) == 0) && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+class PageCache {
+public:
+    PageCache() : enabled(false) {}
+
+    // Use dir, creating it if needed
+    bool Open(const std::string &dir) {
+        directory = dir;
+#ifdef LAYOUT2PDF_HAVE_MMAP
+        if (::mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {
+            return false;
+        }
+        struct stat st;
+        if (::stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+            return false;
+        }
+#endif
+        enabled = true;
+        return true;
+    }
+
+    bool Enabled() const {
+        return enabled;
+    }
+
+    // Fill streams with the entry for key; false on a miss. The key itself
+    // is stored in the entry and compared, so a hash collision is a miss.
+    bool Load(const ByteBuffer &key, std::vector<ByteBuffer> &streams, std::vector<char> &deflated,
+              std::size_t &count, ByteBuffer &scratch) const {
+        std::FILE *f = std::fopen(EntryPath(key).c_str(), "rb");
+        if (!f) {
+            return false;
+        }
+        scratch.Clear();
+        char chunk[16 * 1024];
+        std::size_t got;
+        while ((got = std::fread(chunk, 1, sizeof(chunk), f)) > 0) {
+            scratch.Append(chunk, got);
+        }
+        std::fclose(f);
+
+        // key size, key, stream count, then per stream: deflated, size, bytes
+        const char *p = scratch.Data();
+        const char *end = p + scratch.Size();
+        std::uint64_t keySize, numStreams;
+        if (!ReadLeU64(p, end, keySize) || static_cast<std::uint64_t>(end - p) < keySize ||
+            keySize != key.Size() || std::memcmp(p, key.Data(), key.Size()) != 0) {
+            return false;
+        }
+        p += keySize;
+        if (!ReadLeU64(p, end, numStreams) || numStreams == 0 || numStreams > (1u << 20)) {
+            return false;
+        }
+        while (streams.size() < numStreams) {
+            streams.emplace_back();
+            deflated.push_back(0);
+        }
+        for (std::size_t k = 0; k < numStreams; ++k) {
+            std::uint64_t size;
+            if (p == end) {
+                return false;
+            }
+            deflated[k] = *p++;
+            if (!ReadLeU64(p, end, size) || static_cast<std::uint64_t>(end - p) < size) {
+                return false;
+            }
+            streams[k].Clear();
+            streams[k].Append(p, static_cast<std::size_t>(size));
+            p += size;
+        }
+        count = static_cast<std::size_t>(numStreams);
+        return true;
+    }
+
+    // Written atomically, so readers in other threads or processes never see
+    // half an entry
+    void Store(const ByteBuffer &key, const std::vector<ByteBuffer> &streams,
+               const std::vector<char> &deflated, std::size_t count, ByteBuffer &scratch) const {
+        scratch.Clear();
+        AppendLeU64(scratch, key.Size());
+        scratch.Append(key);
+        AppendLeU64(scratch, count);
+        for (std::size_t k = 0; k < count; ++k) {
+            scratch.Append(deflated[k]);
+            AppendLeU64(scratch, streams[k].Size());
+            scratch.Append(streams[k]);
+        }
+        WriteFileAtomically(EntryPath(key), scratch);
+    }
+
+private:
+    std::string EntryPath(const ByteBuffer &key) const {
+        ContentHash h = HashContent(key);
+        char name[40];
+        std::snprintf(name, sizeof(name), "%016llx%016llx",
+                      static_cast<unsigned long long>(h.hi), static_cast<unsigned long long>(h.lo));
+        return directory + "/" + name + ".page";
+    }
+
+    std::string directory;
+    bool enabled;
+};
+
+// --- Layout index ---
+// Where each page of a layout file starts and ends, so that --pages can
+// parse only the pages asked for. Styles do not carry over from one page
+// to the next (each page's opening directive sets the whole style), so the
+// state a page is entered with is the set of fragment definitions in
+// effect: the index lists every definition with its name, and each page
+// records how many come before it. It is kept next to the layout as
+// <layout>.idx and rebuilt when the layout's size, inode, modification or
+// status change times (to the nanosecond) or first and last bytes stop
+// matching, or when a block it points at no longer starts with a
+// directive and ends with a closing tag.
+
+static const char layoutIndexVersion[] = "layout2pdf-layout-index-2\n";
+
+#ifdef LAYOUT2PDF_HAVE_MMAP
+// Modification and status change times of st, in nanoseconds
+static void FileTimes(const struct stat &st, std::uint64_t &mtime, std::uint64_t &ctime) {
+#if defined(__APPLE__)
+    const struct timespec &m = st.st_mtimespec, &c = st.st_ctimespec;
+#else
+    const struct timespec &m = st.st_mtim, &c = st.st_ctim;
+#endif
+    mtime = static_cast<std::uint64_t>(m.tv_sec) * 1000000000ULL + static_cast<std::uint64_t>(m.tv_nsec);
+    ctime = static_cast<std::uint64_t>(c.tv_sec) * 1000000000ULL + static_cast<std::uint64_t>(c.tv_nsec);
+}
+#endif
+
+struct LayoutStamp {
+    std::uint64_t size;
+    std::uint64_t inode;
+    std::uint64_t mtime;     // nanoseconds
+    std::uint64_t ctime;
+    std::uint64_t ends;      // hash of the first and last 4 KB
+
+    bool operator==(const LayoutStamp &o) const {
+        return size == o.size && inode == o.inode && mtime == o.mtime && ctime == o.ctime &&
+               ends == o.ends;
+    }
+};
+
+class LayoutIndex {
+public:
+    // Byte range [begin, end) of a block, from its opening line to the end
+    // of its closing tag
+    struct Block {
+        std::uint64_t begin;
+        std::uint64_t end;
+    };
+
+    struct Page {
+        Block block;
+        std::uint64_t fragmentsBefore;   // definitions preceding the page
+    };
+
+    struct FragmentDef {
+        Block block;
+        std::string name;
+    };
+
+    LayoutIndex() : stamp() {}
+
+    // Identify the layout file path, whose contents are text
+    static bool Stamp(const std::string &path, std::string_view text, LayoutStamp &stamp) {
+#ifdef LAYOUT2PDF_HAVE_MMAP
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0 || static_cast<std::uint64_t>(st.st_size) != text.size()) {
+            return false;
+        }
+        const std::size_t edge = text.size() < 4096 ? text.size() : 4096;
+        stamp.size = text.size();
+        stamp.inode = static_cast<std::uint64_t>(st.st_ino);
+        FileTimes(st, stamp.mtime, stamp.ctime);
+        stamp.ends = HashBytes(text.data(), edge, 0x243f6a8885a308d3ULL) ^
+                     Mix64(HashBytes(text.data() + text.size() - edge, edge, 0x13198a2e03707344ULL));
+        return true;
+#else
+        (void)path;
+        (void)text;
+        (void)stamp;
+        return false;
+#endif
+    }
+
+    // Index text, following the parser's rules for where pages and
+    // fragments begin and end. False when it defines more fragments than a
+    // document can hold.
+    bool Build(std::string_view text, const LayoutStamp &textStamp) {
+        STATS_SCOPE(STAGE_PARSE);
+        stamp = textStamp;
+        pages.clear();
+        fragments.clear();
+        std::unordered_map<std::string, bool> defined;
+        std::string probe;
+
+        LayoutReader reader;
+        reader.OpenMemory(text.data(), text.size());
+        LayoutLine raw;
+        Page page = Page();
+        bool inPage = false;
+        bool inFragment = false;
+        bool pageHasLines = false;   // an unclosed last page counts only then
+        while (reader.NextLine(raw)) {
+            const std::uint64_t lineBegin = static_cast<std::uint64_t>(raw.text.data() - text.data());
+            const std::uint64_t lineEnd = lineBegin + raw.text.size();
+            std::string_view line = Trim(raw.text.substr(0, raw.commentPos));
+            if (line.empty()) {
+                pageHasLines = pageHasLines || (inPage && raw.commentPos == std::string_view::npos);
+                continue;
+            }
+            if (!raw.directive) {
+                pageHasLines = pageHasLines || inPage;
+                continue;
+            }
+            if (line.size() > 1 && line[1] == '/') {
+                if (inFragment) {
+                    fragments.back().block.end = lineEnd;
+                    inFragment = false;
+                } else if (inPage) {
+                    page.block.end = lineEnd;
+                    pages.push_back(page);
+                    inPage = false;
+                }
+                continue;
+            }
+            std::size_t closePos = line.find(']');
+            if (closePos == std::string_view::npos) {
+                continue;
+            }
+            std::string_view tag = Trim(line.substr(1, closePos - 1));
+            if (tag.size() > 4 && tag.substr(0, 4) == "use ") {
+                if (inPage) {
+                    std::string_view name = Trim(tag.substr(4));
+                    probe.assign(name.data(), name.size());
+                    pageHasLines = pageHasLines || defined.count(probe) > 0;
+                }
+                continue;
+            }
+            if (tag.size() > 9 && tag.substr(0, 9) == "fragment ") {
+                if (inPage || inFragment) {
+                    continue;
+                }
+                if (fragments.size() == FragmentTable::maxFragments) {
+                    return false;
+                }
+                FragmentDef def;
+                def.block.begin = lineBegin;
+                def.block.end = text.size();   // unless closed
+                def.name = std::string(Trim(tag.substr(9)));
+                defined[def.name] = true;
+                fragments.push_back(std::move(def));
+                inFragment = true;
+            } else if (!inPage && !inFragment) {
+                inPage = true;
+                pageHasLines = false;
+                page.block.begin = lineBegin;
+                page.fragmentsBefore = fragments.size();
+            }
+        }
+        if (inPage && pageHasLines) {
+            page.block.end = text.size();
+            pages.push_back(page);
+        }
+        return true;
+    }
+
+    // Read the index at path; false if it is missing, damaged or not for
+    // the layout identified by expected
+    bool Load(const std::string &path, const LayoutStamp &expected) {
+        pages.clear();
+        fragments.clear();
+        std::FILE *f = std::fopen(path.c_str(), "rb");
+        if (!f) {
+            return false;
+        }
+        ByteBuffer &data = scratch;
+        data.Clear();
+        char chunk[16 * 1024];
+        std::size_t got;
+        while ((got = std::fread(chunk, 1, sizeof(chunk), f)) > 0) {
+            data.Append(chunk, got);
+        }
+        std::fclose(f);
+
+        // version, stamp, definitions (range, name), pages (range, fragments before)
+        const std::size_t versionSize = sizeof(layoutIndexVersion) - 1;
+        const char *p = data.Data();
+        const char *end = p + data.Size();
+        if (data.Size() < versionSize || std::memcmp(p, layoutIndexVersion, versionSize) != 0) {
+            return false;
+        }
+        p += versionSize;
+        std::uint64_t count;
+        if (!ReadLeU64(p, end, stamp.size) || !ReadLeU64(p, end, stamp.inode) ||
+            !ReadLeU64(p, end, stamp.mtime) || !ReadLeU64(p, end, stamp.ctime) ||
+            !ReadLeU64(p, end, stamp.ends) || !(stamp == expected) ||
+            !ReadLeU64(p, end, count) || count > FragmentTable::maxFragments) {
+            return false;
+        }
+        fragments.resize(static_cast<std::size_t>(count));
+        for (FragmentDef &def : fragments) {
+            std::uint64_t nameSize;
+            if (!ReadBlock(p, end, def.block) || !ReadLeU64(p, end, nameSize) ||
+                static_cast<std::uint64_t>(end - p) < nameSize) {
+                return false;
+            }
+            def.name.assign(p, static_cast<std::size_t>(nameSize));
+            p += nameSize;
+        }
+        if (!ReadLeU64(p, end, count) || count > static_cast<std::uint64_t>(end - p) / 24) {
+            return false;
+        }
+        pages.resize(static_cast<std::size_t>(count));
+        for (Page &page : pages) {
+            if (!ReadBlock(p, end, page.block) || !ReadLeU64(p, end, page.fragmentsBefore) ||
+                page.fragmentsBefore > fragments.size()) {
+                return false;
+            }
+        }
+        return p == end;
+    }
+
+    // Write the index atomically, like a page cache entry. Failing to is not
+    // an error: the index is only rebuilt next time.
+    void Store(const std::string &path) {
+        ByteBuffer &data = scratch;
+        data.Clear();
+        data.Append(layoutIndexVersion);
+        AppendLeU64(data, stamp.size);
+        AppendLeU64(data, stamp.inode);
+        AppendLeU64(data, stamp.mtime);
+        AppendLeU64(data, stamp.ctime);
+        AppendLeU64(data, stamp.ends);
+        AppendLeU64(data, fragments.size());
+        for (const FragmentDef &def : fragments) {
+            AppendBlock(data, def.block);
+            AppendLeU64(data, def.name.size());
+            data.Append(def.name.data(), def.name.size());
+        }
+        AppendLeU64(data, pages.size());
+        for (const Page &page : pages) {
+            AppendBlock(data, page.block);
+            AppendLeU64(data, page.fragmentsBefore);
+        }
+        WriteFileAtomically(path, data);
+    }
+
+    std::size_t PageCount() const {
+        return pages.size();
+    }
+
+    const Page &GetPage(std::size_t i) const {
+        return pages[i];
+    }
+
+    std::size_t FragmentCount() const {
+        return fragments.size();
+    }
+
+    const FragmentDef &GetFragment(std::size_t k) const {
+        return fragments[k];
+    }
+
+    // The definition a [use name] on page i refers to, or -1
+    int FindFragment(std::string_view name, std::size_t i) const {
+        for (std::size_t k = static_cast<std::size_t>(pages[i].fragmentsBefore); k-- > 0;) {
+            if (fragments[k].name == name) {
+                return static_cast<int>(k);
+            }
+        }
+        return -1;
+    }
+
+    // Whether block of text still looks like one the index recorded: its
+    // first line is a directive and its last a closing tag, unless it runs
+    // to the end of the text
+    static bool Intact(std::string_view text, const Block &block) {
+        if (block.begin >= block.end || block.end > text.size()) {
+            return false;
+        }
+        std::string_view body = text.substr(static_cast<std::size_t>(block.begin),
+                                            static_cast<std::size_t>(block.end - block.begin));
+        std::string_view head = Trim(body.substr(0, body.find('\n')));
+        if (head.empty() || head[0] != '[') {
+            return false;
+        }
+        if (block.end == text.size()) {
+            return true;
+        }
+        std::size_t lastLine = body.rfind('\n');
+        std::string_view tail = Trim(body.substr(lastLine == std::string_view::npos ? 0 : lastLine + 1));
+        return tail.size() > 1 && tail[0] == '[' && tail[1] == '/' &&
+               (tail.size() == 2 || tail[2] != '/');
+    }
+
+    // Hash of the text of block
+    static ContentHash HashBlock(std::string_view text, const Block &block) {
+        return HashContent(text.data() + block.begin, static_cast<std::size_t>(block.end - block.begin));
+    }
+
+    void Swap(LayoutIndex &other) {
+        std::swap(stamp, other.stamp);
+        pages.swap(other.pages);
+        fragments.swap(other.fragments);
+    }
+
+    // The definitions a [use NAME] on page i can refer to, the latest of
+    // each name, in file order
+    void FragmentsAt(std::size_t i, std::vector<Block> &out) const {
+        out.clear();
+        std::unordered_map<std::string_view, bool> seen;
+        for (std::size_t k = static_cast<std::size_t>(pages[i].fragmentsBefore); k-- > 0;) {
+            if (seen.emplace(fragments[k].name, true).second) {
+                out.push_back(fragments[k].block);
+            }
+        }
+        std::reverse(out.begin(), out.end());
+    }
+
+private:
+    static void AppendBlock(ByteBuffer &out, const Block &block) {
+        AppendLeU64(out, block.begin);
+        AppendLeU64(out, block.end);
+    }
+
+    bool ReadBlock(const char *&p, const char *end, Block &block) const {
+        return ReadLeU64(p, end, block.begin) && ReadLeU64(p, end, block.end) &&
+               block.begin < block.end && block.end <= stamp.size;
+    }
+
+    LayoutStamp stamp;
+    std::vector<Page> pages;
+    std::vector<FragmentDef> fragments;   // in file order
+    ByteBuffer scratch;
+};
+
+// --- Output sinks ---
+// Where PdfWriter's bytes go: a file on disk, or a buffer in memory when the
+// PDF is sent back over a connection. Files are written either in line
+// (FileSink) or overlapped with the conversion (AsyncFileSink).
+
+class OutputSink {
+public:
+    virtual ~OutputSink() {}
+    virtual void Write(const char *data, std::size_t n) = 0;
+    // False once any write has failed
+    virtual bool Good() const = 0;
+    // Flush and release the output; false if anything failed
+    virtual bool Close() = 0;
+};
+
+class FileSink : public OutputSink {
+public:
+    // append adds to the end of an existing file instead of replacing it
+    bool Open(const std::string &filename, bool append = false) {
+        if (out.is_open()) {
+            out.close();
+        }
+        out.clear();
+        out.open(filename.c_str(), append ? std::ios::binary | std::ios::app : std::ios::binary);
+        return out.is_open();
+    }
+
+    void Write(const char *data, std::size_t n) override {
+        out.write(data, static_cast<std::streamsize>(n));
+    }
+
+    bool Good() const override {
+        return !out.fail();
+    }
+
+    bool Close() override {
+        if (out.is_open()) {
+            out.close();
+        }
+        return !out.fail();
+    }
+
+private:
+    std::ofstream out;
+};
+
+// Standard output, written as the document is built so a consumer
+// downstream can start before conversion finishes
+class StreamSink : public OutputSink {
+public:
+    explicit StreamSink(std::ostream &out) : out(out) {}
+
+    void Write(const char *data, std::size_t n) override {
+        out.write(data, static_cast<std::streamsize>(n));
+    }
+
+    bool Good() const override {
+        return !out.fail();
+    }
+
+    bool Close() override {
+        out.flush();
+        return !out.fail();
+    }
+
+private:
+    std::ostream &out;
+};
+
+class MemorySink : public OutputSink {
+public:
+    explicit MemorySink(ByteBuffer &buf) : buf(buf) {}
+
+    void Write(const char *data, std::size_t n) override {
+        buf.Append(data, n);
+    }
+
+    bool Good() const override {
+        return true;
+    }
+
+    bool Close() override {
+        return true;
+    }
+
+private:
+    ByteBuffer &buf;
+};
+
+// How output files are written: FILE_WRITE_SYNC through an ofstream, the
+// others through AsyncFileSink. FILE_WRITE_AUTO takes io_uring when the
+// kernel has it and a writer thread otherwise.
+enum FileWriteMode {
+    FILE_WRITE_SYNC,
+    FILE_WRITE_AUTO,
+    FILE_WRITE_THREAD,
+    FILE_WRITE_URING
+};
+
+#if defined(LAYOUT2PDF_HAVE_IO_URING)
+// Just enough of io_uring to keep a few writes in flight: one submission
+// per buffer, completions reaped in whatever order they finish. Only the
+// thread that owns the sink touches the rings.
+class IoRing {
+public:
+    IoRing()
+        : fd(-1), sqRing(nullptr), cqRing(nullptr), sqes(nullptr), sqRingSize(0),
+          cqRingSize(0), sqesSize(0), sqTail(nullptr), sqArray(nullptr), sqMask(0),
+          cqHead(nullptr), cqTail(nullptr), cqes(nullptr), cqMask(0) {}
+
+    ~IoRing() {
+        Close();
+    }
+
+    // False if the kernel has no io_uring (or it is disabled)
+    static bool Supported() {
+        IoRing probe;
+        return probe.Setup(1);
+    }
+
+    bool Ready() const {
+        return fd >= 0;
+    }
+
+    bool Setup(unsigned entries) {
+        Close();
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        long r = syscall(__NR_io_uring_setup, entries, &params);
+        if (r < 0) {
+            return false;
+        }
+        fd = static_cast<int>(r);
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMap) {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+        sqRing = Map(sqRingSize, IORING_OFF_SQ_RING);
+        cqRing = singleMap ? sqRing : Map(cqRingSize, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void *entriesMap = Map(sqesSize, IORING_OFF_SQES);
+        if (!sqRing || !cqRing || !entriesMap) {
+            if (entriesMap) {
+                munmap(entriesMap, sqesSize);
+            }
+            Close();
+            return false;
+        }
+        sqes = static_cast<io_uring_sqe *>(entriesMap);
+
+        char *sq = static_cast<char *>(sqRing);
+        sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        char *cq = static_cast<char *>(cqRing);
+        cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        return true;
+    }
+
+    void Close() {
+        if (sqes) {
+            munmap(sqes, sqesSize);
+        }
+        if (cqRing && cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        if (sqRing) {
+            munmap(sqRing, sqRingSize);
+        }
+        sqes = nullptr;
+        sqRing = cqRing = nullptr;
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    // Queue a write of iov (which must stay valid until it completes) at
+    // offset in fileFd, and hand it to the kernel
+    bool SubmitWrite(int fileFd, const iovec *iov, long long offset, std::uint64_t tag) {
+        const unsigned tail = *sqTail;
+        const unsigned index = tail & sqMask;
+        io_uring_sqe &sqe = sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITEV;
+        sqe.fd = fileFd;
+        sqe.off = static_cast<std::uint64_t>(offset);
+        sqe.addr = reinterpret_cast<std::uint64_t>(iov);
+        sqe.len = 1;
+        sqe.user_data = tag;
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        for (;;) {
+            long r = syscall(__NR_io_uring_enter, fd, 1, 0, 0, nullptr, 0);
+            if (r >= 0) {
+                return r == 1;
+            }
+            if (errno != EINTR) {
+                return false;
+            }
+        }
+    }
+
+    // Block until a write completes; result is its byte count or -errno
+    bool Reap(std::uint64_t &tag, int &result) {
+        for (;;) {
+            const unsigned head = *cqHead;
+            if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+                const io_uring_cqe &cqe = cqes[head & cqMask];
+                tag = cqe.user_data;
+                result = cqe.res;
+                __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+            long r = syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (r < 0 && errno != EINTR) {
+                return false;
+            }
+        }
+    }
+
+private:
+    void *Map(std::size_t size, long long offset) {
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                       static_cast<off_t>(offset));
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    int fd;
+    void *sqRing;
+    void *cqRing;
+    io_uring_sqe *sqes;
+    std::size_t sqRingSize;
+    std::size_t cqRingSize;
+    std::size_t sqesSize;
+    unsigned *sqTail;
+    unsigned *sqArray;
+    unsigned sqMask;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    io_uring_cqe *cqes;
+    unsigned cqMask;
+};
+#endif
+
+#if defined(LAYOUT2PDF_HAVE_ASYNC_WRITE)
+// A file written through a few large buffers: Write copies into the
+// current one, and a full buffer goes to the kernel (io_uring) or to a
+// writer thread (pwrite) while the next one fills, so the converter only
+// stalls when every buffer is still in flight. With direct I/O the file is
+// opened O_DIRECT, where the filesystem allows it; buffers and offsets are
+// then block aligned, the last write is padded and the file cut back to
+// size in Close. The ring, the thread and the buffers outlive Close, for
+// the next file.
+class AsyncFileSink : public OutputSink {
+public:
+    static const int bufferCount = 4;
+    static const std::size_t bufferSize = 1 << 20;
+    static const std::size_t directAlign = 4096;
+
+    AsyncFileSink()
+        : fd(-1), useRing(false), direct(false), failed(false), current(0), fill(0),
+          fileOffset(0), stopping(false) {}
+
+    ~AsyncFileSink() {
+        Close();
+        if (writer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            queued.notify_one();
+            writer.join();
+        }
+        for (Buffer &b : buffers) {
+            std::free(b.data);
+        }
+    }
+
+    // mode is FILE_WRITE_AUTO, FILE_WRITE_THREAD or FILE_WRITE_URING; the
+    // last fails if io_uring is not available
+    bool Open(const std::string &filename, FileWriteMode mode, bool directIo) {
+        Close();
+        for (Buffer &b : buffers) {
+            if (!b.data) {
+                b.data = static_cast<char *>(std::aligned_alloc(directAlign, bufferSize));
+                if (!b.data) {
+                    return false;
+                }
+            }
+            b.busy = false;
+            b.ok = true;
+        }
+        useRing = false;
+#if defined(LAYOUT2PDF_HAVE_IO_URING)
+        if (mode != FILE_WRITE_THREAD) {
+            useRing = ring.Ready() || ring.Setup(bufferCount);
+        }
+#endif
+        if (mode == FILE_WRITE_URING && !useRing) {
+            return false;
+        }
+        if (!useRing && !writer.joinable()) {
+            writer = std::thread([this]() { WriterLoop(); });
+        }
+
+        const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        direct = false;
+#if defined(O_DIRECT)
+        if (directIo) {
+            fd = open(filename.c_str(), flags | O_DIRECT, 0666);
+            direct = fd >= 0;
+        }
+#else
+        (void)directIo;
+#endif
+        if (fd < 0) {
+            fd = open(filename.c_str(), flags, 0666);
+        }
+        if (fd < 0) {
+            return false;
+        }
+        failed = false;
+        current = 0;
+        fill = 0;
+        fileOffset = 0;
+        return true;
+    }
+
+    void Write(const char *data, std::size_t n) override {
+        while (n > 0 && !failed) {
+            std::size_t take = std::min(n, bufferSize - fill);
+            std::memcpy(buffers[current].data + fill, data, take);
+            fill += take;
+            data += take;
+            n -= take;
+            if (fill == bufferSize) {
+                Submit(current, fill);
+                current = (current + 1) % bufferCount;
+                fill = 0;
+                WaitIdle(current);
+            }
+        }
+    }
+
+    // Errors from writes still in flight only show up in Close
+    bool Good() const override {
+        return !failed;
+    }
+
+    bool Close() override {
+        if (fd < 0) {
+            return !failed;
+        }
+        std::size_t padding = 0;
+        if (fill > 0 && !failed) {
+            if (direct) {
+                padding = (directAlign - fill % directAlign) % directAlign;
+                std::memset(buffers[current].data + fill, 0, padding);
+            }
+            Submit(current, fill + padding);
+        }
+        for (int i = 0; i < bufferCount; ++i) {
+            WaitIdle(i);
+        }
+        if (padding > 0 && !failed &&
+            ftruncate(fd, static_cast<off_t>(fileOffset - static_cast<long long>(padding))) != 0) {
+            failed = true;
+        }
+        if (close(fd) != 0) {
+            failed = true;
+        }
+        fd = -1;
+        fill = 0;
+        return !failed;
+    }
+
+private:
+    struct Buffer {
+        Buffer() : data(nullptr), length(0), written(0), offset(0), busy(false), ok(true) {}
+        char *data;
+        std::size_t length;
+        std::size_t written;  // io_uring: bytes done, when a write came back short
+        long long offset;
+        bool busy;            // in flight
+        bool ok;
+#if defined(LAYOUT2PDF_HAVE_IO_URING)
+        iovec iov;
+#endif
+    };
+
+    void Submit(int i, std::size_t length) {
+        Buffer &b = buffers[i];
+        b.length = length;
+        b.written = 0;
+        b.offset = fileOffset;
+        fileOffset += static_cast<long long>(length);
+#if defined(LAYOUT2PDF_HAVE_IO_URING)
+        if (useRing) {
+            b.busy = true;
+            b.ok = true;
+            if (!SubmitRest(i)) {
+                b.busy = false;
+                failed = true;
+            }
+            return;
+        }
+#endif
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            b.busy = true;
+            b.ok = true;
+            queue.push_back(i);
+        }
+        queued.notify_one();
+    }
+
+    void WaitIdle(int i) {
+        Buffer &b = buffers[i];
+#if defined(LAYOUT2PDF_HAVE_IO_URING)
+        if (useRing) {
+            if (b.busy) {
+                STATS_SCOPE(STAGE_WAIT);
+                while (b.busy) {
+                    ReapOne();
+                }
+            }
+            if (!b.ok) {
+                failed = true;
+            }
+            return;
+        }
+#endif
+        std::unique_lock<std::mutex> lock(mutex);
+        if (b.busy) {
+            STATS_SCOPE(STAGE_WAIT);
+            finished.wait(lock, [&b]() { return !b.busy; });
+        }
+        if (!b.ok) {
+            failed = true;
+        }
+    }
+
+#if defined(LAYOUT2PDF_HAVE_IO_URING)
+    bool SubmitRest(int i) {
+        Buffer &b = buffers[i];
+        if (!ring.Ready()) {
+            return false;
+        }
+        b.iov.iov_base = b.data + b.written;
+        b.iov.iov_len = b.length - b.written;
+        if (ring.SubmitWrite(fd, &b.iov, b.offset + static_cast<long long>(b.written),
+                             static_cast<std::uint64_t>(i))) {
+            return true;
+        }
+        // A ring that could not take the write is in an unknown state
+        ring.Close();
+        return false;
+    }
+
+    void ReapOne() {
+        std::uint64_t tag;
+        int result;
+        if (!ring.Reap(tag, result)) {
+            // Nothing more will complete; give up on every write in flight
+            ring.Close();
+            for (Buffer &b : buffers) {
+                if (b.busy) {
+                    b.busy = false;
+                    b.ok = false;
+                }
+            }
+            return;
+        }
+        Buffer &b = buffers[tag];
+        if (result == -EINTR || result == -EAGAIN) {
+            result = 0;
+        } else if (result <= 0) {
+            b.busy = false;
+            b.ok = false;
+            return;
+        }
+        b.written += static_cast<std::size_t>(result);
+        if (b.written < b.length && !SubmitRest(static_cast<int>(tag))) {
+            b.busy = false;
+            b.ok = false;
+        } else if (b.written == b.length) {
+            b.busy = false;
+        }
+    }
+#endif
+
+    void WriterLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            queued.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            Buffer &b = buffers[queue.front()];
+            queue.pop_front();
+            const int file = fd;
+            lock.unlock();
+            bool ok = true;
+            std::size_t done = 0;
+            while (done < b.length) {
+                ssize_t r = pwrite(file, b.data + done, b.length - done,
+                                   static_cast<off_t>(b.offset + static_cast<long long>(done)));
+                if (r < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (r <= 0) {
+                    ok = false;
+                    break;
+                }
+                done += static_cast<std::size_t>(r);
+            }
+            lock.lock();
+            b.ok = ok;
+            b.busy = false;
+            finished.notify_all();
+        }
+    }
+
+    int fd;
+    bool useRing;
+    bool direct;
+    bool failed;
+    int current;        // buffer being filled
+    std::size_t fill;   // bytes in it
+    long long fileOffset;  // where the next submitted buffer goes
+    Buffer buffers[bufferCount];
+#if defined(LAYOUT2PDF_HAVE_IO_URING)
+    IoRing ring;
+#endif
+
+    // Writer thread, when there is no ring
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::condition_variable finished;
+    std::deque<int> queue;
+    bool stopping;
+};
+#endif
+
+// --- Streaming PDF writer ---
+// Objects go straight to the output file as they are built; only their byte
+// offsets are kept, so the document is never held in memory as a whole.
+// Linearized output is the exception: it needs every offset before the
+// first byte is written, so objects are spooled and laid out in Finish().
+
+enum PdfOutputMode {
+    PDF_CLASSIC,          // PDF 1.4, xref table
+    PDF_OBJECT_STREAMS,   // PDF 1.5, object streams and an xref stream
+    PDF_LINEARIZED        // PDF 1.4, first page up front with hint tables
+};
+
+// Writes integers of any bit width, most significant bit first, as hint
+// tables need
+class BitWriter {
+public:
+    explicit BitWriter(ByteBuffer &out) : out(out), acc(0), bits(0) {}
+
+    void Put(std::uint64_t value, int width) {
+        for (int i = width - 1; i >= 0; --i) {
+            acc = static_cast<unsigned>((acc << 1) | ((value >> i) & 1));
+            if (++bits == 8) {
+                out.Append(static_cast<char>(acc));
+                acc = 0;
+                bits = 0;
+            }
+        }
+    }
+
+    // Pad to the next byte boundary
+    void Flush() {
+        if (bits > 0) {
+            Put(0, 8 - bits);
+        }
+    }
+
+private:
+    ByteBuffer &out;
+    unsigned acc;
+    int bits;
+};
+
+// Bits needed to store values up to v
+static int BitsFor(std::uint64_t v) {
+    int n = 0;
+    while (v != 0) {
+        n++;
+        v >>= 1;
+    }
+    return n;
+}
+
+class PdfWriter {
+public:
+    PdfWriter()
+        : out(nullptr), position(0), lastObj(0), mode(PDF_CLASSIC), objectStreams(false),
+          prevXref(-1), xrefOffset(0), spool(nullptr) {}
+
+    ~PdfWriter() {
+        if (spool) {
+            std::fclose(spool);
+        }
+    }
+
+    // PDF_OBJECT_STREAMS packs non-stream objects into compressed object
+    // streams and writes a binary cross-reference stream; PDF_LINEARIZED
+    // spools objects to a temporary file until Finish(). writeMode and
+    // directIo pick how the file itself is written (see AsyncFileSink).
+    bool Open(const std::string &filename, PdfOutputMode outputMode = PDF_CLASSIC,
+              FileWriteMode writeMode = FILE_WRITE_SYNC, bool directIo = false) {
+#if defined(LAYOUT2PDF_HAVE_ASYNC_WRITE)
+        if (writeMode != FILE_WRITE_SYNC) {
+            if (!asyncFile.Open(filename, writeMode, directIo)) {
+                return false;
+            }
+            return Open(asyncFile, outputMode);
+        }
+#else
+        (void)writeMode;
+        (void)directIo;
+#endif
+        if (!file.Open(filename)) {
+            return false;
+        }
+        return Open(file, outputMode);
+    }
+
+    // Write to sink, which must outlive Finish() or Abort()
+    bool Open(OutputSink &sink, PdfOutputMode outputMode = PDF_CLASSIC) {
+        if (spool) {
+            std::fclose(spool);
+            spool = nullptr;
+        }
+        out = &sink;
+        offsets.assign(1, 0);
+        containers.clear();
+        pendingObjs.clear();
+        position = 0;
+        lastObj = 0;
+        mode = outputMode;
+        objectStreams = (mode == PDF_OBJECT_STREAMS);
+        prevXref = -1;
+        if (mode == PDF_LINEARIZED) {
+            spool = std::tmpfile();
+            if (!spool) {
+                return false;
+            }
+            spooled.assign(1, SpooledObject());
+            spoolSize = 0;
+            spoolDicts.Clear();
+            linPages.clear();
+            linShared.clear();
+            return true;
+        }
+        Write(objectStreams ? "%PDF-1.5\n" : "%PDF-1.4\n");
+        Write("%\xE2\xE3\xCF\xD3\n");
+        return true;
+    }
+
+    // Append an incremental update to filename, a classic PDF of fileSize
+    // bytes with objectCount objects whose last xref table is at
+    // lastXref. Objects written replace those with the same numbers, new
+    // ones are numbered after objectCount, and Finish() writes an xref
+    // section for just the objects written.
+    bool OpenUpdate(const std::string &filename, long fileSize, int objectCount, long lastXref) {
+        if (spool) {
+            std::fclose(spool);
+            spool = nullptr;
+        }
+        if (!file.Open(filename, true)) {
+            return false;
+        }
+        out = &file;
+        offsets.assign(static_cast<std::size_t>(objectCount) + 1, 0);
+        containers.clear();
+        pendingObjs.clear();
+        position = fileSize;
+        lastObj = objectCount;
+        mode = PDF_CLASSIC;
+        objectStreams = false;
+        prevXref = lastXref;
+        return true;
+    }
+
+    // Bytes written, counting those of the file updated
+    long Position() const {
+        return position;
+    }
+
+    int ObjectCount() const {
+        return lastObj;
+    }
+
+    // Of the xref table Finish() wrote, for a later update
+    long XrefOffset() const {
+        return xrefOffset;
+    }
+
+    // Linearized output needs to know which objects make up each page: the
+    // page object and its content stream, in page order
+    void MarkPage(int pageObj, int contentObj) {
+        if (mode == PDF_LINEARIZED) {
+            linPages.push_back(std::make_pair(pageObj, contentObj));
+        }
+    }
+
+    // Objects every page uses (resources, fonts); linearized output places
+    // them with the first page
+    void MarkShared(int objNum) {
+        if (mode == PDF_LINEARIZED) {
+            linShared.push_back(objNum);
+        }
+    }
+
+    // Hand out the next unused object number
+    int NewObject() {
+        return ++lastObj;
+    }
+
+    // Record the offset of object objNum and write its header
+    void BeginObject(int objNum) {
+        SetEntry(objNum, position, 0);
+
+        scratch.Clear();
+        scratch.AppendInt(objNum);
+        scratch.Append(" 0 obj\n");
+        Write(scratch);
+    }
+
+    void EndObject() {
+        Write("endobj\n");
+    }
+
+    void Write(const char *data, std::size_t n) {
+        out->Write(data, n);
+        position += static_cast<long>(n);
+        STATS_ADD(STAT_OUTPUT_BYTES, n);
+    }
+
+    void Write(const char *str) { Write(str, std::strlen(str)); }
+    void Write(const ByteBuffer &data) { Write(data.Data(), data.Size()); }
+
+    // Write a complete object whose body is a dictionary or other direct value
+    void WriteObject(int objNum, const char *body) {
+        WriteObject(objNum, body, std::strlen(body));
+    }
+
+    void WriteObject(int objNum, const ByteBuffer &body) {
+        WriteObject(objNum, body.Data(), body.Size());
+    }
+
+    void WriteObject(int objNum, const char *body, std::size_t n) {
+        STATS_SCOPE(STAGE_WRITE);
+        if (objectStreams) {
+            AddToObjectStream(objNum, body, n);
+            return;
+        }
+        if (mode == PDF_LINEARIZED) {
+            SpooledObject &so = SpoolEntry(objNum);
+            so.stream = false;
+            so.offset = static_cast<long>(spoolDicts.Size());
+            so.length = n;
+            spoolDicts.Append(body, n);
+            return;
+        }
+        BeginObject(objNum);
+        Write(body, n);
+        EndObject();
+    }
+
+    // Write a stream object holding data, with its /Length filled in.
+    // flateEncoded marks data as already deflated; extraDict is added to
+    // the stream dictionary as is.
+    void WriteStreamObject(int objNum, const ByteBuffer &data, bool flateEncoded = false,
+                           const char *extraDict = nullptr) {
+        STATS_SCOPE(STAGE_WRITE);
+        if (mode == PDF_LINEARIZED) {
+            SpoolStream(objNum, data, flateEncoded, extraDict);
+            return;
+        }
+        BeginObject(objNum);
+        scratch.Clear();
+        scratch.Append("<< /Length ");
+        scratch.AppendInt(static_cast<long>(data.Size()));
+        if (flateEncoded) {
+            scratch.Append(" /Filter /FlateDecode");
+        }
+        if (extraDict) {
+            scratch.Append(' ');
+            scratch.Append(extraDict);
+        }
+        scratch.Append(" >>\nstream\n");
+        Write(scratch);
+        Write(data);
+        Write("\nendstream\n");
+        EndObject();
+    }
+
+    bool Good() const {
+        return out->Good() && !(spool && std::ferror(spool));
+    }
+
+    // Close the output without finishing it
+    void Abort() {
+        out->Close();
+    }
+
+    // Xref table and trailer; every object number handed out must have been
+    // written exactly once.
+    bool Finish(int rootObj) {
+        STATS_SCOPE(STAGE_WRITE);
+        STATS_ADD(STAT_OBJECTS, lastObj);
+        if (mode == PDF_LINEARIZED) {
+            return FinishLinearized(rootObj);
+        }
+        if (objectStreams) {
+            FlushObjectStream();
+            WriteXrefStream(rootObj);
+        } else {
+            WriteXrefTable(rootObj);
+        }
+        return out->Close();
+    }
+
+private:
+    static const std::size_t objectsPerStream = 100;
+
+    // Top-level objects have container 0 and their file offset; objects in
+    // an object stream have the stream's number and their index in it
+    void SetEntry(int objNum, long offsetOrIndex, int container) {
+        std::size_t n = static_cast<std::size_t>(objNum);
+        if (n >= offsets.size()) {
+            offsets.resize(n + 1, 0);
+        }
+        offsets[n] = offsetOrIndex;
+        if (container != 0 || !containers.empty()) {
+            if (n >= containers.size()) {
+                containers.resize(n + 1, 0);
+            }
+            containers[n] = container;
+        }
+    }
+
+    void AddToObjectStream(int objNum, const char *body, std::size_t n) {
+        pendingIndex.AppendInt(objNum);
+        pendingIndex.Append(' ');
+        pendingIndex.AppendInt(static_cast<long>(pendingBodies.Size()));
+        pendingIndex.Append(' ');
+        pendingBodies.Append(body, n);
+        pendingObjs.push_back(objNum);
+        if (pendingObjs.size() == objectsPerStream) {
+            FlushObjectStream();
+        }
+    }
+
+    void FlushObjectStream() {
+        if (pendingObjs.empty()) {
+            return;
+        }
+        int streamObj = NewObject();
+        for (std::size_t i = 0; i < pendingObjs.size(); ++i) {
+            SetEntry(pendingObjs[i], static_cast<long>(i), streamObj);
+        }
+
+        ByteBuffer &plain = pendingIndex;
+        std::size_t first = plain.Size();
+        plain.Append(pendingBodies);
+
+        char extra[64];
+        std::snprintf(extra, sizeof(extra), "/Type /ObjStm /N %u /First %u",
+                      static_cast<unsigned>(pendingObjs.size()), static_cast<unsigned>(first));
+        bool deflated = FlateEncode(plain, Z_DEFAULT_COMPRESSION, encoded);
+        WriteStreamObject(streamObj, deflated ? encoded : plain, deflated, extra);
+
+        pendingIndex.Clear();
+        pendingBodies.Clear();
+        pendingObjs.clear();
+    }
+
+    // An update's table has a subsection for each run of objects written,
+    // and its trailer points back to the previous table with /Prev
+    void WriteXrefTable(int rootObj) {
+        const std::size_t flushAt = 64 * 1024;
+        int numObjects = lastObj;
+        offsets.resize(static_cast<std::size_t>(numObjects) + 1, 0);
+        xrefOffset = position;
+
+        scratch.Clear();
+        if (prevXref < 0) {
+            scratch.Append("xref\n0 ");
+            scratch.AppendInt(numObjects + 1);
+            scratch.Append("\n0000000000 65535 f \n");
+        } else {
+            scratch.Append("xref\n");
+        }
+        for (int i = 1; i <= numObjects;) {
+            int run = i;
+            while (run <= numObjects && (prevXref < 0 || offsets[static_cast<std::size_t>(run)] != 0)) {
+                run++;
+            }
+            if (prevXref >= 0 && run > i) {
+                scratch.AppendInt(i);
+                scratch.Append(' ');
+                scratch.AppendInt(run - i);
+                scratch.Append('\n');
+            }
+            for (; i < run; ++i) {
+                scratch.AppendXrefOffset(offsets[static_cast<std::size_t>(i)]);
+                scratch.Append(" 00000 n \n");
+                if (scratch.Size() >= flushAt) {
+                    Write(scratch);
+                    scratch.Clear();
+                }
+            }
+            i = run + 1;   // past an object the update leaves alone
+        }
+
+        scratch.Append("trailer\n<< /Size ");
+        scratch.AppendInt(numObjects + 1);
+        scratch.Append(" /Root ");
+        scratch.AppendInt(rootObj);
+        if (prevXref >= 0) {
+            scratch.Append(" 0 R /Prev ");
+            scratch.AppendInt(prevXref);
+            scratch.Append(" >>\nstartxref\n");
+        } else {
+            scratch.Append(" 0 R >>\nstartxref\n");
+        }
+        scratch.AppendInt(xrefOffset);
+        scratch.Append("\n%%EOF\n");
+        Write(scratch);
+    }
+
+    // Binary cross-reference stream. Each row is a 1-byte type, an offset
+    // (or object stream number) as wide as the largest one needs, and a
+    // 2-byte generation (or index within the object stream).
+    void WriteXrefStream(int rootObj) {
+        // The stream lists itself, so its entry is set before the rows exist
+        int xrefObj = NewObject();
+        xrefOffset = position;
+        int numObjects = lastObj;
+        SetEntry(xrefObj, xrefOffset, 0);
+        offsets.resize(static_cast<std::size_t>(numObjects) + 1, 0);
+        containers.resize(static_cast<std::size_t>(numObjects) + 1, 0);
+
+        int offsetBytes = 1;
+        while (offsetBytes < 8 && (xrefOffset >> (8 * offsetBytes)) != 0) {
+            offsetBytes++;
+        }
+
+        ByteBuffer rows;
+        auto addRow = [&](int type, long field2, int field3) {
+            char *p = rows.Reserve(static_cast<std::size_t>(3 + offsetBytes));
+            p[0] = static_cast<char>(type);
+            for (int k = 0; k < offsetBytes; ++k) {
+                p[1 + k] = static_cast<char>((field2 >> (8 * (offsetBytes - 1 - k))) & 0xFF);
+            }
+            p[1 + offsetBytes] = static_cast<char>((field3 >> 8) & 0xFF);
+            p[2 + offsetBytes] = static_cast<char>(field3 & 0xFF);
+            rows.Commit(static_cast<std::size_t>(3 + offsetBytes));
+        };
+
+        addRow(0, 0, 65535);
+        for (int i = 1; i <= numObjects; ++i) {
+            std::size_t n = static_cast<std::size_t>(i);
+            if (containers[n] != 0) {
+                addRow(2, containers[n], static_cast<int>(offsets[n]));
+            } else {
+                addRow(1, offsets[n], 0);
+            }
+        }
+
+        char extra[96];
+        std::snprintf(extra, sizeof(extra), "/Type /XRef /Size %d /W [1 %d 2] /Root %d 0 R",
+                      numObjects + 1, offsetBytes, rootObj);
+        bool deflated = FlateEncode(rows, Z_DEFAULT_COMPRESSION, encoded);
+        WriteStreamObject(xrefObj, deflated ? encoded : rows, deflated, extra);
+
+        scratch.Clear();
+        scratch.Append("startxref\n");
+        scratch.AppendInt(xrefOffset);
+        scratch.Append("\n%%EOF\n");
+        Write(scratch);
+    }
+
+    // --- Linearized output ---
+    // Layout (ISO 32000-1 Annex F): linearization dictionary, first-page
+    // xref and trailer, catalog, primary hint stream, first page section
+    // (page 1, its content and the shared resources), the remaining pages,
+    // other objects (the page tree), then the main xref. Objects are
+    // renumbered so the first-page xref covers the top, contiguous range.
+
+    // The dictionary (for streams, up to and including "stream\n") is kept
+    // in spoolDicts so its references can be renumbered; stream data and
+    // "endstream" go to the spool file
+    struct SpooledObject {
+        bool stream;
+        long offset;          // into spoolDicts
+        std::size_t length;
+        long dataOffset;      // into the spool file
+        std::size_t dataLength;
+        SpooledObject() : stream(false), offset(0), length(0), dataOffset(0), dataLength(0) {}
+    };
+
+    static const std::size_t linDictWidth = 200;
+    static const std::size_t firstTrailerWidth = 100;
+
+    SpooledObject &SpoolEntry(int objNum) {
+        std::size_t n = static_cast<std::size_t>(objNum);
+        if (n >= spooled.size()) {
+            spooled.resize(n + 1);
+        }
+        return spooled[n];
+    }
+
+    void SpoolStream(int objNum, const ByteBuffer &data, bool flateEncoded, const char *extraDict) {
+        SpooledObject &so = SpoolEntry(objNum);
+        so.stream = true;
+        so.offset = static_cast<long>(spoolDicts.Size());
+        spoolDicts.Append("<< /Length ");
+        spoolDicts.AppendInt(static_cast<long>(data.Size()));
+        if (flateEncoded) {
+            spoolDicts.Append(" /Filter /FlateDecode");
+        }
+        if (extraDict) {
+            spoolDicts.Append(' ');
+            spoolDicts.Append(extraDict);
+        }
+        spoolDicts.Append(" >>\nstream\n");
+        so.length = spoolDicts.Size() - static_cast<std::size_t>(so.offset);
+
+        so.dataOffset = spoolSize;
+        so.dataLength = data.Size() + std::strlen("\nendstream\n");
+        std::fwrite(data.Data(), 1, data.Size(), spool);
+        std::fwrite("\nendstream\n", 1, std::strlen("\nendstream\n"), spool);
+        spoolSize += static_cast<long>(so.dataLength);
+    }
+
+    // Copy a dictionary, replacing every "N 0 R" with its new number
+    static void RenumberRefs(const char *body, std::size_t n, const std::vector<int> &renum,
+                             ByteBuffer &out) {
+        auto isRegular = [](char c) {
+            return !(IsSpace(c) || std::strchr("()<>[]{}/%", c) != nullptr || c == '\0');
+        };
+        std::size_t i = 0;
+        while (i < n) {
+            if (body[i] >= '0' && body[i] <= '9' && (i == 0 || !isRegular(body[i - 1]))) {
+                std::size_t end = i;
+                long num = 0;
+                while (end < n && body[end] >= '0' && body[end] <= '9') {
+                    num = num * 10 + (body[end] - '0');
+                    end++;
+                }
+                if (end + 4 <= n && std::memcmp(body + end, " 0 R", 4) == 0 &&
+                    (end + 4 == n || !isRegular(body[end + 4])) &&
+                    num > 0 && static_cast<std::size_t>(num) < renum.size()) {
+                    out.AppendInt(renum[static_cast<std::size_t>(num)]);
+                    out.Append(" 0 R");
+                    i = end + 4;
+                    continue;
+                }
+                out.Append(body + i, end - i);
+                i = end;
+                continue;
+            }
+            out.Append(body[i]);
+            i++;
+        }
+    }
+
+    static std::size_t DecimalWidth(long v) {
+        std::size_t n = 1;
+        while (v >= 10) {
+            v /= 10;
+            n++;
+        }
+        return n;
+    }
+
+    static std::size_t ObjectHeaderSize(int objNum) {
+        return DecimalWidth(objNum) + std::strlen(" 0 obj\n");
+    }
+
+    // Append text padded with spaces to width
+    static void AppendPadded(ByteBuffer &out, const char *text, std::size_t width) {
+        std::size_t n = std::strlen(text);
+        out.Append(text, n);
+        while (n++ < width) {
+            out.Append(' ');
+        }
+    }
+
+    bool FinishLinearized(int rootObj) {
+        const int numObjects = lastObj;
+        spooled.resize(static_cast<std::size_t>(numObjects) + 1);
+        if (linPages.empty()) {
+            return false;
+        }
+
+        // --- Order and renumber ---
+        std::vector<char> placed(static_cast<std::size_t>(numObjects) + 1, 0);
+        std::vector<int> firstSection;
+        firstSection.push_back(linPages[0].first);
+        firstSection.push_back(linPages[0].second);
+        for (std::size_t i = 0; i < linShared.size(); ++i) {
+            firstSection.push_back(linShared[i]);
+        }
+        for (std::size_t i = 0; i < firstSection.size(); ++i) {
+            placed[static_cast<std::size_t>(firstSection[i])] = 1;
+        }
+        placed[static_cast<std::size_t>(rootObj)] = 1;
+
+        std::vector<int> mainSection;
+        for (std::size_t p = 1; p < linPages.size(); ++p) {
+            mainSection.push_back(linPages[p].first);
+            mainSection.push_back(linPages[p].second);
+            placed[static_cast<std::size_t>(linPages[p].first)] = 1;
+            placed[static_cast<std::size_t>(linPages[p].second)] = 1;
+        }
+        for (int i = 1; i <= numObjects; ++i) {
+            if (!placed[static_cast<std::size_t>(i)]) {
+                mainSection.push_back(i);
+            }
+        }
+
+        std::vector<int> renum(static_cast<std::size_t>(numObjects) + 1, 0);
+        for (std::size_t k = 0; k < mainSection.size(); ++k) {
+            renum[static_cast<std::size_t>(mainSection[k])] = static_cast<int>(k) + 1;
+        }
+        const int m = static_cast<int>(mainSection.size()) + 1;   // first of the first-page range
+        const int linObj = m;
+        const int hintObj = m + 2;
+        renum[static_cast<std::size_t>(rootObj)] = m + 1;
+        for (std::size_t k = 0; k < firstSection.size(); ++k) {
+            renum[static_cast<std::size_t>(firstSection[k])] = m + 3 + static_cast<int>(k);
+        }
+        const int firstCount = 3 + static_cast<int>(firstSection.size());
+        const int totalSize = m + firstCount;
+
+        // Dictionaries with references rewritten
+        ByteBuffer dicts;
+        std::vector<std::size_t> dictAt(static_cast<std::size_t>(numObjects) + 1, 0);
+        std::vector<std::size_t> dictLength(static_cast<std::size_t>(numObjects) + 1, 0);
+        std::vector<std::size_t> objSize(static_cast<std::size_t>(numObjects) + 1, 0);
+        for (int i = 1; i <= numObjects; ++i) {
+            const std::size_t k = static_cast<std::size_t>(i);
+            const SpooledObject &so = spooled[k];
+            dictAt[k] = dicts.Size();
+            RenumberRefs(spoolDicts.Data() + so.offset, so.length, renum, dicts);
+            dictLength[k] = dicts.Size() - dictAt[k];
+            objSize[k] = ObjectHeaderSize(renum[k]) + dictLength[k] + so.dataLength +
+                         std::strlen("endobj\n");
+        }
+        auto dictOf = [&](int orig) {
+            const std::size_t k = static_cast<std::size_t>(orig);
+            return std::string_view(dicts.Data() + dictAt[k], dictLength[k]);
+        };
+
+        // --- Offsets, at first as if the hint stream were absent, which is
+        // how the hint tables themselves count ---
+        const long headerSize = 15;
+        const long linSize = static_cast<long>(ObjectHeaderSize(linObj) + linDictWidth + 1 +
+                                               std::strlen("endobj\n"));
+        const long firstXrefOffset = headerSize + linSize;
+        const long firstXrefSize = static_cast<long>(
+            std::strlen("xref\n") + DecimalWidth(m) + 1 + DecimalWidth(firstCount) + 1 +
+            20 * static_cast<std::size_t>(firstCount) + std::strlen("trailer\n") +
+            firstTrailerWidth + 1 + std::strlen("startxref\n0\n%%EOF\n"));
+
+        std::vector<long> at(static_cast<std::size_t>(numObjects) + 1, 0);
+        long pos = firstXrefOffset + firstXrefSize;
+        at[static_cast<std::size_t>(rootObj)] = pos;
+        pos += static_cast<long>(objSize[static_cast<std::size_t>(rootObj)]);
+        const long hintOffset = pos;
+        for (std::size_t k = 0; k < firstSection.size(); ++k) {
+            at[static_cast<std::size_t>(firstSection[k])] = pos;
+            pos += static_cast<long>(objSize[static_cast<std::size_t>(firstSection[k])]);
+        }
+        long firstPageEnd = pos;
+        for (std::size_t k = 0; k < mainSection.size(); ++k) {
+            at[static_cast<std::size_t>(mainSection[k])] = pos;
+            pos += static_cast<long>(objSize[static_cast<std::size_t>(mainSection[k])]);
+        }
+        long mainXrefOffset = pos;
+
+        // --- Hint stream ---
+        ByteBuffer hint;
+        BuildHintTables(firstSection, at, objSize, firstPageEnd, hint);
+        std::size_t sharedTableAt = hintSharedOffset;
+
+        ByteBuffer hintObjBody;
+        hintObjBody.Append("<< /Length ");
+        hintObjBody.AppendInt(static_cast<long>(hint.Size()));
+        hintObjBody.Append(" /S ");
+        hintObjBody.AppendInt(static_cast<long>(sharedTableAt));
+        hintObjBody.Append(" >>\nstream\n");
+        hintObjBody.Append(hint);
+        hintObjBody.Append("\nendstream\n");
+        const long hintSize = static_cast<long>(ObjectHeaderSize(hintObj) + hintObjBody.Size() +
+                                                std::strlen("endobj\n"));
+
+        // Everything from the hint stream on moves down by its size
+        for (int i = 1; i <= numObjects; ++i) {
+            if (at[static_cast<std::size_t>(i)] >= hintOffset) {
+                at[static_cast<std::size_t>(i)] += hintSize;
+            }
+        }
+        firstPageEnd += hintSize;
+        mainXrefOffset += hintSize;
+
+        ByteBuffer mainXrefHead;
+        mainXrefHead.Append("xref\n0 ");
+        mainXrefHead.AppendInt(m);
+        const long mainFirstEntry = mainXrefOffset + static_cast<long>(mainXrefHead.Size());
+        mainXrefHead.Append("\n0000000000 65535 f \n");
+
+        ByteBuffer mainTrailer;
+        mainTrailer.Append("trailer\n<< /Size ");
+        mainTrailer.AppendInt(m);
+        mainTrailer.Append(" >>\nstartxref\n");
+        mainTrailer.AppendInt(firstXrefOffset);
+        mainTrailer.Append("\n%%EOF\n");
+        const long fileLength = mainXrefOffset + static_cast<long>(mainXrefHead.Size()) +
+                                20L * (m - 1) + static_cast<long>(mainTrailer.Size());
+
+        // --- Write ---
+        position = 0;
+        Write("%PDF-1.4\n");
+        Write("%\xE2\xE3\xCF\xD3\n");
+
+        char text[256];
+        std::snprintf(text, sizeof(text),
+                      "<< /Linearized 1 /L %ld /H [ %ld %ld ] /O %d /E %ld /N %d /T %ld >>",
+                      fileLength, hintOffset, hintSize, renum[static_cast<std::size_t>(linPages[0].first)],
+                      firstPageEnd, static_cast<int>(linPages.size()), mainFirstEntry);
+        scratch.Clear();
+        scratch.AppendInt(linObj);
+        scratch.Append(" 0 obj\n");
+        AppendPadded(scratch, text, linDictWidth);
+        scratch.Append("\nendobj\n");
+        Write(scratch);
+
+        // First-page xref: objects m .. m + firstCount - 1
+        std::vector<long> firstOffsets;
+        firstOffsets.push_back(headerSize);
+        firstOffsets.push_back(at[static_cast<std::size_t>(rootObj)]);
+        firstOffsets.push_back(hintOffset);
+        for (std::size_t k = 0; k < firstSection.size(); ++k) {
+            firstOffsets.push_back(at[static_cast<std::size_t>(firstSection[k])]);
+        }
+        scratch.Clear();
+        scratch.Append("xref\n");
+        scratch.AppendInt(m);
+        scratch.Append(' ');
+        scratch.AppendInt(firstCount);
+        scratch.Append('\n');
+        for (std::size_t k = 0; k < firstOffsets.size(); ++k) {
+            scratch.AppendXrefOffset(firstOffsets[k]);
+            scratch.Append(" 00000 n \n");
+        }
+        std::snprintf(text, sizeof(text), "<< /Size %d /Root %d 0 R /Prev %ld >>",
+                      totalSize, m + 1, mainXrefOffset);
+        scratch.Append("trailer\n");
+        AppendPadded(scratch, text, firstTrailerWidth);
+        scratch.Append("\nstartxref\n0\n%%EOF\n");
+        Write(scratch);
+
+        WriteSpooled(rootObj, renum, dictOf);
+
+        scratch.Clear();
+        scratch.AppendInt(hintObj);
+        scratch.Append(" 0 obj\n");
+        Write(scratch);
+        Write(hintObjBody);
+        Write("endobj\n");
+
+        for (std::size_t k = 0; k < firstSection.size(); ++k) {
+            WriteSpooled(firstSection[k], renum, dictOf);
+        }
+        for (std::size_t k = 0; k < mainSection.size(); ++k) {
+            WriteSpooled(mainSection[k], renum, dictOf);
+        }
+
+        Write(mainXrefHead);
+        scratch.Clear();
+        for (std::size_t k = 0; k < mainSection.size(); ++k) {
+            scratch.AppendXrefOffset(at[static_cast<std::size_t>(mainSection[k])]);
+            scratch.Append(" 00000 n \n");
+            if (scratch.Size() >= 64 * 1024) {
+                Write(scratch);
+                scratch.Clear();
+            }
+        }
+        scratch.Append(mainTrailer);
+        Write(scratch);
+
+        bool ok = !std::ferror(spool) && position == fileLength;
+        return out->Close() && ok;
+    }
+
+    template <typename DictOf>
+    void WriteSpooled(int orig, const std::vector<int> &renum, const DictOf &dictOf) {
+        const SpooledObject &so = spooled[static_cast<std::size_t>(orig)];
+        scratch.Clear();
+        scratch.AppendInt(renum[static_cast<std::size_t>(orig)]);
+        scratch.Append(" 0 obj\n");
+        Write(scratch);
+        std::string_view dict = dictOf(orig);
+        Write(dict.data(), dict.size());
+        if (so.stream) {
+            char chunk[64 * 1024];
+            std::fseek(spool, so.dataOffset, SEEK_SET);
+            std::size_t left = so.dataLength;
+            while (left > 0) {
+                std::size_t n = left < sizeof(chunk) ? left : sizeof(chunk);
+                if (std::fread(chunk, 1, n, spool) != n) {
+                    break;
+                }
+                Write(chunk, n);
+                left -= n;
+            }
+        }
+        Write("endobj\n");
+    }
+
+    // Page offset hint table followed by the shared object hint table
+    // (Annex F.4). Offsets are the ones the file would have without the
+    // hint stream. The first page section's objects are the shared object
+    // groups, one object each; every later page refers to the shared ones.
+    void BuildHintTables(const std::vector<int> &firstSection, const std::vector<long> &at,
+                         const std::vector<std::size_t> &objSize, long firstPageEnd,
+                         ByteBuffer &hint) {
+        const std::size_t numPages = linPages.size();
+        std::vector<std::uint64_t> nobjects(numPages), length(numPages);
+        std::vector<std::uint64_t> contentOffset(numPages), contentLength(numPages);
+        std::vector<std::uint64_t> nshared(numPages);
+        for (std::size_t p = 0; p < numPages; ++p) {
+            std::size_t pageObj = static_cast<std::size_t>(linPages[p].first);
+            std::size_t contentObj = static_cast<std::size_t>(linPages[p].second);
+            if (p == 0) {
+                nobjects[p] = firstSection.size();
+                length[p] = static_cast<std::uint64_t>(firstPageEnd - at[pageObj]);
+                nshared[p] = 0;
+            } else {
+                nobjects[p] = 2;
+                length[p] = objSize[pageObj] + objSize[contentObj];
+                nshared[p] = linShared.size();
+            }
+            contentOffset[p] = static_cast<std::uint64_t>(at[contentObj] - at[pageObj]);
+            contentLength[p] = objSize[contentObj];
+        }
+
+        auto range = [](const std::vector<std::uint64_t> &v, std::uint64_t &least) {
+            least = v[0];
+            std::uint64_t most = v[0];
+            for (std::size_t i = 1; i < v.size(); ++i) {
+                if (v[i] < least) least = v[i];
+                if (v[i] > most) most = v[i];
+            }
+            return BitsFor(most - least);
+        };
+
+        std::uint64_t leastObjects, leastLength, leastOffset, leastContent, leastShared;
+        int objectBits = range(nobjects, leastObjects);
+        int lengthBits = range(length, leastLength);
+        int offsetBits = range(contentOffset, leastOffset);
+        int contentBits = range(contentLength, leastContent);
+        range(nshared, leastShared);
+        std::uint64_t mostShared = linShared.size();
+        // Shared identifiers index the shared table, whose first entries
+        // are page 1, its content, then the shared objects
+        int sharedCountBits = BitsFor(mostShared);
+        int sharedIdBits = BitsFor(firstSection.size() - 1);
+
+        BitWriter bw(hint);
+        bw.Put(leastObjects, 32);
+        bw.Put(static_cast<std::uint64_t>(at[static_cast<std::size_t>(linPages[0].first)]), 32);
+        bw.Put(static_cast<std::uint64_t>(objectBits), 16);
+        bw.Put(leastLength, 32);
+        bw.Put(static_cast<std::uint64_t>(lengthBits), 16);
+        bw.Put(leastOffset, 32);
+        bw.Put(static_cast<std::uint64_t>(offsetBits), 16);
+        bw.Put(leastContent, 32);
+        bw.Put(static_cast<std::uint64_t>(contentBits), 16);
+        bw.Put(static_cast<std::uint64_t>(sharedCountBits), 16);
+        bw.Put(static_cast<std::uint64_t>(sharedIdBits), 16);
+        bw.Put(0, 16);   // no fractional positions
+        bw.Put(1, 16);
+
+        for (std::size_t p = 0; p < numPages; ++p) bw.Put(nobjects[p] - leastObjects, objectBits);
+        bw.Flush();
+        for (std::size_t p = 0; p < numPages; ++p) bw.Put(length[p] - leastLength, lengthBits);
+        bw.Flush();
+        for (std::size_t p = 0; p < numPages; ++p) bw.Put(nshared[p], sharedCountBits);
+        bw.Flush();
+        for (std::size_t p = 0; p < numPages; ++p) {
+            for (std::size_t k = 0; k < nshared[p]; ++k) {
+                bw.Put(2 + k, sharedIdBits);
+            }
+        }
+        bw.Flush();
+        for (std::size_t p = 0; p < numPages; ++p) bw.Put(contentOffset[p] - leastOffset, offsetBits);
+        bw.Flush();
+        for (std::size_t p = 0; p < numPages; ++p) bw.Put(contentLength[p] - leastContent, contentBits);
+        bw.Flush();
+
+        // Shared object hint table: only first-page entries, no part 8
+        hintSharedOffset = hint.Size();
+        std::vector<std::uint64_t> groupLength(firstSection.size());
+        for (std::size_t k = 0; k < firstSection.size(); ++k) {
+            groupLength[k] = objSize[static_cast<std::size_t>(firstSection[k])];
+        }
+        std::uint64_t leastGroup;
+        int groupBits = range(groupLength, leastGroup);
+
+        bw.Put(0, 32);   // first object of the shared objects section (none)
+        bw.Put(0, 32);   // its location
+        bw.Put(firstSection.size(), 32);
+        bw.Put(firstSection.size(), 32);
+        bw.Put(0, 16);   // every group is a single object
+        bw.Put(leastGroup, 32);
+        bw.Put(static_cast<std::uint64_t>(groupBits), 16);
+        for (std::size_t k = 0; k < groupLength.size(); ++k) bw.Put(groupLength[k] - leastGroup, groupBits);
+        bw.Flush();
+        for (std::size_t k = 0; k < groupLength.size(); ++k) bw.Put(0, 1);   // no MD5 signatures
+        bw.Flush();
+    }
+
+    FileSink file;
+#if defined(LAYOUT2PDF_HAVE_ASYNC_WRITE)
+    AsyncFileSink asyncFile;
+#endif
+    OutputSink *out;
+    long position;
+    int lastObj;
+    PdfOutputMode mode;
+    bool objectStreams;
+    long prevXref;        // of the file an update is appended to, or -1
+    long xrefOffset;      // of the table Finish() wrote
+    std::vector<long> offsets;
+    std::vector<int> containers;  // only filled in for PDF 1.5 output
+    ByteBuffer scratch;   // object headers and the xref table
+
+    // Object stream being filled (PDF 1.5 output)
+    ByteBuffer pendingIndex;
+    ByteBuffer pendingBodies;
+    std::vector<int> pendingObjs;
+    ByteBuffer encoded;
+
+    // Linearized output: dictionaries in memory, streams in the spool file
+    std::FILE *spool;
+    long spoolSize;
+    ByteBuffer spoolDicts;
+    std::vector<SpooledObject> spooled;
+    std::vector<std::pair<int, int> > linPages;
+    std::vector<int> linShared;
+    std::size_t hintSharedOffset;
+};
+
+// --- Page tree ---
+// Pages hang off leaf /Pages nodes of at most pageTreeFanout kids, and the
+// leaves are grouped the same way up to the root, so viewers reach any page
+// in O(log n) steps instead of scanning one huge Kids array. A page's
+// /Parent must be known when the page is written, so leaves get their
+// object numbers as pages arrive; all nodes are written at the end.
+
+static const std::size_t pageTreeFanout = 32;
+
+class PageTree {
+public:
+    PageTree(PdfWriter &writer, int rootObj) : writer(writer), rootObj(rootObj), pageCount(0) {}
+
+    // Parent node for the next page, starting a new leaf when the last is full
+    int NextParent() {
+        if (leaves.empty() || leaves.back().kids.size() == pageTreeFanout) {
+            Node leaf;
+            leaf.obj = writer.NewObject();
+            leaf.count = 0;
+            leaves.push_back(leaf);
+        }
+        return leaves.back().obj;
+    }
+
+    // Add a page under the node returned by the last NextParent()
+    void AddPage(int pageObj) {
+        leaves.back().kids.push_back(pageObj);
+        leaves.back().count++;
+        pageCount++;
+    }
+
+    long PageCount() const {
+        return pageCount;
+    }
+
+    // Write every node, building the levels above the leaves up to the root
+    void Finish() {
+        std::vector<Node> level;
+        level.swap(leaves);
+        while (level.size() > pageTreeFanout) {
+            std::vector<Node> parents;
+            for (std::size_t i = 0; i < level.size(); i += pageTreeFanout) {
+                Node parent;
+                parent.obj = writer.NewObject();
+                parent.count = 0;
+                std::size_t end = i + pageTreeFanout < level.size() ? i + pageTreeFanout : level.size();
+                for (std::size_t k = i; k < end; ++k) {
+                    parent.kids.push_back(level[k].obj);
+                    parent.count += level[k].count;
+                    WriteNode(level[k], parent.obj);
+                }
+                parents.push_back(parent);
+            }
+            level.swap(parents);
+        }
+
+        Node root;
+        root.obj = rootObj;
+        root.count = 0;
+        for (std::size_t k = 0; k < level.size(); ++k) {
+            root.kids.push_back(level[k].obj);
+            root.count += level[k].count;
+            WriteNode(level[k], rootObj);
+        }
+        WriteNode(root, 0);
+    }
+
+private:
+    struct Node {
+        int obj;
+        std::vector<int> kids;
+        long count;   // pages below this node
+    };
+
+    void WriteNode(const Node &node, int parentObj) {
+        obj.Clear();
+        obj.Append("<< /Type /Pages");
+        if (parentObj != 0) {
+            obj.Append(" /Parent ");
+            obj.AppendInt(parentObj);
+            obj.Append(" 0 R");
+        }
+        obj.Append(" /Kids [");
+        for (std::size_t i = 0; i < node.kids.size(); ++i) {
+            obj.Append(' ');
+            obj.AppendInt(node.kids[i]);
+            obj.Append(" 0 R");
+        }
+        obj.Append(" ] /Count ");
+        obj.AppendInt(node.count);
+        obj.Append(" >>\n");
+        writer.WriteObject(node.obj, obj);
+    }
+
+    PdfWriter &writer;
+    int rootObj;
+    long pageCount;
+    std::vector<Node> leaves;
+    ByteBuffer obj;
+};
+
+// --- Worker pool ---
+// Fixed set of threads that run an indexed job over [0, count). The calling
+// thread takes part as well, so a pool of size 1 has no extra threads. Jobs
+// also get the id of the worker running them (0 = calling thread, up to
+// Size() - 1), for per-worker scratch state.
+
+class WorkerPool {
+public:
+    explicit WorkerPool(int size)
+        : stopping(false), generation(0), job(nullptr), count(0), next(0), active(0) {
+        for (int i = 1; i < size; ++i) {
+            threads.push_back(std::thread(&WorkerPool::ThreadMain, this, i));
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::size_t i = 0; i < threads.size(); ++i) {
+            threads[i].join();
+        }
+    }
+
+    int Size() const {
+        return static_cast<int>(threads.size()) + 1;
+    }
+
+    // Call fn(i, worker) for every i in [0, n) and return once all calls are done
+    void Run(std::size_t n, const std::function<void(std::size_t, int)> &fn) {
+        if (threads.empty() || n <= 1) {
+            for (std::size_t i = 0; i < n; ++i) {
+                fn(i, 0);
+            }
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            count = n;
+            next.store(0);
+            active = static_cast<int>(threads.size());
+            generation++;
+        }
+        wake.notify_all();
+
+        Work(fn, n, 0);
+
+        STATS_SCOPE(STAGE_WAIT);
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return active == 0; });
+        job = nullptr;
+    }
+
+private:
+    void Work(const std::function<void(std::size_t, int)> &fn, std::size_t n, int worker) {
+        for (;;) {
+            std::size_t i = next.fetch_add(1);
+            if (i >= n) {
+                break;
+            }
+            fn(i, worker);
+        }
+    }
+
+    void ThreadMain(int worker) {
+        unsigned long seen = 0;
+        for (;;) {
+            const std::function<void(std::size_t, int)> *fn;
+            std::size_t n;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+                fn = job;
+                n = count;
+            }
+
+            Work(*fn, n, worker);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--active == 0) {
+                done.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool stopping;
+    unsigned long generation;
+    const std::function<void(std::size_t, int)> *job;
+    std::size_t count;
+    std::atomic<std::size_t> next;
+    int active;
+};
+
+// --- Work-stealing queue ---
+// Items [0, count) are dealt out as contiguous ranges, one per owner. An
+// owner takes items from the front of its own range; once that runs dry it
+// steals the back half of the fullest remaining range.
+
+class StealingQueue {
+public:
+    StealingQueue(std::size_t owners, std::size_t count)
+        : ranges(new Range[owners]), numRanges(owners) {
+        for (std::size_t i = 0; i < owners; ++i) {
+            ranges[i].begin = count * i / owners;
+            ranges[i].end = count * (i + 1) / owners;
+        }
+    }
+
+    // Next item for owner; false once every range is empty
+    bool Pop(std::size_t owner, std::size_t &item) {
+        {
+            Range &own = ranges[owner];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (own.begin < own.end) {
+                item = own.begin++;
+                return true;
+            }
+        }
+        for (;;) {
+            std::size_t victim = numRanges;
+            std::size_t most = 0;
+            for (std::size_t i = 0; i < numRanges; ++i) {
+                std::lock_guard<std::mutex> lock(ranges[i].mutex);
+                std::size_t left = ranges[i].end - ranges[i].begin;
+                if (left > most) {
+                    most = left;
+                    victim = i;
+                }
+            }
+            if (victim == numRanges) {
+                return false;
+            }
+
+            std::size_t begin, end;
+            {
+                Range &v = ranges[victim];
+                std::lock_guard<std::mutex> lock(v.mutex);
+                if (v.begin == v.end) {
+                    continue;
+                }
+                begin = v.begin + (v.end - v.begin) / 2;
+                end = v.end;
+                v.end = begin;
+            }
+            Range &own = ranges[owner];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            own.begin = begin + 1;
+            own.end = end;
+            item = begin;
+            return true;
+        }
+    }
+
+private:
+    struct Range {
+        std::mutex mutex;
+        std::size_t begin;
+        std::size_t end;
+    };
+
+    std::unique_ptr<Range[]> ranges;
+    std::size_t numRanges;
+};
+
+// --- Parallel parsing ---
+// A large mapped layout is cut into chunks just after closing tags
+// ([/pageN] or [/fragment]). After any closing tag the parser is outside
+// every page and fragment, and each opening directive sets the whole style,
+// so a chunk parses the same on its own as it would in sequence. Each round
+// parses one chunk per worker, with chunk-local style and fragment tables,
+// then merges them in input order: styles are re-interned, fragment
+// references renumbered and [use NAME] lines resolved against the
+// fragments of earlier chunks. Pages are handed on in order, and each
+// fragment joins the document's table just before the first page that
+// followed it, as in a sequential parse, so the output is the same.
+// Rounds bound the memory to a few chunks of pages at a time.
+
+class ParallelParser {
+public:
+    static const std::size_t chunkSize = 4 * 1024 * 1024;
+
+    explicit ParallelParser(WorkerPool &pool)
+        : pool(pool), chunks(static_cast<std::size_t>(pool.Size())), stylesFull(false),
+          fragmentsFull(false) {}
+
+    // Whether Parse is worth it for in
+    bool Suits(const LayoutReader &in) const {
+        return pool.Size() > 1 && in.Stable() && in.Contents().size() >= 2 * chunkSize;
+    }
+
+    // Same result as ParseLayoutFile on a Stable() reader
+    bool Parse(LayoutReader &in, StyleTable &styles, FragmentTable &fragments,
+               const PageHandler &onPage) {
+        stylesFull = false;
+        fragmentsFull = false;
+        const std::string_view text = in.Contents();
+        std::size_t pos = 0;
+        while (pos < text.size()) {
+            std::size_t count = 0;
+            while (count < chunks.size() && pos < text.size()) {
+                std::size_t end = ChunkEnd(text, pos + chunkSize);
+                chunks[count].text = text.substr(pos, end - pos);
+                pos = end;
+                count++;
+            }
+
+            pool.Run(count, [&](std::size_t i, int) {
+                ParseChunk(chunks[i]);
+            });
+            std::size_t fragmentCount = fragments.Size();
+            for (std::size_t i = 0; i < count; ++i) {
+                if (!Merge(i, styles, fragments, fragmentCount)) {
+                    return false;
+                }
+            }
+            pool.Run(count, [&](std::size_t i, int) {
+                Patch(chunks[i], styles);
+            });
+
+            for (std::size_t i = 0; i < count; ++i) {
+                Chunk &chunk = chunks[i];
+                const std::vector<std::uint32_t> &defined = chunk.notes.fragmentPages;
+                std::size_t next = 0;   // first local fragment not yet in fragments
+                for (std::size_t k = 0; k < chunk.pageCount; ++k) {
+                    std::size_t end = next;
+                    while (end < defined.size() && defined[end] <= k) {
+                        end++;
+                    }
+                    fragments.Append(chunk.fragments, next, end);
+                    next = end;
+                    if (!onPage(chunk.pages[k])) {
+                        return false;
+                    }
+                }
+                fragments.Append(chunk.fragments, next, defined.size());
+            }
+        }
+        return true;
+    }
+
+    // After Parse failed: whether it ran out of styles or fragments, in the
+    // document's tables or a chunk's
+    bool StylesFull() const {
+        return stylesFull;
+    }
+
+    bool FragmentsFull() const {
+        return fragmentsFull;
+    }
+
+private:
+    struct Chunk {
+        std::string_view text;
+        LayoutReader reader;
+        StyleTable styles;
+        FragmentTable fragments;
+        ChunkNotes notes;
+        std::vector<PageSpec> pages;   // spent pages come back for reuse
+        std::size_t pageCount;
+        bool parsed;
+
+        // Filled in by Merge
+        std::vector<std::uint16_t> styleMap;   // local style -> document style
+        std::vector<int> resolved;             // unresolved name -> fragment, or -1
+        std::size_t fragmentBase;              // document index of local fragment 0
+    };
+
+    // End of the first line at or after from that is a closing tag, or
+    // the end of the text
+    static std::size_t ChunkEnd(std::string_view text, std::size_t from) {
+        if (from >= text.size()) {
+            return text.size();
+        }
+        const void *nl = std::memchr(text.data() + from - 1, '\n', text.size() - from + 1);
+        std::size_t line = nl ? static_cast<const char *>(nl) - text.data() + 1 : text.size();
+        while (line < text.size()) {
+            nl = std::memchr(text.data() + line, '\n', text.size() - line);
+            std::size_t next = nl ? static_cast<const char *>(nl) - text.data() + 1 : text.size();
+            std::size_t c = line;
+            while (c < next && text[c] != '\n' && IsSpace(text[c])) {
+                c++;
+            }
+            // "[/" but not "[//", which is "[" and a comment
+            if (c + 2 < next && text[c] == '[' && text[c + 1] == '/' && text[c + 2] != '/') {
+                return next;
+            }
+            line = next;
+        }
+        return text.size();
+    }
+
+    static void ParseChunk(Chunk &chunk) {
+        chunk.styles.Clear();
+        chunk.fragments.Clear();
+        chunk.notes.Clear();
+        chunk.pageCount = 0;
+        chunk.reader.OpenMemory(chunk.text.data(), chunk.text.size());
+        chunk.parsed = ParseLayoutFile(chunk.reader, chunk.styles, chunk.fragments,
+                                       [&](PageSpec &page) {
+            if (chunk.pageCount == chunk.pages.size()) {
+                chunk.pages.emplace_back();
+            }
+            std::swap(chunk.pages[chunk.pageCount++], page);
+            return true;
+        }, &chunk.notes);
+        chunk.reader.Close();
+    }
+
+    // Latest fragment called name defined before chunk i; fragments holds
+    // those of earlier rounds, this round's are still in their chunks
+    int FindBefore(std::size_t i, const FragmentTable &fragments, const std::string &name) const {
+        for (std::size_t j = i; j-- > 0;) {
+            int index = chunks[j].fragments.Find(name);
+            if (index >= 0) {
+                return static_cast<int>(chunks[j].fragmentBase) + index;
+            }
+        }
+        return fragments.Find(name);
+    }
+
+    // In input order: map the chunk's styles and fragments to the
+    // document's. fragmentCount counts the fragments before the chunk.
+    bool Merge(std::size_t i, StyleTable &styles, const FragmentTable &fragments,
+               std::size_t &fragmentCount) {
+        Chunk &chunk = chunks[i];
+        if (!chunk.parsed) {
+            stylesFull = chunk.styles.Full();
+            fragmentsFull = chunk.fragments.Full();
+            return false;
+        }
+        chunk.styleMap.resize(chunk.styles.Size());
+        for (std::size_t k = 0; k < chunk.styles.Size(); ++k) {
+            if (!styles.Intern(chunk.styles.Get(static_cast<std::uint16_t>(k)), chunk.styleMap[k])) {
+                stylesFull = true;
+                return false;
+            }
+        }
+
+        chunk.resolved.resize(chunk.notes.names.size());
+        for (std::size_t k = 0; k < chunk.notes.names.size(); ++k) {
+            chunk.resolved[k] = FindBefore(i, fragments, chunk.notes.names[k]);
+        }
+
+        chunk.fragmentBase = fragmentCount;
+        fragmentCount += chunk.fragments.Size();
+        if (fragmentCount > FragmentTable::maxFragments) {
+            fragmentsFull = true;
+            return false;
+        }
+        for (std::size_t k = 0; k < chunk.fragments.Size(); ++k) {
+            PageSpec &spec = chunk.fragments.Get(k).spec;
+            for (std::size_t l = 0; l < spec.lines.size(); ++l) {
+                spec.lines[l].style = chunk.styleMap[spec.lines[l].style];
+            }
+            spec.styleTable = &styles;
+        }
+        return true;
+    }
+
+    // Renumber the chunk's pages in place, once Merge has run
+    static void Patch(Chunk &chunk, const StyleTable &styles) {
+        const std::uint16_t *styleMap = chunk.styleMap.data();
+        const std::uint16_t base = static_cast<std::uint16_t>(chunk.fragmentBase);
+        for (std::size_t k = 0; k < chunk.pageCount; ++k) {
+            PageSpec &page = chunk.pages[k];
+            page.styleTable = &styles;
+            for (LineSpec &ls : page.lines) {
+                ls.style = styleMap[ls.style];
+                if (ls.fragment) {
+                    ls.fragment = static_cast<std::uint16_t>(ls.fragment + base);
+                }
+            }
+        }
+
+        // Back to front, so dropping a line leaves the later indices valid
+        const std::vector<ChunkNotes::Use> &uses = chunk.notes.uses;
+        for (std::size_t u = uses.size(); u-- > 0;) {
+            std::vector<LineSpec> &lines = chunk.pages[uses[u].page].lines;
+            int index = chunk.resolved[uses[u].name];
+            if (index >= 0) {
+                lines[uses[u].line].fragment = static_cast<std::uint16_t>(index + 1);
+            } else {
+                lines.erase(lines.begin() + uses[u].line);
+            }
+        }
+
+        // A sequential parse would not have handed on an unclosed last
+        // page left empty
+        if (chunk.notes.endsOpen && chunk.pages[chunk.pageCount - 1].lines.empty()) {
+            chunk.pageCount--;
+        }
+    }
+
+    WorkerPool &pool;
+    std::vector<Chunk> chunks;
+    bool stylesFull;
+    bool fragmentsFull;
+};
+
+// --- Synthetic layouts ---
+// Layout files of any size and shape, for benchmarks: pages of random words
+// with style changes every few lines and a share of bottom-anchored lines.
+// The same settings always give the same file.
+
+struct GeneratorSettings {
+    int pages;
+    int linesPerPage;
+    int lineLength;          // average characters per line
+    int styleEvery;          // lines between style changes, 0 = never
+    double footerRatio;      // share of each page's lines that are footer lines
+    unsigned long seed;
+};
+
+static void DefaultGeneratorSettings(GeneratorSettings &gen) {
+    gen.pages = 1000;
+    gen.linesPerPage = 40;
+    gen.lineLength = 70;
+    gen.styleEvery = 10;
+    gen.footerRatio = 0.05;
+    gen.seed = 1;
+}
+
+static void GenerateLayout(const GeneratorSettings &gen, ByteBuffer &out) {
+    static const char *const colors[] = { "black", "gray", "blue", "red", "green" };
+    static const char *const aligns[] = { "left", "center", "right" };
+    std::uint64_t state = gen.seed * 0x9e3779b97f4a7c15ULL + 1;
+    auto next = [&state](std::uint32_t n) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return static_cast<std::uint32_t>(state % n);
+    };
+    auto style = [&](int page, bool footer) {
+        out.Append("[page");
+        out.AppendInt(page);
+        out.Append("] ");
+        out.AppendInt(footer ? 9 : static_cast<long>(8 + next(10)));
+        out.Append(", ");
+        out.Append(colors[next(5)]);
+        out.Append(", ");
+        out.Append(aligns[next(3)]);
+        if (footer) {
+            out.Append(", bottom");
+        }
+        out.Append('\n');
+    };
+    auto line = [&]() {
+        const std::uint32_t target = static_cast<std::uint32_t>(gen.lineLength > 0 ? gen.lineLength : 1);
+        std::uint32_t len = target / 2 + next(target + 1);
+        std::uint32_t used = 0;
+        while (used < len) {
+            if (used > 0) {
+                out.Append(' ');
+                used++;
+            }
+            std::uint32_t word = 2 + next(9);
+            for (std::uint32_t k = 0; k < word; ++k) {
+                out.Append(static_cast<char>('a' + next(26)));
+            }
+            used += word;
+        }
+        out.Append('\n');
+    };
+
+    const int footerLines = static_cast<int>(gen.linesPerPage * gen.footerRatio + 0.5);
+    const int bodyLines = gen.linesPerPage - footerLines;
+    for (int page = 0; page < gen.pages; ++page) {
+        style(page, false);
+        for (int i = 0; i < bodyLines; ++i) {
+            if (gen.styleEvery > 0 && i > 0 && i % gen.styleEvery == 0) {
+                style(page, false);
+            }
+            line();
+        }
+        if (footerLines > 0) {
+            style(page, true);
+            for (int i = 0; i < footerLines; ++i) {
+                line();
+            }
+        }
+        out.Append("[/page");
+        out.AppendInt(page);
+        out.Append("]\n\n");
+    }
+}
+
+// --- Command line ---
+
+struct Options {
+    std::string layoutName;  // base name, without .txt/.pdf; "-" for stdin
+    std::string outputName;  // PDF path, "-" for stdout; empty: from layoutName
+    int jobs;                // worker threads for page layout
+    int compressLevel;       // zlib level for content streams, 0 = off
+    bool pdf15;              // object streams and a cross-reference stream
+    bool linearize;          // first page up front, for fast web view
+    bool batch;              // convert every name in batchNames
+    std::vector<std::string> batchNames;  // empty: read the manifest from stdin
+    std::string cacheDir;    // page cache directory; empty = no cache
+    std::string fontFile;    // TrueType font to embed; empty = Helvetica
+    std::size_t firstPage;   // --pages: first layout page, from 1; 0 = all
+    std::size_t lastPage;    // ... and the last; 0 = to the end
+    bool watch;              // convert again whenever the layout changes
+    std::string generateName;  // write a synthetic layout to <name>.txt
+    bool bench;              // time each stage on a synthetic layout
+    int benchIterations;     // best of this many runs per stage
+    GeneratorSettings gen;
+    bool serve;              // answer framed requests until the input ends
+    std::string socketPath;  // serve on this Unix socket instead of stdin
+    bool stats;              // report stage times and counters on stderr
+    bool statsJson;          // ... as one line of JSON
+    FileWriteMode writeMode; // how output files are written
+    bool directIo;           // O_DIRECT output files, where supported
+};
+
+static void PrintUsage() {
+    std::cerr << "Usage: layout2pdf [--jobs N] [--compress LEVEL] [--pdf15 | --linearize]\n"
+                 "                  [-o OUTPUT] <filename | ->\n";
+    std::cerr << "       layout2pdf --batch [options] [filename...]\n";
+    std::cerr << "       layout2pdf --serve [--socket PATH] [options]\n";
+    std::cerr << "       layout2pdf --generate NAME [generator options]\n";
+    std::cerr << "       layout2pdf --bench [--iterations N] [generator options] [options]\n";
+    std::cerr << "  --jobs N          lay out pages on N threads (0 = one per core)\n";
+    std::cerr << "  --compress LEVEL  deflate content streams, LEVEL 1-9 (0 = off)\n";
+    std::cerr << "  --pdf15           pack objects into object streams, with an xref stream\n";
+    std::cerr << "  --linearize       linearized (fast web view) output\n";
+    std::cerr << "  -o, --output FILE write the PDF to FILE (- = stdout); a layout read\n";
+    std::cerr << "                    from stdin (-) goes to stdout by default\n";
+    std::cerr << "  --cache DIR       reuse finished pages from DIR, and store new ones\n";
+    std::cerr << "  --font FILE       embed the glyphs used from TrueType font FILE, for\n";
+    std::cerr << "                    UTF-8 text, instead of using Helvetica\n";
+    std::cerr << "  --pages A-B       convert only layout pages A to B (A, A-: to the end)\n";
+    std::cerr << "  --watch           convert again each time the layout file changes,\n";
+    std::cerr << "                    updating only the pages edited where possible\n";
+    std::cerr << "  --batch           convert many files, one per thread; names are read\n";
+    std::cerr << "                    from stdin, one per line, when none are given\n";
+    std::cerr << "  --serve           answer framed requests on stdin/stdout\n";
+    std::cerr << "  --socket PATH     with --serve, listen on a Unix socket instead\n";
+    std::cerr << "  --stats           print stage times and counters to stderr at exit\n";
+    std::cerr << "  --stats-json      the same, as JSON\n";
+    std::cerr << "  --writer MODE     write output files with auto (default), uring,\n";
+    std::cerr << "                    thread or sync\n";
+    std::cerr << "  --direct          open output files with O_DIRECT, where supported\n";
+    std::cerr << "Generator options (--generate, --bench):\n";
+    std::cerr << "  --page-count N    pages (default 1000)\n";
+    std::cerr << "  --lines N         lines per page (default 40)\n";
+    std::cerr << "  --line-length N   average characters per line (default 70)\n";
+    std::cerr << "  --style-every N   lines between style changes, 0 = never (default 10)\n";
+    std::cerr << "  --footer-ratio F  share of lines that are footer lines (default 0.05)\n";
+    std::cerr << "  --seed N          random seed (default 1)\n";
+}
+
+// The whole of text as a number; false if it holds anything else
+template <typename T>
+static bool ParseNumber(const char *text, T &value) {
+    const char *end = text + std::strlen(text);
+    std::from_chars_result r = std::from_chars(text, end, value);
+    return r.ec == std::errc() && r.ptr == end;
+}
+
+// "A-B", "A" or "A-", pages counted from 1; last is 0 for "to the end"
+static bool ParsePageRange(std::string_view range, std::size_t &first, std::size_t &last) {
+    const char *end = range.data() + range.size();
+    std::from_chars_result r = std::from_chars(range.data(), end, first);
+    if (r.ec != std::errc() || first == 0) {
+        return false;
+    }
+    if (r.ptr == end) {
+        last = first;
+        return true;
+    }
+    if (*r.ptr != '-') {
+        return false;
+    }
+    last = 0;
+    if (r.ptr + 1 == end) {
+        return true;
+    }
+    std::from_chars_result l = std::from_chars(r.ptr + 1, end, last);
+    return l.ec == std::errc() && l.ptr == end && last >= first;
+}
+
+static bool ParseArgs(int argc, char **argv, Options &opts) {
+    opts.jobs = 1;
+    opts.compressLevel = 0;
+    opts.pdf15 = false;
+    opts.linearize = false;
+    opts.batch = false;
+    opts.serve = false;
+    opts.bench = false;
+    opts.benchIterations = 3;
+    opts.stats = false;
+    opts.statsJson = false;
+    opts.writeMode = FILE_WRITE_AUTO;
+    opts.directIo = false;
+    opts.firstPage = 0;
+    opts.lastPage = 0;
+    opts.watch = false;
+    DefaultGeneratorSettings(opts.gen);
+
+    std::vector<std::string> names;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--jobs" || arg == "-j") {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            if (!ParseNumber(argv[++i], opts.jobs) || opts.jobs < 0) {
+                return false;
+            }
+            if (opts.jobs == 0) {
+                opts.jobs = static_cast<int>(std::thread::hardware_concurrency());
+                if (opts.jobs <= 0) opts.jobs = 1;
+            }
+        } else if (arg == "--compress" || arg == "-z") {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            if (!ParseNumber(argv[++i], opts.compressLevel) ||
+                opts.compressLevel < 0 || opts.compressLevel > 9) {
+                return false;
+            }
+        } else if (arg == "--pdf15") {
+            opts.pdf15 = true;
+        } else if (arg == "--linearize") {
+            opts.linearize = true;
+        } else if (arg == "--output" || arg == "-o") {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            opts.outputName = argv[++i];
+        } else if (arg == "--cache") {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            opts.cacheDir = argv[++i];
+        } else if (arg == "--font") {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            opts.fontFile = argv[++i];
+        } else if (arg == "--generate") {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            opts.generateName = argv[++i];
+        } else if (arg == "--bench") {
+            opts.bench = true;
+        } else if (arg == "--pages") {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            if (!ParsePageRange(argv[++i], opts.firstPage, opts.lastPage)) {
+                return false;
+            }
+        } else if (arg == "--iterations" || arg == "--page-count" || arg == "--lines" ||
+                   arg == "--line-length" || arg == "--style-every") {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            int value;
+            if (!ParseNumber(argv[++i], value) || value < 0 ||
+                (value == 0 && arg != "--style-every")) {
+                return false;
+            }
+            if (arg == "--iterations")       opts.benchIterations = value;
+            else if (arg == "--page-count")  opts.gen.pages = value;
+            else if (arg == "--lines")       opts.gen.linesPerPage = value;
+            else if (arg == "--line-length") opts.gen.lineLength = value;
+            else                             opts.gen.styleEvery = value;
+        } else if (arg == "--seed") {
+            if (i + 1 >= argc || !ParseNumber(argv[++i], opts.gen.seed)) {
+                return false;
+            }
+        } else if (arg == "--footer-ratio") {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            const char *value = argv[++i];
+            char *end;
+            opts.gen.footerRatio = std::strtod(value, &end);
+            if (end == value || *end != '\0' ||
+                !(opts.gen.footerRatio >= 0.0 && opts.gen.footerRatio <= 1.0)) {
+                return false;
+            }
+        } else if (arg == "--batch") {
+            opts.batch = true;
+        } else if (arg == "--serve") {
+            opts.serve = true;
+        } else if (arg == "--stats") {
+            opts.stats = true;
+        } else if (arg == "--stats-json") {
+            opts.statsJson = true;
+        } else if (arg == "--writer") {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            std::string mode = argv[++i];
+            if (mode == "auto")        opts.writeMode = FILE_WRITE_AUTO;
+            else if (mode == "uring")  opts.writeMode = FILE_WRITE_URING;
+            else if (mode == "thread") opts.writeMode = FILE_WRITE_THREAD;
+            else if (mode == "sync")   opts.writeMode = FILE_WRITE_SYNC;
+            else                       return false;
+        } else if (arg == "--direct") {
+            opts.directIo = true;
+        } else if (arg == "--watch") {
+            opts.watch = true;
+        } else if (arg == "--socket") {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            opts.socketPath = argv[++i];
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            return false;
+        } else {
+            names.push_back(arg);
+        }
+    }
+    if (opts.pdf15 && opts.linearize) {
+        return false;
+    }
+    if ((opts.serve || opts.batch) && !opts.outputName.empty()) {
+        return false;
+    }
+    if (opts.watch && (opts.bench || !opts.generateName.empty() || opts.serve || opts.batch ||
+                       opts.outputName == "-")) {
+        return false;
+    }
+    if (opts.bench || !opts.generateName.empty()) {
+        return opts.firstPage == 0 && !opts.serve && !opts.batch && names.empty() &&
+               !(opts.bench && !opts.generateName.empty());
+    }
+    if (opts.serve) {
+        return !opts.batch && names.empty();
+    }
+    if (!opts.socketPath.empty()) {
+        return false;
+    }
+    if (opts.batch) {
+        opts.batchNames.swap(names);
+        return true;
+    }
+    if (names.size() != 1 || (opts.watch && names[0] == "-")) {
+        return false;
+    }
+    opts.layoutName = names[0];
+    return true;
+}
+
+// Page dictionary for a page under parentObj whose content stream is
+// contentObjNum; all pages share the resource dictionary resourcesObj
+static void BuildPageObject(int parentObj, int resourcesObj, int contentObjNum, ByteBuffer &obj) {
+    obj.Clear();
+    obj.Append("<< /Type /Page\n   /Parent ");
+    obj.AppendInt(parentObj);
+    obj.Append(" 0 R\n   /MediaBox [0 0 ");
+    obj.AppendInt(static_cast<long>(pageWidth));
+    obj.Append(' ');
+    obj.AppendInt(static_cast<long>(pageHeight));
+    obj.Append("]\n   /Resources ");
+    obj.AppendInt(resourcesObj);
+    obj.Append(" 0 R\n   /Contents ");
+    obj.AppendInt(contentObjNum);
+    obj.Append(" 0 R\n>>\n");
+}
+
+// --- Document conversion ---
+// Converts <name>.txt to <name>.pdf. A converter keeps its reader, writer,
+// page batches and per-worker buffers between documents, so converting many
+// files in a row allocates them once.
+
+class DocumentConverter {
+public:
+    DocumentConverter(const Options &opts, WorkerPool &pool)
+        : opts(opts), pool(pool), parallelParser(pool), parsedInParallel(false),
+          stdoutSink(std::cout), fontObj(0),
+          resourcesObj(0),
+          fragmentsPrepared(0), nextPageNumber(1), pagesToSkip(0), pagesLeft(0),
+          rangeDone(false), watching(false), contentBytesKept(0),
+          batchSize(static_cast<std::size_t>(pool.Size()) * 4),
+          batch(batchSize), batchCount(0), outputs(batchSize),
+          workers(static_cast<std::size_t>(pool.Size())) {
+        if (!opts.cacheDir.empty()) {
+            cache.Open(opts.cacheDir);
+        }
+        if (!opts.fontFile.empty() && trueType.Load(opts.fontFile, fontError)) {
+            font.Embed(trueType);
+            char hash[20];
+            std::snprintf(hash, sizeof(hash), "%016llx",
+                          static_cast<unsigned long long>(
+                              HashBytes(trueType.File().Data(), trueType.File().Size(), 0)));
+            fontKey = hash;
+        }
+    }
+
+    // On failure the partial output is removed and error says why
+    bool Convert(const std::string &layoutName, std::string &error) {
+        return ConvertFile(layoutName + ".txt", layoutName + ".pdf", error);
+    }
+
+    // Either name may be "-" for standard input or output. A file is written
+    // beside outputFile and renamed over it once complete, so a failed
+    // conversion leaves any earlier PDF in place.
+    bool ConvertFile(const std::string &layoutFile, const std::string &outputFile,
+                     std::string &error) {
+        const bool toStdout = outputFile == "-";
+        if (!fontError.empty()) {
+            error = fontError;
+            return false;
+        }
+        if (!in.Open(layoutFile)) {
+            error = "Failed to open layout file: " + layoutFile;
+            return false;
+        }
+        layoutPath = layoutFile == "-" ? std::string() : layoutFile;
+        const std::string target = toStdout ? outputFile : TemporaryPathFor(outputFile);
+        bool opened = toStdout ? writer.Open(stdoutSink, OutputMode())
+                               : writer.Open(target, OutputMode(), opts.writeMode,
+                                             opts.directIo);
+        if (!opened) {
+            in.Close();
+            if (!toStdout) {
+                std::remove(target.c_str());
+            }
+            error = "Failed to open output PDF: " + outputFile;
+            return false;
+        }
+        if (!WriteDocument(outputFile, error)) {
+            if (!toStdout) {
+                std::remove(target.c_str());
+            }
+            return false;
+        }
+        if (!toStdout && std::rename(target.c_str(), outputFile.c_str()) != 0) {
+            std::remove(target.c_str());
+            error = "Failed to write output PDF: " + outputFile;
+            watch.valid = false;
+            return false;
+        }
+        return true;
+    }
+
+    // --watch: convert layoutFile to outputFile again after it changed.
+    // If the last conversion was to the same file and the edit allows (see
+    // UpdatePages), only the pages whose text changed are rebuilt and
+    // appended as an incremental update: updated is set and pagesRebuilt
+    // counts the layout pages laid out again. Otherwise the layout is
+    // converted in full, as by ConvertFile. An update is not made once the
+    // file has grown to twice its size after the last full conversion.
+    bool Reconvert(const std::string &layoutFile, const std::string &outputFile, bool &updated,
+                   std::size_t &pagesRebuilt, std::string &error) {
+        updated = false;
+        if (watch.valid && fontError.empty() && outputFile == watch.outputFile &&
+            watch.fileSize <= 2 * watch.fullSize && OutputSize(outputFile) == watch.fileSize &&
+            in.Open(layoutFile)) {
+            layoutPath = layoutFile;
+            updated = UpdatePages(outputFile, pagesRebuilt);
+            rangeReader.Close();
+            in.Close();
+        }
+        return updated || ConvertFile(layoutFile, outputFile, error);
+    }
+
+    // Convert layout text in memory; the PDF is appended to pdf
+    bool ConvertBuffer(const char *text, std::size_t n, ByteBuffer &pdf, std::string &error) {
+        if (!fontError.empty()) {
+            error = fontError;
+            return false;
+        }
+        in.OpenMemory(text, n);
+        layoutPath.clear();
+        MemorySink sink(pdf);
+        if (!writer.Open(sink, OutputMode())) {
+            in.Close();
+            error = "Failed to open output PDF";
+            return false;
+        }
+        return WriteDocument("(response)", error);
+    }
+
+private:
+    // Size of the file at path, or -1
+    static long OutputSize(const std::string &path) {
+#ifdef LAYOUT2PDF_HAVE_MMAP
+        struct stat st;
+        if (::stat(path.c_str(), &st) == 0) {
+            return static_cast<long>(st.st_size);
+        }
+#else
+        (void)path;
+#endif
+        return -1;
+    }
+
+    PdfOutputMode OutputMode() const {
+        if (opts.pdf15) return PDF_OBJECT_STREAMS;
+        if (opts.linearize) return PDF_LINEARIZED;
+        return PDF_CLASSIC;
+    }
+
+    // Pages from the open reader to the open writer
+    bool WriteDocument(const std::string &outputFile, std::string &error) {
+        STATS_SCOPE(STAGE_ASSEMBLE);
+        // Fixed objects: 1 catalog, 2 page tree root, 3 font, 4 the resource
+        // dictionary shared by every page. The resources are written last,
+        // once every fragment's XObject is known, and so is an embedded
+        // font, once every glyph it needs is.
+        const int catalogObj = writer.NewObject();
+        const int pagesObj = writer.NewObject();
+        fontObj = writer.NewObject();
+        resourcesObj = writer.NewObject();
+        styles.Clear();
+        fragments.Clear();
+        parsedInParallel = false;
+        fragmentsPrepared = 0;
+        nextPageNumber = 1;
+        contentObjects.clear();
+        contentBytesKept = 0;
+        watch.valid = false;
+        watch.firstPdfPage.clear();
+        watch.pdfPages.clear();
+        watching = opts.watch && opts.firstPage == 0 && OutputMode() == PDF_CLASSIC &&
+                   !layoutPath.empty() && outputFile != "-";
+
+        ByteBuffer &obj = pageObj;
+        obj.Clear();
+        obj.Append("<< /Type /Catalog /Pages ");
+        obj.AppendInt(pagesObj);
+        obj.Append(" 0 R >>\n");
+        writer.WriteObject(catalogObj, obj);
+
+        // Font (Helvetica)
+        if (!font.Embedded()) {
+            obj.Clear();
+            obj.Append("<< /Type /Font /Subtype /Type1 /BaseFont /");
+            obj.Append(helveticaMetrics.baseFont);
+            obj.Append(" /Encoding /WinAnsiEncoding >>\n");
+            writer.WriteObject(fontObj, obj);
+        }
+        for (WorkerState &ws : workers) {
+            ws.glyphs.Clear();
+        }
+        writer.MarkShared(resourcesObj);
+        writer.MarkShared(fontObj);
+
+        // Each page object is followed directly by its content stream.
+        // Parsed pages are collected into batches that are laid out,
+        // serialised and compressed on the worker pool, then written in page
+        // order. One parsed page may fill several PDF pages. The page tree
+        // nodes go last, once the number of pages is known.
+        PageTree tree(writer, pagesObj);
+        batchCount = 0;
+
+        // With --pages, parsing stops once the last page wanted is in
+        std::string rangeError;
+        PageHandler onPage = [&](PageSpec &page) {
+            if (pagesToSkip > 0) {
+                pagesToSkip--;
+                return true;
+            }
+            std::swap(batch[batchCount++], page);
+            if (--pagesLeft == 0) {
+                rangeDone = true;
+                return false;
+            }
+            if (batchCount < batchSize) {
+                return true;
+            }
+            return FlushBatch(tree);
+        };
+        bool parsed = ParsePages(onPage, rangeError);
+        if (parsed && batchCount > 0) {
+            parsed = FlushBatch(tree);
+        }
+        if (parsed && watching) {
+            watching = RecordLayout();
+        }
+        rangeReader.Close();
+        in.Close();
+
+        if (!parsed || tree.PageCount() == 0) {
+            if (!rangeError.empty()) {
+                error = rangeError;
+            } else if (!parsed && !TableLimitError().empty()) {
+                error = TableLimitError();
+            } else if (!parsed) {
+                error = "Failed to write output PDF: " + outputFile;
+            } else {
+                error = "No pages parsed from layout file.";
+            }
+            batchCount = 0;
+            writer.Abort();
+            return false;
+        }
+
+        if (font.Embedded()) {
+            WriteEmbeddedFont();
+        }
+
+        obj.Clear();
+        obj.Append("<< /Font << /F1 ");
+        obj.AppendInt(fontObj);
+        obj.Append(" 0 R >>");
+        bool anyXObject = false;
+        for (std::size_t i = 0; i < fragmentsPrepared; ++i) {
+            const Fragment &f = fragments.Get(i);
+            if (f.objNum == 0) {
+                continue;
+            }
+            obj.Append(anyXObject ? " /Fr" : "\n   /XObject << /Fr");
+            obj.AppendInt(f.id);
+            obj.Append(' ');
+            obj.AppendInt(f.objNum);
+            obj.Append(" 0 R");
+            anyXObject = true;
+        }
+        obj.Append(anyXObject ? " >> >>\n" : " >>\n");
+        writer.WriteObject(resourcesObj, obj);
+
+        tree.Finish();
+
+        if (!writer.Finish(catalogObj)) {
+            error = "Failed to write output PDF: " + outputFile;
+            return false;
+        }
+        if (watching) {
+            watch.firstPdfPage.push_back(static_cast<std::uint32_t>(watch.pdfPages.size()));
+            watch.valid = watch.firstPdfPage.size() == watch.index.PageCount() + 1;
+            watch.outputFile = outputFile;
+            watch.catalogObj = catalogObj;
+            watch.objectCount = writer.ObjectCount();
+            watch.fileSize = writer.Position();
+            watch.fullSize = watch.fileSize;
+            watch.xrefOffset = writer.XrefOffset();
+            if (font.Embedded()) {
+                watch.glyphs = workers[0].glyphs;   // merged by WriteEmbeddedFont
+            }
+        }
+        return true;
+    }
+
+    // --watch: index the layout just parsed, with a hash of each page and
+    // fragment definition, to compare the next version with. The index
+    // must account for every fragment the parser defined.
+    bool RecordLayout() {
+        LayoutStamp stamp;
+        const std::string_view text = in.Contents();
+        if (!in.Stable() || !LayoutIndex::Stamp(layoutPath, text, stamp) ||
+            !watch.index.Build(text, stamp) || watch.index.FragmentCount() != fragments.Size()) {
+            return false;
+        }
+        watch.pageText.resize(watch.index.PageCount());
+        for (std::size_t i = 0; i < watch.pageText.size(); ++i) {
+            watch.pageText[i] = LayoutIndex::HashBlock(text, watch.index.GetPage(i).block);
+        }
+        watch.fragmentText.resize(watch.index.FragmentCount());
+        for (std::size_t k = 0; k < watch.fragmentText.size(); ++k) {
+            watch.fragmentText[k] = LayoutIndex::HashBlock(text, watch.index.GetFragment(k).block);
+        }
+        return true;
+    }
+
+    // --watch: write the open layout as an incremental update of the
+    // output file, if the only change is to the text of some pages and each
+    // still fills as many PDF pages. Fragments, page numbers, the page tree
+    // and the font subset then stay as they are, and every page rebuilt
+    // gets a new content stream object and its page object is replaced.
+    // False when the layout has to be converted in full instead, which is
+    // also how a failure part way through the update is repaired.
+    bool UpdatePages(const std::string &outputFile, std::size_t &pagesRebuilt) {
+        STATS_SCOPE(STAGE_ASSEMBLE);
+        LayoutStamp stamp;
+        const std::string_view text = in.Contents();
+        if (!in.Stable() || !LayoutIndex::Stamp(layoutPath, text, stamp) ||
+            !updateIndex.Build(text, stamp)) {
+            return false;
+        }
+        const LayoutIndex &old = watch.index;
+        if (updateIndex.PageCount() != old.PageCount() ||
+            updateIndex.FragmentCount() != old.FragmentCount()) {
+            return false;
+        }
+        for (std::size_t k = 0; k < updateIndex.FragmentCount(); ++k) {
+            const LayoutIndex::FragmentDef &def = updateIndex.GetFragment(k);
+            if (def.name != old.GetFragment(k).name ||
+                !(LayoutIndex::HashBlock(text, def.block) == watch.fragmentText[k])) {
+                return false;
+            }
+        }
+        changedPages.clear();
+        changedText.clear();
+        for (std::size_t i = 0; i < updateIndex.PageCount(); ++i) {
+            const LayoutIndex::Page &page = updateIndex.GetPage(i);
+            if (page.fragmentsBefore != old.GetPage(i).fragmentsBefore) {
+                return false;
+            }
+            ContentHash h = LayoutIndex::HashBlock(text, page.block);
+            if (!(h == watch.pageText[i])) {
+                changedPages.push_back(i);
+                changedText.push_back(h);
+            }
+        }
+
+        bool opened = false;
+        auto fail = [&]() {
+            batchCount = 0;
+            if (opened) {
+                writer.Abort();
+            }
+            return false;
+        };
+        for (std::size_t done = 0; done < changedPages.size();) {
+            const std::size_t begin = done;
+            batchCount = 0;
+            for (; batchCount < batchSize && done < changedPages.size(); ++done) {
+                if (!ParseChangedPage(text, changedPages[done], batch[batchCount])) {
+                    return fail();
+                }
+                batchCount++;
+            }
+            for (WorkerState &ws : workers) {
+                ws.glyphs.Clear();
+            }
+            LayOutBatch();
+            for (std::size_t j = 0; j < batchCount; ++j) {
+                const std::size_t i = changedPages[begin + j];
+                const std::uint32_t first = watch.firstPdfPage[i];
+                if (outputs[j].count != watch.firstPdfPage[i + 1] - first) {
+                    return fail();
+                }
+                outputs[j].firstPage = static_cast<int>(first) + 1;
+            }
+            if (font.Embedded()) {
+                for (const WorkerState &ws : workers) {
+                    if (!watch.glyphs.Covers(ws.glyphs)) {
+                        return fail();
+                    }
+                }
+            }
+            SerializeBatch();
+
+            if (!opened) {
+                if (!writer.OpenUpdate(outputFile, watch.fileSize, watch.objectCount,
+                                       watch.xrefOffset)) {
+                    return fail();
+                }
+                opened = true;
+            }
+            for (std::size_t j = 0; j < batchCount; ++j) {
+                const SlotOutput &slot = outputs[j];
+                const std::uint32_t first = watch.firstPdfPage[changedPages[begin + j]];
+                for (std::size_t k = 0; k < slot.count; ++k) {
+                    const WatchedPage &wp = watch.pdfPages[first + k];
+                    int contentObjNum = writer.NewObject();
+                    BuildPageObject(wp.parentObj, resourcesObj, contentObjNum, pageObj);
+                    writer.WriteObject(wp.pageObj, pageObj);
+                    writer.WriteStreamObject(contentObjNum, slot.streams[k], slot.deflated[k] != 0);
+                    STATS_ADD(STAT_STREAM_BYTES, slot.streams[k].Size());
+                    STATS_ADD(STAT_PAGES, 1);
+                }
+            }
+            if (!writer.Good()) {
+                return fail();
+            }
+        }
+        batchCount = 0;
+
+        if (opened) {
+            if (!writer.Finish(watch.catalogObj)) {
+                return false;
+            }
+            watch.objectCount = writer.ObjectCount();
+            watch.fileSize = writer.Position();
+            watch.xrefOffset = writer.XrefOffset();
+        }
+        for (std::size_t j = 0; j < changedPages.size(); ++j) {
+            watch.pageText[changedPages[j]] = changedText[j];
+        }
+        watch.index.Swap(updateIndex);
+        pagesRebuilt = changedPages.size();
+        return true;
+    }
+
+    // Parse page i of updateIndex into spec. [use NAME] lines are resolved
+    // through the index, to the document's fragment as of that page.
+    bool ParseChangedPage(std::string_view text, std::size_t i, PageSpec &spec) {
+        const LayoutIndex::Block &block = updateIndex.GetPage(i).block;
+        rangeReader.OpenMemory(text.data() + block.begin, static_cast<std::size_t>(block.end - block.begin));
+        watchFragments.Clear();
+        watchNotes.Clear();
+        std::size_t pages = 0;
+        bool parsed = ParseLayoutFile(rangeReader, styles, watchFragments, [&](PageSpec &page) {
+            std::swap(spec, page);
+            pages++;
+            return true;
+        }, &watchNotes);
+        if (!parsed || pages != 1) {
+            return false;
+        }
+        // Back to front, so dropping a line leaves the later indices valid
+        const std::vector<ChunkNotes::Use> &uses = watchNotes.uses;
+        for (std::size_t u = uses.size(); u-- > 0;) {
+            int k = updateIndex.FindFragment(watchNotes.names[uses[u].name], i);
+            if (k >= 0) {
+                spec.lines[uses[u].line].fragment = static_cast<std::uint16_t>(k + 1);
+            } else {
+                spec.lines.erase(spec.lines.begin() + uses[u].line);
+            }
+        }
+        return true;
+    }
+
+    // Parse the open reader, or with --pages just the pages in range. A
+    // mapped layout file is indexed (see LayoutIndex), so only the range
+    // and the fragment definitions it can use are read; other input is
+    // parsed from the start, skipping pages until the range begins. Large
+    // mapped inputs are parsed on the pool, a round of chunks at a time.
+    bool ParsePages(const PageHandler &onPage, std::string &rangeError) {
+        pagesToSkip = 0;
+        pagesLeft = std::numeric_limits<std::size_t>::max();
+        rangeDone = false;
+        if (opts.firstPage == 0) {
+            return Parse(in, onPage);
+        }
+        if (opts.lastPage > 0) {
+            pagesLeft = opts.lastPage - opts.firstPage + 1;
+        }
+        LayoutStamp stamp;
+        if (layoutPath.empty() || !in.Stable() ||
+            !LayoutIndex::Stamp(layoutPath, in.Contents(), stamp)) {
+            pagesToSkip = opts.firstPage - 1;
+            if (!Parse(in, onPage) && !rangeDone) {
+                return false;
+            }
+            if (pagesToSkip > 0) {
+                rangeError = "Layout file has only " +
+                             std::to_string(opts.firstPage - 1 - pagesToSkip) + " pages.";
+                return false;
+            }
+            return true;
+        }
+
+        // A stored index that does not fit the blocks the range needs is
+        // stale after all, and is rebuilt
+        const std::string indexPath = layoutPath + ".idx";
+        const std::string_view text = in.Contents();
+        if (!layoutIndex.Load(indexPath, stamp) || !RangeIntact(text)) {
+            if (!layoutIndex.Build(text, stamp)) {
+                rangeError = TooManyFragmentsError();
+                return false;
+            }
+            layoutIndex.Store(indexPath);
+            RangeIntact(text);
+        }
+        const std::size_t count = layoutIndex.PageCount();
+        if (opts.firstPage > count) {
+            rangeError = "Layout file has only " + std::to_string(count) + " pages.";
+            return false;
+        }
+
+        const std::size_t last = opts.lastPage == 0 || opts.lastPage > count ? count : opts.lastPage;
+        const LayoutIndex::Page &first = layoutIndex.GetPage(opts.firstPage - 1);
+        PageHandler noPages = [](PageSpec &) { return true; };
+        for (const LayoutIndex::Block &def : rangeFragments) {
+            rangeReader.OpenMemory(text.data() + def.begin, static_cast<std::size_t>(def.end - def.begin));
+            if (!ParseLayoutFile(rangeReader, styles, fragments, noPages)) {
+                return false;
+            }
+        }
+        const std::uint64_t end = layoutIndex.GetPage(last - 1).block.end;
+        rangeReader.OpenMemory(text.data() + first.block.begin,
+                               static_cast<std::size_t>(end - first.block.begin));
+        return Parse(rangeReader, onPage) || rangeDone;
+    }
+
+    // Whether layoutIndex has the first page of the range and the blocks
+    // of text the range is parsed from are intact; fills rangeFragments
+    bool RangeIntact(std::string_view text) {
+        rangeFragments.clear();
+        const std::size_t count = layoutIndex.PageCount();
+        if (opts.firstPage > count) {
+            return false;
+        }
+        const std::size_t last = opts.lastPage == 0 || opts.lastPage > count ? count : opts.lastPage;
+        layoutIndex.FragmentsAt(opts.firstPage - 1, rangeFragments);
+        for (const LayoutIndex::Block &def : rangeFragments) {
+            if (!LayoutIndex::Intact(text, def)) {
+                return false;
+            }
+        }
+        return LayoutIndex::Intact(text, layoutIndex.GetPage(opts.firstPage - 1).block) &&
+               LayoutIndex::Intact(text, layoutIndex.GetPage(last - 1).block);
+    }
+
+    bool Parse(LayoutReader &reader, const PageHandler &onPage) {
+        parsedInParallel = parallelParser.Suits(reader);
+        return parsedInParallel ? parallelParser.Parse(reader, styles, fragments, onPage)
+                                : ParseLayoutFile(reader, styles, fragments, onPage);
+    }
+
+    // Why a failed parse stopped, when a style or fragment table filled up;
+    // empty when it failed for another reason
+    std::string TableLimitError() const {
+        if (styles.Full() || (parsedInParallel && parallelParser.StylesFull())) {
+            return "Too many distinct styles in layout file (at most " +
+                   std::to_string(StyleTable::maxStyles) + ").";
+        }
+        if (fragments.Full() || (parsedInParallel && parallelParser.FragmentsFull())) {
+            return TooManyFragmentsError();
+        }
+        return std::string();
+    }
+
+    static std::string TooManyFragmentsError() {
+        return "Too many fragments in layout file (at most " +
+               std::to_string(FragmentTable::maxFragments) + ").";
+    }
+
+    // Layouts and content streams of each batch slot; buffers keep their
+    // capacity between batches
+    struct SlotOutput {
+        std::vector<PageLayout> layouts;
+        std::vector<ByteBuffer> streams;
+        std::vector<char> deflated;
+        std::size_t count;
+        int firstPage;        // number of the slot's first PDF page
+        ByteBuffer key;       // page cache key
+        bool pageDependent;   // key needs firstPage too
+        bool cached;          // streams came from the page cache
+    };
+
+    // Buffers of one pool worker, reused for every page it handles
+    struct WorkerState {
+        LayoutEngine engine;
+        ContentScratch scratch;
+        GlyphSet glyphs;     // of an embedded font, used by the pages laid out here
+        ByteBuffer encoded;
+        ByteBuffer cacheData;
+    };
+
+    // Lay out and write the XObject of every fragment defined since the
+    // last batch, before any page using it is laid out
+    void PrepareFragments() {
+        const bool compress = opts.compressLevel > 0;
+        for (; fragmentsPrepared < fragments.Size(); ++fragmentsPrepared) {
+            Fragment &f = fragments.Get(fragmentsPrepared);
+            {
+                STATS_SCOPE(STAGE_LAYOUT);
+                LayoutFragment(f, font);
+                NoteGlyphs(f.spec, workers[0].glyphs);
+                if (!f.fields.Empty()) {
+                    font.AddGlyphs("0123456789", workers[0].glyphs);
+                }
+            }
+            if (f.fixed.Empty()) {
+                continue;
+            }
+
+            ByteBuffer &content = fragmentContent;
+            content.Clear();
+            {
+                STATS_SCOPE(STAGE_SERIALIZE);
+                BuildFragmentContent(f, font, workers[0].scratch, content);
+            }
+            bool deflated = compress && FlateEncode(content, opts.compressLevel, workers[0].encoded);
+            if (deflated) {
+                content.Swap(workers[0].encoded);
+            }
+
+            pageObj.Clear();
+            pageObj.Append("/Type /XObject /Subtype /Form /BBox [0 ");
+            pageObj.AppendMilli(ToMilli(f.minY));
+            pageObj.Append(' ');
+            pageObj.AppendInt(static_cast<long>(pageWidth));
+            pageObj.Append(' ');
+            pageObj.AppendMilli(ToMilli(f.maxY));
+            pageObj.Append("] /Resources ");
+            pageObj.AppendInt(resourcesObj);
+            pageObj.Append(" 0 R");
+            std::string extraDict(pageObj.Data(), pageObj.Size());
+
+            f.objNum = writer.NewObject();
+            writer.WriteStreamObject(f.objNum, content, deflated, extraDict.c_str());
+            writer.MarkShared(f.objNum);
+        }
+    }
+
+    void NoteGlyphs(const PageSpec &spec, GlyphSet &used) const {
+        for (std::size_t i = 0; i < spec.lines.size(); ++i) {
+            font.AddGlyphs(spec.lines[i].Text(), used);
+        }
+    }
+
+    // The Type0 font for --font, once the document's text is all known: a
+    // CIDFontType2 over the subset of the font program holding every glyph
+    // used, with their widths and a ToUnicode CMap so the text can still be
+    // searched and copied
+    void WriteEmbeddedFont() {
+        GlyphSet &used = workers[0].glyphs;
+        for (std::size_t w = 1; w < workers.size(); ++w) {
+            used.Merge(workers[w].glyphs);
+        }
+        used.Add(0);
+        const std::uint32_t end = used.End();
+
+        // Subset tag: six capitals that change with the glyphs kept
+        std::uint64_t h = HashBytes(reinterpret_cast<const char *>(used.Words().data()),
+                                    (end + 63) / 64 * sizeof(std::uint64_t), 0x452821e638d01377ULL);
+        std::string name;
+        for (int k = 0; k < 6; ++k) {
+            name.push_back(static_cast<char>('A' + h % 26));
+            h /= 26;
+        }
+        name += '+';
+        name += trueType.PostScriptName();
+
+        const int descendantObj = writer.NewObject();
+        const int descriptorObj = writer.NewObject();
+        const int programObj = writer.NewObject();
+        const int toUnicodeObj = writer.NewObject();
+
+        ByteBuffer &obj = pageObj;
+        obj.Clear();
+        obj.Append("<< /Type /Font /Subtype /Type0 /BaseFont /");
+        obj.Append(name);
+        obj.Append(" /Encoding /Identity-H\n   /DescendantFonts [");
+        obj.AppendInt(descendantObj);
+        obj.Append(" 0 R] /ToUnicode ");
+        obj.AppendInt(toUnicodeObj);
+        obj.Append(" 0 R >>\n");
+        writer.WriteObject(fontObj, obj);
+
+        // Widths of each run of consecutive glyph ids
+        obj.Clear();
+        obj.Append("<< /Type /Font /Subtype /CIDFontType2 /BaseFont /");
+        obj.Append(name);
+        obj.Append("\n   /CIDSystemInfo << /Registry (Adobe) /Ordering (Identity) /Supplement 0 >>"
+                   "\n   /FontDescriptor ");
+        obj.AppendInt(descriptorObj);
+        obj.Append(" 0 R /CIDToGIDMap /Identity\n   /W [");
+        for (std::uint32_t gid = 0; gid < end;) {
+            if (!used.Has(gid)) {
+                gid++;
+                continue;
+            }
+            obj.Append("\n   ");
+            obj.AppendInt(static_cast<long>(gid));
+            obj.Append(" [");
+            for (const std::uint32_t first = gid; gid < end && used.Has(gid); ++gid) {
+                if (gid != first) {
+                    obj.Append(' ');
+                }
+                obj.AppendInt(trueType.Advance(gid));
+            }
+            obj.Append(']');
+        }
+        obj.Append("\n   ] >>\n");
+        writer.WriteObject(descendantObj, obj);
+
+        obj.Clear();
+        obj.Append("<< /Type /FontDescriptor /FontName /");
+        obj.Append(name);
+        obj.Append(" /Flags ");
+        obj.AppendInt(32 | (trueType.FixedPitch() ? 1 : 0) | (trueType.ItalicAngle() != 0.0f ? 64 : 0));
+        obj.Append("\n   /FontBBox [");
+        for (int k = 0; k < 4; ++k) {
+            if (k > 0) {
+                obj.Append(' ');
+            }
+            obj.AppendInt(trueType.BBox(k));
+        }
+        obj.Append("] /ItalicAngle ");
+        obj.AppendMilli(ToMilli(trueType.ItalicAngle()));
+        obj.Append(" /Ascent ");
+        obj.AppendInt(trueType.Ascent());
+        obj.Append(" /Descent ");
+        obj.AppendInt(trueType.Descent());
+        obj.Append(" /CapHeight ");
+        obj.AppendInt(trueType.CapHeight());
+        obj.Append(" /StemV 80\n   /FontFile2 ");
+        obj.AppendInt(programObj);
+        obj.Append(" 0 R >>\n");
+        writer.WriteObject(descriptorObj, obj);
+
+        // The font program is always deflated, at --compress level if given
+        ByteBuffer &encoded = workers[0].encoded;
+        fontProgram.Clear();
+        trueType.BuildSubset(used, fontProgram);
+        std::string extraDict = "/Length1 " + std::to_string(fontProgram.Size());
+        bool deflated = FlateEncode(fontProgram, opts.compressLevel > 0 ? opts.compressLevel : 6, encoded);
+        if (deflated) {
+            fontProgram.Swap(encoded);
+        }
+        writer.WriteStreamObject(programObj, fontProgram, deflated, extraDict.c_str());
+
+        fontProgram.Clear();
+        fontProgram.Append("/CIDInit /ProcSet findresource begin\n12 dict begin\nbegincmap\n"
+                           "/CIDSystemInfo << /Registry (Adobe) /Ordering (UCS) /Supplement 0 >> def\n"
+                           "/CMapName /Adobe-Identity-UCS def\n/CMapType 2 def\n"
+                           "1 begincodespacerange\n<0000> <FFFF>\nendcodespacerange\n");
+        std::vector<std::uint32_t> mapped;
+        for (std::uint32_t gid = 1; gid < end; ++gid) {
+            if (used.Has(gid) && trueType.UnicodeOf(gid) != 0) {
+                mapped.push_back(gid);
+            }
+        }
+        for (std::size_t k = 0; k < mapped.size(); k += 100) {
+            const std::size_t n = std::min<std::size_t>(100, mapped.size() - k);
+            fontProgram.AppendInt(static_cast<long>(n));
+            fontProgram.Append(" beginbfchar\n");
+            for (std::size_t j = k; j < k + n; ++j) {
+                const std::uint32_t cp = trueType.UnicodeOf(mapped[j]);
+                fontProgram.Append('<');
+                AppendHex16(fontProgram, mapped[j]);
+                fontProgram.Append("> <");
+                if (cp < 0x10000) {
+                    AppendHex16(fontProgram, cp);
+                } else {
+                    AppendHex16(fontProgram, 0xd800 + ((cp - 0x10000) >> 10));
+                    AppendHex16(fontProgram, 0xdc00 + ((cp - 0x10000) & 0x3ff));
+                }
+                fontProgram.Append(">\n");
+            }
+            fontProgram.Append("endbfchar\n");
+        }
+        fontProgram.Append("endcmap\nCMapName currentdict /CMap defineresource pop\nend\nend\n");
+        deflated = opts.compressLevel > 0 && FlateEncode(fontProgram, opts.compressLevel, encoded);
+        if (deflated) {
+            fontProgram.Swap(encoded);
+        }
+        writer.WriteStreamObject(toUnicodeObj, fontProgram, deflated);
+
+        writer.MarkShared(descendantObj);
+        writer.MarkShared(descriptorObj);
+        writer.MarkShared(programObj);
+        writer.MarkShared(toUnicodeObj);
+    }
+
+    bool FlushBatch(PageTree &tree) {
+        STATS_SCOPE(STAGE_ASSEMBLE);
+        PrepareFragments();
+
+        // Lay every slot out first: page numbers, which fragments can show,
+        // depend on how many pages the slots before filled
+        LayOutBatch();
+        for (std::size_t i = 0; i < batchCount; ++i) {
+            outputs[i].firstPage = nextPageNumber;
+            nextPageNumber += static_cast<int>(outputs[i].count);
+        }
+        SerializeBatch();
+
+        for (std::size_t i = 0; i < batchCount; ++i) {
+            const SlotOutput &slot = outputs[i];
+            if (watching) {
+                watch.firstPdfPage.push_back(static_cast<std::uint32_t>(watch.pdfPages.size()));
+            }
+            for (std::size_t k = 0; k < slot.count; ++k) {
+                int parentObj = tree.NextParent();
+                int pageObjNum = writer.NewObject();
+
+                // Pages with the same content share one stream object,
+                // except in linearized output, where each page's objects
+                // must be its own. A hash match is only taken once the
+                // bytes compare equal too.
+                const ByteBuffer &stream = slot.streams[k];
+                const bool deflated = slot.deflated[k] != 0;
+                int contentObjNum = 0;
+                ContentHash h = {0, 0};
+                bool shared = false;
+                if (!opts.linearize) {
+                    h = HashContent(stream);
+                    h.hi ^= static_cast<std::uint64_t>(deflated);
+                    auto it = contentObjects.find(h);
+                    if (it != contentObjects.end() && it->second.deflated == deflated &&
+                        it->second.bytes.Size() == stream.Size() &&
+                        std::memcmp(it->second.bytes.Data(), stream.Data(), stream.Size()) == 0) {
+                        contentObjNum = it->second.objNum;
+                        shared = true;
+                    }
+                }
+                if (!shared) {
+                    contentObjNum = writer.NewObject();
+                    STATS_ADD(STAT_STREAM_BYTES, slot.streams[k].Size());
+                    STATS_PEAK(PEAK_STREAM, slot.streams[k].Size());
+                } else {
+                    STATS_ADD(STAT_SHARED_STREAMS, 1);
+                }
+                STATS_ADD(STAT_PAGES, 1);
+
+                BuildPageObject(parentObj, resourcesObj, contentObjNum, pageObj);
+                writer.WriteObject(pageObjNum, pageObj);
+                if (!shared) {
+                    writer.WriteStreamObject(contentObjNum, stream, deflated);
+                    if (!opts.linearize && contentBytesKept + stream.Size() <= sharedContentBudget &&
+                        contentObjects.find(h) == contentObjects.end()) {
+                        SharedContent &entry = contentObjects[h];
+                        entry.objNum = contentObjNum;
+                        entry.deflated = deflated;
+                        entry.bytes.Append(stream.Data(), stream.Size());
+                        contentBytesKept += stream.Size();
+                    }
+                }
+                writer.MarkPage(pageObjNum, contentObjNum);
+                tree.AddPage(pageObjNum);
+                if (watching) {
+                    WatchedPage wp = { pageObjNum, parentObj };
+                    watch.pdfPages.push_back(wp);
+                }
+            }
+        }
+        batchCount = 0;
+        return writer.Good();
+    }
+
+    // Lay out each page of the batch, or find its streams in the page cache
+    void LayOutBatch() {
+        pool.Run(batchCount, [&](std::size_t i, int worker) {
+            WorkerState &ws = workers[static_cast<std::size_t>(worker)];
+            SlotOutput &slot = outputs[i];
+            slot.count = 0;
+            slot.cached = false;
+            if (font.Embedded()) {
+                // From the text rather than the pages drawn, so pages taken
+                // from the cache count the same
+                STATS_SCOPE(STAGE_LAYOUT);
+                NoteGlyphs(batch[i], ws.glyphs);
+            }
+
+            if (cache.Enabled()) {
+                STATS_SCOPE(STAGE_CACHE);
+                BuildPageKey(batch[i], fragments, opts.compressLevel, fontKey, slot.key,
+                             slot.pageDependent);
+                if (!slot.pageDependent &&
+                    cache.Load(slot.key, slot.streams, slot.deflated, slot.count, ws.cacheData)) {
+                    STATS_ADD(STAT_CACHE_HITS, 1);
+                    slot.cached = true;
+                    return;
+                }
+                slot.count = 0;
+            }
+
+            STATS_SCOPE(STAGE_LAYOUT);
+            ws.engine.Begin(batch[i], fragments, font);
+            for (;;) {
+                if (slot.count == slot.layouts.size()) {
+                    slot.layouts.emplace_back();
+                }
+                if (!ws.engine.NextPage(slot.layouts[slot.count])) {
+                    break;
+                }
+                slot.count++;
+            }
+        });
+    }
+
+    // Content streams of the pages laid out, once each slot's firstPage is
+    // set
+    void SerializeBatch() {
+        const bool compress = opts.compressLevel > 0;
+        pool.Run(batchCount, [&](std::size_t i, int worker) {
+            WorkerState &ws = workers[static_cast<std::size_t>(worker)];
+            SlotOutput &slot = outputs[i];
+            if (slot.cached) {
+                return;
+            }
+            if (cache.Enabled() && slot.pageDependent) {
+                STATS_SCOPE(STAGE_CACHE);
+                std::size_t count = 0;
+                slot.key.Append(" p");
+                slot.key.AppendInt(slot.firstPage);
+                if (cache.Load(slot.key, slot.streams, slot.deflated, count, ws.cacheData) &&
+                    count == slot.count) {
+                    STATS_ADD(STAT_CACHE_HITS, 1);
+                    slot.cached = true;
+                    return;
+                }
+            }
+            while (slot.streams.size() < slot.count) {
+                slot.streams.emplace_back();
+                slot.deflated.push_back(0);
+            }
+            for (std::size_t k = 0; k < slot.count; ++k) {
+                ByteBuffer &stream = slot.streams[k];
+                stream.Clear();
+                {
+                    STATS_SCOPE(STAGE_SERIALIZE);
+                    BuildPageContent(slot.layouts[k], slot.firstPage + static_cast<int>(k), font,
+                                     ws.scratch, stream);
+                }
+                STATS_ADD(STAT_CONTENT_BYTES, stream.Size());
+
+                bool deflated = compress && FlateEncode(stream, opts.compressLevel, ws.encoded);
+                if (deflated) {
+                    stream.Swap(ws.encoded);
+                }
+                slot.deflated[k] = deflated;
+            }
+            if (cache.Enabled()) {
+                STATS_SCOPE(STAGE_CACHE);
+                cache.Store(slot.key, slot.streams, slot.deflated, slot.count, ws.cacheData);
+            }
+        });
+    }
+
+    const Options &opts;
+    WorkerPool &pool;
+    ParallelParser parallelParser;
+    bool parsedInParallel;       // the last Parse was parallelParser's
+    LayoutReader in;
+    std::string layoutPath;      // of in, when it is a named file
+    PdfWriter writer;
+    StreamSink stdoutSink;
+    int fontObj;
+    int resourcesObj;
+
+    // --font: the font, or why it could not be loaded; fontKey identifies
+    // it in the page cache
+    TrueTypeFont trueType;
+    TextFont font;
+    std::string fontError;
+    std::string fontKey;
+    ByteBuffer fontProgram;
+
+    // Styles and fragments of the current document; the first
+    // fragmentsPrepared fragments have been laid out and written
+    StyleTable styles;
+    FragmentTable fragments;
+    std::size_t fragmentsPrepared;
+    ByteBuffer fragmentContent;
+    int nextPageNumber;
+
+    // --pages: the index of the layout file, the reader over the part of it
+    // parsed, and how many pages to skip and to take before parsing stops
+    LayoutIndex layoutIndex;
+    LayoutReader rangeReader;
+    std::vector<LayoutIndex::Block> rangeFragments;
+    std::size_t pagesToSkip;
+    std::size_t pagesLeft;
+    bool rangeDone;               // stopped after the last page wanted
+
+    // --watch: the document in the output file, as the last full
+    // conversion wrote it and updates since have changed it
+    struct WatchedPage {
+        int pageObj;
+        int parentObj;
+    };
+    struct WatchModel {
+        WatchModel()
+            : valid(false), catalogObj(0), objectCount(0), fileSize(0), fullSize(0),
+              xrefOffset(0) {}
+
+        bool valid;
+        std::string outputFile;
+        LayoutIndex index;                         // of the layout in the file
+        std::vector<ContentHash> pageText;         // hash of each page's text
+        std::vector<ContentHash> fragmentText;     // ... and each definition's
+        std::vector<std::uint32_t> firstPdfPage;   // per layout page, and the end
+        std::vector<WatchedPage> pdfPages;
+        GlyphSet glyphs;                           // in the embedded subset
+        int catalogObj;
+        int objectCount;
+        long fileSize;
+        long fullSize;                             // as the full conversion left it
+        long xrefOffset;
+    };
+    bool watching;                 // recording the model while converting
+    WatchModel watch;
+    LayoutIndex updateIndex;       // of the layout being compared
+    FragmentTable watchFragments;  // stays empty: uses are resolved by the index
+    ChunkNotes watchNotes;
+    std::vector<std::size_t> changedPages;
+    std::vector<ContentHash> changedText;
+
+    PageCache cache;
+    // A content stream object written so far, with a copy of its bytes to
+    // check a page's stream against before sharing the object
+    struct SharedContent {
+        int objNum;
+        bool deflated;
+        ByteBuffer bytes;
+    };
+    // Streams are kept until they hold sharedContentBudget bytes; later
+    // ones are written but not offered for sharing
+    static const std::size_t sharedContentBudget = 64 * 1024 * 1024;
+    std::unordered_map<ContentHash, SharedContent, ContentHashHasher> contentObjects;
+    std::size_t contentBytesKept;
+
+    // Parsed pages are swapped into batch slots, so the parser gets a spent
+    // page back and its arena and vectors are reused.
+    const std::size_t batchSize;
+    std::vector<PageSpec> batch;
+    std::size_t batchCount;
+    std::vector<SlotOutput> outputs;
+    std::vector<WorkerState> workers;
+    ByteBuffer pageObj;
+};
+
+// One converter per worker, each laying out pages on its own thread only
+class ConverterSet {
+public:
+    ConverterSet(const Options &opts, std::size_t count) {
+        for (std::size_t i = 0; i < count; ++i) {
+            pools.emplace_back(new WorkerPool(1));
+            converters.emplace_back(new DocumentConverter(opts, *pools.back()));
+        }
+    }
+
+    DocumentConverter &Get(int worker) {
+        return *converters[static_cast<std::size_t>(worker)];
+    }
+
+private:
+    std::vector<std::unique_ptr<WorkerPool> > pools;
+    std::vector<std::unique_ptr<DocumentConverter> > converters;
+};
+
+// --- Batch mode ---
+// Each worker converts whole documents on its own, with its own converter;
+// documents are spread over the workers with a StealingQueue, so a few large
+// files do not leave the other cores idle. Results are reported in input
+// order once everything is done.
+
+static int RunBatch(const Options &opts) {
+    std::vector<std::string> names = opts.batchNames;
+    if (names.empty()) {
+        std::string line;
+        while (std::getline(std::cin, line)) {
+            std::string_view name = Trim(line);
+            if (!name.empty()) {
+                names.emplace_back(name);
+            }
+        }
+    }
+
+    WorkerPool pool(opts.jobs);
+    const std::size_t numWorkers = static_cast<std::size_t>(pool.Size());
+    ConverterSet converters(opts, numWorkers);
+
+    StealingQueue queue(numWorkers, names.size());
+    std::vector<std::string> errors(names.size());
+    std::vector<char> converted(names.size(), 0);
+    pool.Run(numWorkers, [&](std::size_t owner, int worker) {
+        DocumentConverter &converter = converters.Get(worker);
+        std::size_t item;
+        while (queue.Pop(owner, item)) {
+            converted[item] = converter.Convert(names[item], errors[item]);
+        }
+    });
+
+    std::size_t failed = 0;
+    for (std::size_t i = 0; i < names.size(); ++i) {
+        if (converted[i]) {
+            std::cout << "ok    " << names[i] << ".pdf\n";
+        } else {
+            std::cout << "FAIL  " << names[i] << ": " << errors[i] << "\n";
+            failed++;
+        }
+    }
+    std::cout << (names.size() - failed) << " converted, " << failed << " failed\n";
+    return failed == 0 ? 0 : 1;
+}
+
+// --- Server mode ---
+// Framed requests on stdin, or on each connection to a Unix socket:
+//
+//     REQ <id> <length>\n<length bytes of layout text>
+//
+// are answered, in whatever order they finish, with
+//
+//     RES <id> <length>\n<length bytes of PDF>
+//     ERR <id> <length>\n<length bytes of error message>
+//
+// <id> is any token without spaces, echoed back unchanged. A connection's
+// reader keeps taking requests while earlier ones are being converted, so
+// many can be in flight at once, and replies wait in memory until the
+// client reads them. Nothing touches the disk unless --linearize needs its
+// spool file.
+
+#ifdef LAYOUT2PDF_HAVE_SOCKETS
+
+static bool WriteAll(int fd, const char *data, std::size_t n) {
+    while (n > 0) {
+        ssize_t done = ::write(fd, data, n);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += done;
+        n -= static_cast<std::size_t>(done);
+    }
+    return true;
+}
+
+// One client. Send queues a whole response and returns at once; the
+// connection's writer thread writes the queue out in order, so a client
+// that is slow to read its replies holds up that thread, never a worker.
+// The writer owns the descriptors and closes them once the connection is
+// gone and every reply has been written.
+class Connection {
+public:
+    Connection(int inFd, int outFd, bool ownsFds) : inFd(inFd), outbox(new Outbox) {
+        outbox->inFd = inFd;
+        outbox->outFd = outFd;
+        outbox->ownsFds = ownsFds;
+        outbox->writing = false;
+        outbox->done = false;
+        std::shared_ptr<Outbox> box = outbox;
+        std::thread([box] { WriteReplies(*box); }).detach();
+    }
+
+    ~Connection() {
+        std::lock_guard<std::mutex> lock(outbox->mutex);
+        outbox->done = true;
+        outbox->ready.notify_all();
+    }
+
+    int InputFd() const {
+        return inFd;
+    }
+
+    void Send(const char *tag, const std::string &id, const char *data, std::size_t n) {
+        ByteBuffer reply;
+        reply.Append(tag);
+        reply.Append(' ');
+        reply.Append(id);
+        reply.Append(' ');
+        reply.AppendInt(static_cast<long>(n));
+        reply.Append('\n');
+        reply.Append(data, n);
+
+        std::lock_guard<std::mutex> lock(outbox->mutex);
+        outbox->replies.push_back(std::move(reply));
+        outbox->ready.notify_all();
+    }
+
+    // Block until every reply sent so far has been written
+    void Flush() {
+        std::unique_lock<std::mutex> lock(outbox->mutex);
+        outbox->ready.wait(lock, [this] { return outbox->replies.empty() && !outbox->writing; });
+    }
+
+private:
+    struct Outbox {
+        int inFd;
+        int outFd;
+        bool ownsFds;
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<ByteBuffer> replies;
+        bool writing;        // a reply taken off replies is being written
+        bool done;           // the connection is gone
+
+        ~Outbox() {
+            if (ownsFds) {
+                ::close(inFd);
+                if (outFd != inFd) {
+                    ::close(outFd);
+                }
+            }
+        }
+    };
+
+    static void WriteReplies(Outbox &box) {
+        bool broken = false;     // client went away; drop further replies
+        std::unique_lock<std::mutex> lock(box.mutex);
+        for (;;) {
+            box.ready.wait(lock, [&box] { return box.done || !box.replies.empty(); });
+            if (box.replies.empty()) {
+                return;
+            }
+            ByteBuffer reply = std::move(box.replies.front());
+            box.replies.pop_front();
+            box.writing = true;
+            lock.unlock();
+            if (!broken) {
+                broken = !WriteAll(box.outFd, reply.Data(), reply.Size());
+            }
+            lock.lock();
+            box.writing = false;
+            box.ready.notify_all();
+        }
+    }
+
+    int inFd;
+    std::shared_ptr<Outbox> outbox;
+};
+
+struct ServerRequest {
+    std::shared_ptr<Connection> conn;
+    std::string id;
+    std::vector<char> text;
+};
+
+// Requests waiting for a worker. Push blocks while limit requests are
+// queued, so a fast client cannot buffer unbounded input; since workers
+// never wait on a client, the queue keeps draining. Pop blocks until a
+// request arrives or the queue is closed and drained.
+class RequestQueue {
+public:
+    explicit RequestQueue(std::size_t limit) : limit(limit), closed(false) {}
+
+    // False, leaving req as it was, once the queue is closed
+    bool Push(ServerRequest &req) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return closed || pending.size() < limit; });
+        if (closed) {
+            return false;
+        }
+        pending.push_back(std::move(req));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    bool Pop(ServerRequest &req) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return closed || !pending.empty(); });
+        if (pending.empty()) {
+            return false;
+        }
+        req = std::move(pending.front());
+        pending.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void Close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<ServerRequest> pending;
+    std::size_t limit;
+    bool closed;
+};
+
+// Buffered reads from a descriptor, for the request framing
+class FrameReader {
+public:
+    explicit FrameReader(int fd) : fd(fd), start(0), end(0), buf(64 * 1024) {}
+
+    // Header line without its newline; false at end of input or when the
+    // line is longer than maxLine
+    bool ReadLine(std::string &line, std::size_t maxLine) {
+        line.clear();
+        for (;;) {
+            const char *nl = static_cast<const char *>(
+                std::memchr(buf.data() + start, '\n', end - start));
+            if (nl) {
+                line.append(buf.data() + start, static_cast<std::size_t>(nl - (buf.data() + start)));
+                start = static_cast<std::size_t>(nl - buf.data()) + 1;
+                return true;
+            }
+            line.append(buf.data() + start, end - start);
+            start = end;
+            if (line.size() > maxLine || !Fill()) {
+                return false;
+            }
+        }
+    }
+
+    bool ReadExact(char *data, std::size_t n) {
+        while (n > 0) {
+            if (start == end && !Fill()) {
+                return false;
+            }
+            std::size_t take = end - start < n ? end - start : n;
+            std::memcpy(data, buf.data() + start, take);
+            start += take;
+            data += take;
+            n -= take;
+        }
+        return true;
+    }
+
+private:
+    bool Fill() {
+        start = 0;
+        end = 0;
+        for (;;) {
+            ssize_t got = ::read(fd, buf.data(), buf.size());
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            end = static_cast<std::size_t>(got);
+            return true;
+        }
+    }
+
+    int fd;
+    std::size_t start;
+    std::size_t end;
+    std::vector<char> buf;
+};
+
+// Queue every request on conn until its input ends. A malformed header
+// gets an ERR with id "-" and ends the connection, since the framing is lost.
+static void ReadRequests(const std::shared_ptr<Connection> &conn, RequestQueue &queue) {
+    const std::size_t maxRequest = 256 * 1024 * 1024;
+    FrameReader reader(conn->InputFd());
+    std::string line;
+    while (reader.ReadLine(line, 256)) {
+        std::vector<std::string_view> parts;
+        std::string_view rest = Trim(line);
+        while (!rest.empty()) {
+            std::size_t sp = rest.find(' ');
+            parts.push_back(rest.substr(0, sp));
+            rest = sp == std::string_view::npos ? std::string_view() : Trim(rest.substr(sp));
+        }
 
-    int numPages = static_cast<int>(pages.size());
-
-    // Object 1: Catalog
-    {
-        std::ostringstream obj;
-        obj << "1 0 obj\n";
-        obj << "<< /Type /Catalog /Pages 2 0 R >>\n";
-        obj << "endobj\n";
-        objects.push_back(obj.str());
-    }
-
-    // Object 2: Pages
-    {
-        std::ostringstream obj;
-        obj << "2 0 obj\n";
-        obj << "<< /Type /Pages /Kids [";
-        // Page objects start at index 4 (see below)
-        int firstPageObj = 4;
-        for (int i = 0; i < numPages; ++i) {
-            int pageObjNum = firstPageObj + i;
-            obj << " " << pageObjNum << " 0 R";
-        }
-        obj << " ] /Count " << numPages << " >>\n";
-        obj << "endobj\n";
-        objects.push_back(obj.str());
-    }
-
-    // Object 3: Font (Helvetica)
-    {
-        std::ostringstream obj;
-        obj << "3 0 obj\n";
-        obj << "<< /Type /Font /Subtype /Type1 /BaseFont /Helvetica >>\n";
-        obj << "endobj\n";
-        objects.push_back(obj.str());
-    }
-
-    // Page objects (4 .. 3+numPages)
-    int firstPageObj = 4;
-    int firstContentObj = firstPageObj + numPages;
-
-    for (int i = 0; i < numPages; ++i) {
-        int pageObjNum = firstPageObj + i;
-        int contentObjNum = firstContentObj + i;
-
-        std::ostringstream obj;
-        obj << pageObjNum << " 0 obj\n";
-        obj << "<< /Type /Page\n";
-        obj << "   /Parent 2 0 R\n";
-        obj << "   /MediaBox [0 0 612 792]\n";
-        obj << "   /Resources << /Font << /F1 3 0 R >> >>\n";
-        obj << "   /Contents " << contentObjNum << " 0 R\n";
-        obj << ">>\n";
-        obj << "endobj\n";
-        objects.push_back(obj.str());
-    }
-
-    // Content stream objects (one per page)
-    for (int i = 0; i < numPages; ++i) {
-        std::string content = BuildPageContent(pages[i]);
-        int contentLength = static_cast<int>(content.size());
-
-        int contentObjNum = firstContentObj + i;
-        std::ostringstream obj;
-        obj << contentObjNum << " 0 obj\n";
-        obj << "<< /Length " << contentLength << " >>\n";
-        obj << "stream\n";
-        obj << content;
-        obj << "\nendstream\n";
-        obj << "endobj\n";
-        objects.push_back(obj.str());
-    }
-
-    int numObjects = static_cast<int>(objects.size()) - 1;
-
-    // Build full PDF in memory
-    std::ostringstream pdf;
-    pdf << "%PDF-1.4\n";
-    pdf << "%\xE2\xE3\xCF\xD3\n";
-
-    std::vector<long> offsets(numObjects + 1, 0);
-
-    for (int i = 1; i <= numObjects; ++i) {
-        offsets[i] = static_cast<long>(pdf.tellp());
-        pdf << objects[i];
-    }
-
-    long xrefOffset = static_cast<long>(pdf.tellp());
-
-    // Xref table
-    pdf << "xref\n";
-    pdf << "0 " << (numObjects + 1) << "\n";
-    pdf << "0000000000 65535 f \n";
-    for (int i = 1; i <= numObjects; ++i) {
-        pdf << std::setw(10) << std::setfill('0') << offsets[i]
-            << " 00000 n \n";
-    }
-
-    // Trailer
-    pdf << "trailer\n";
-    pdf << "<< /Size " << (numObjects + 1) << " /Root 1 0 R >>\n";
-    pdf << "startxref\n";
-    pdf << xrefOffset << "\n";
-    pdf << "%%EOF\n";
-
-    std::string pdfStr = pdf.str();
-
-    // Write to file
-    std::ofstream out(outputFile.c_str(), std::ios::binary);
-    if (!out) {
-        std::cerr << "Failed to open output PDF: " << outputFile << "\n";
+        unsigned long length = 0;
+        bool ok = parts.size() == 3 && parts[0] == "REQ";
+        if (ok) {
+            auto res = std::from_chars(parts[2].data(), parts[2].data() + parts[2].size(), length);
+            ok = res.ec == std::errc() && res.ptr == parts[2].data() + parts[2].size() &&
+                 length <= maxRequest;
+        }
+        if (!ok) {
+            const char *msg = "Malformed request header";
+            conn->Send("ERR", "-", msg, std::strlen(msg));
+            return;
+        }
+
+        ServerRequest req;
+        req.conn = conn;
+        req.id.assign(parts[1].data(), parts[1].size());
+        req.text.resize(length);
+        if (!reader.ReadExact(req.text.data(), length)) {
+            return;
+        }
+        if (!queue.Push(req)) {
+            const char *msg = "Server is shutting down";
+            conn->Send("ERR", req.id, msg, std::strlen(msg));
+        }
+    }
+}
+
+static int ListenUnix(const std::string &path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        ::listen(fd, 64) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int RunServer(const Options &opts) {
+    // A client hanging up must not kill the server
+    std::signal(SIGPIPE, SIG_IGN);
+
+    int listenFd = -1;
+    if (!opts.socketPath.empty()) {
+        listenFd = ListenUnix(opts.socketPath);
+        if (listenFd < 0) {
+            std::cerr << "Failed to listen on socket: " << opts.socketPath << "\n";
+            return 1;
+        }
+    }
+
+    WorkerPool pool(opts.jobs);
+    const std::size_t numWorkers = static_cast<std::size_t>(pool.Size());
+    ConverterSet converters(opts, numWorkers);
+    // Shared with the connection readers, which may outlive this function
+    // in socket mode
+    std::shared_ptr<RequestQueue> queue(new RequestQueue(numWorkers * 4));
+
+    std::thread input;
+    std::shared_ptr<Connection> stdio;
+    if (listenFd < 0) {
+        stdio = std::make_shared<Connection>(0, 1, false);
+        input = std::thread([queue, stdio] {
+            ReadRequests(stdio, *queue);
+            queue->Close();
+        });
+    } else {
+        input = std::thread([queue, listenFd] {
+            for (;;) {
+                int fd = ::accept(listenFd, nullptr, nullptr);
+                if (fd < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED) {
+                        continue;
+                    }
+                    break;
+                }
+                std::shared_ptr<Connection> conn = std::make_shared<Connection>(fd, fd, true);
+                std::thread([conn, queue] { ReadRequests(conn, *queue); }).detach();
+            }
+            queue->Close();
+        });
+    }
+
+    pool.Run(numWorkers, [&](std::size_t, int worker) {
+        DocumentConverter &converter = converters.Get(worker);
+        ServerRequest req;
+        ByteBuffer pdf;
+        std::string error;
+        while (queue->Pop(req)) {
+            pdf.Clear();
+            if (converter.ConvertBuffer(req.text.data(), req.text.size(), pdf, error)) {
+                req.conn->Send("RES", req.id, pdf.Data(), pdf.Size());
+            } else {
+                req.conn->Send("ERR", req.id, error.data(), error.size());
+            }
+            req = ServerRequest();
+        }
+    });
+
+    input.join();
+    if (stdio) {
+        stdio->Flush();
+    }
+    if (listenFd >= 0) {
+        std::cerr << "Failed to accept on socket: " << opts.socketPath << "\n";
+        ::close(listenFd);
         return 1;
     }
-    out.write(pdfStr.data(), static_cast<std::streamsize>(pdfStr.size()));
+    return 0;
+}
+
+#else
+
+static int RunServer(const Options &) {
+    std::cerr << "Server mode is not available on this platform\n";
+    return 1;
+}
+
+#endif
+
+// --- Benchmarks ---
+// --generate writes a synthetic layout; --bench times each stage on one
+// held in memory, best of --iterations runs: parse (text to PageSpecs),
+// layout (PageSpecs to positioned lines), serialize (content streams,
+// deflated with --compress), write (PdfWriter to a file: page objects,
+// streams, page tree, xref), then the whole conversion on --jobs threads.
+// The single-stage timings run on one thread.
+
+static int RunGenerate(const Options &opts) {
+    ByteBuffer text;
+    GenerateLayout(opts.gen, text);
+    std::string layoutFile = opts.generateName + ".txt";
+    std::ofstream out(layoutFile.c_str(), std::ios::binary);
+    out.write(text.Data(), static_cast<std::streamsize>(text.Size()));
     out.close();
+    if (out.fail()) {
+        std::cerr << "Failed to write layout file: " << layoutFile << "\n";
+        return 1;
+    }
+    std::cout << "Saved to '" << layoutFile << "'\n";
+    return 0;
+}
+
+// Peak resident set size of the process so far, in MiB
+static double PeakRssMiB() {
+#ifdef LAYOUT2PDF_HAVE_MMAP
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#ifdef __APPLE__
+        return static_cast<double>(ru.ru_maxrss) / (1024.0 * 1024.0);   // bytes
+#else
+        return static_cast<double>(ru.ru_maxrss) / 1024.0;              // KiB
+#endif
+    }
+#endif
+    return 0.0;
+}
+
+template <typename Fn>
+static double BestSeconds(int iterations, const Fn &fn) {
+    double best = 0.0;
+    for (int i = 0; i < iterations; ++i) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+        if (i == 0 || took.count() < best) {
+            best = took.count();
+        }
+    }
+    return best;
+}
+
+// Create an empty scratch file in TMPDIR (or /tmp) under a fresh name
+static bool MakeScratchFile(std::string &path) {
+#ifdef LAYOUT2PDF_HAVE_MMAP
+    const char *dir = std::getenv("TMPDIR");
+    path = dir && *dir ? dir : "/tmp";
+    path += "/layout2pdf-bench-XXXXXX";
+    int fd = ::mkstemp(&path[0]);
+    if (fd < 0) {
+        return false;
+    }
+    ::close(fd);
+    return true;
+#else
+    char name[L_tmpnam];
+    if (!std::tmpnam(name)) {
+        return false;
+    }
+    path = name;
+    return true;
+#endif
+}
+
+// bytes is what the stage consumed (in) or produced (out)
+static void ReportStage(const char *name, double seconds, std::size_t pages, std::size_t bytes,
+                        const char *bytesKind) {
+    double safe = seconds > 0.0 ? seconds : 1e-9;
+    std::printf("%-11s %10.2f ms %12.0f pages/s %10.1f MB/s %s\n", name, seconds * 1000.0,
+                static_cast<double>(pages) / safe, static_cast<double>(bytes) / safe / 1e6, bytesKind);
+}
+
+static int RunBench(const Options &opts) {
+    const int iterations = opts.benchIterations;
+    ByteBuffer text;
+    GenerateLayout(opts.gen, text);
+    std::printf("layout: %d pages x %d lines, %.1f MB, best of %d\n", opts.gen.pages,
+                opts.gen.linesPerPage, static_cast<double>(text.Size()) / 1e6, iterations);
+
+    // Parse. Specs keep views into text, which stays put.
+    std::vector<PageSpec> specs;
+    std::size_t numSpecs = 0;
+    StyleTable styles;
+    FragmentTable fragments;
+    LayoutReader in;
+    double parseTime = BestSeconds(iterations, [&] {
+        numSpecs = 0;
+        styles.Clear();
+        fragments.Clear();
+        in.OpenMemory(text.Data(), text.Size());
+        ParseLayoutFile(in, styles, fragments, [&](PageSpec &page) {
+            if (numSpecs == specs.size()) {
+                specs.emplace_back();
+            }
+            std::swap(specs[numSpecs++], page);
+            return true;
+        });
+    });
+    // The stages on their own draw in Helvetica; --font only applies to the
+    // full conversion
+    const TextFont font;
+    for (std::size_t i = 0; i < fragments.Size(); ++i) {
+        LayoutFragment(fragments.Get(i), font);
+    }
+
+    // Layout
+    LayoutEngine engine;
+    std::vector<PageLayout> layouts;
+    std::size_t numPages = 0;
+    double layoutTime = BestSeconds(iterations, [&] {
+        numPages = 0;
+        for (std::size_t i = 0; i < numSpecs; ++i) {
+            engine.Begin(specs[i], fragments, font);
+            for (;;) {
+                if (numPages == layouts.size()) {
+                    layouts.emplace_back();
+                }
+                if (!engine.NextPage(layouts[numPages])) {
+                    break;
+                }
+                numPages++;
+            }
+        }
+    });
+
+    // Serialize
+    std::vector<ByteBuffer> streams(numPages);
+    std::vector<char> deflated(numPages, 0);
+    ByteBuffer encoded;
+    ContentScratch scratch;
+    std::size_t contentBytes = 0;
+    double serializeTime = BestSeconds(iterations, [&] {
+        contentBytes = 0;
+        for (std::size_t k = 0; k < numPages; ++k) {
+            ByteBuffer &stream = streams[k];
+            stream.Clear();
+            BuildPageContent(layouts[k], static_cast<int>(k) + 1, font, scratch, stream);
+            deflated[k] = opts.compressLevel > 0 && FlateEncode(stream, opts.compressLevel, encoded);
+            if (deflated[k]) {
+                stream.Swap(encoded);
+            }
+            contentBytes += stream.Size();
+        }
+    });
+
+    // Write
+    PdfOutputMode mode = PDF_CLASSIC;
+    if (opts.pdf15) mode = PDF_OBJECT_STREAMS;
+    if (opts.linearize) mode = PDF_LINEARIZED;
+    std::string benchFile;
+    if (!MakeScratchFile(benchFile)) {
+        std::cerr << "Failed to create a temporary file for the benchmark output\n";
+        return 1;
+    }
+    PdfWriter writer;
+    ByteBuffer obj;
+    bool wrote = true;
+    double writeTime = BestSeconds(iterations, [&] {
+        if (!writer.Open(benchFile, mode, opts.writeMode, opts.directIo)) {
+            wrote = false;
+            return;
+        }
+        const int catalogObj = writer.NewObject();
+        const int pagesObj = writer.NewObject();
+        const int fontObj = writer.NewObject();
+        const int resourcesObj = writer.NewObject();
+        obj.Clear();
+        obj.Append("<< /Type /Catalog /Pages ");
+        obj.AppendInt(pagesObj);
+        obj.Append(" 0 R >>\n");
+        writer.WriteObject(catalogObj, obj);
+        writer.WriteObject(fontObj, "<< /Type /Font /Subtype /Type1 /BaseFont /Helvetica"
+                                    " /Encoding /WinAnsiEncoding >>\n");
+        obj.Clear();
+        obj.Append("<< /Font << /F1 ");
+        obj.AppendInt(fontObj);
+        obj.Append(" 0 R >> >>\n");
+        writer.WriteObject(resourcesObj, obj);
+        writer.MarkShared(resourcesObj);
+        writer.MarkShared(fontObj);
+
+        PageTree tree(writer, pagesObj);
+        for (std::size_t k = 0; k < numPages; ++k) {
+            int parentObj = tree.NextParent();
+            int pageObjNum = writer.NewObject();
+            int contentObjNum = writer.NewObject();
+            BuildPageObject(parentObj, resourcesObj, contentObjNum, obj);
+            writer.WriteObject(pageObjNum, obj);
+            writer.WriteStreamObject(contentObjNum, streams[k], deflated[k] != 0);
+            writer.MarkPage(pageObjNum, contentObjNum);
+            tree.AddPage(pageObjNum);
+        }
+        tree.Finish();
+        wrote = writer.Finish(catalogObj) && wrote;
+    });
+    std::size_t pdfBytes = 0;
+    if (std::FILE *f = std::fopen(benchFile.c_str(), "rb")) {
+        std::fseek(f, 0, SEEK_END);
+        pdfBytes = static_cast<std::size_t>(std::ftell(f));
+        std::fclose(f);
+    }
+    std::remove(benchFile.c_str());
+    if (!wrote) {
+        std::cerr << "Failed to write benchmark output: " << benchFile << "\n";
+        return 1;
+    }
+
+    // The whole conversion, as --serve runs it: memory in, memory out. The
+    // page cache is left out, or every run after the first would only be
+    // copying pages back from it.
+    Options convertOpts = opts;
+    convertOpts.cacheDir.clear();
+    WorkerPool pool(opts.jobs);
+    DocumentConverter converter(convertOpts, pool);
+    ByteBuffer pdf;
+    std::string error;
+    bool converted = true;
+    double convertTime = BestSeconds(iterations, [&] {
+        pdf.Clear();
+        converted = converter.ConvertBuffer(text.Data(), text.Size(), pdf, error) && converted;
+    });
+    if (!converted) {
+        std::cerr << error << "\n";
+        return 1;
+    }
+
+    ReportStage("parse", parseTime, numPages, text.Size(), "in");
+    ReportStage("layout", layoutTime, numPages, text.Size(), "in");
+    ReportStage("serialize", serializeTime, numPages, contentBytes, "out");
+    ReportStage("write", writeTime, numPages, pdfBytes, "out");
+    ReportStage("convert", convertTime, numPages, text.Size(), "in");
+    std::printf("peak RSS    %10.1f MiB\n", PeakRssMiB());
+    return 0;
+}
+
+// --- Single conversion ---
+
+static int RunConvert(const Options &opts) {
+    const bool fromStdin = opts.layoutName == "-";
+    std::string layoutFile = fromStdin ? "-" : opts.layoutName + ".txt";
+    std::string outputFile = opts.outputName;
+    if (outputFile.empty()) {
+        outputFile = fromStdin ? "-" : opts.layoutName + ".pdf";
+    }
+
+    WorkerPool pool(opts.jobs);
+    DocumentConverter converter(opts, pool);
+    std::string error;
+    if (!converter.ConvertFile(layoutFile, outputFile, error)) {
+        std::cerr << error << "\n";
+        return 1;
+    }
+
+    // stdout carries the PDF itself
+    if (outputFile != "-") {
+        std::cout << "Saved to '" << outputFile << "'\n";
+    }
+    return 0;
+}
 
-    std::cout << "Saved to '" << outputFile << "'\n";
+// --- Watch mode ---
+// Converts the layout, then polls it and converts it again whenever its
+// size, modification time or inode changes and then holds still for a
+// poll, until interrupted. The
+// converter keeps a model of the PDF it wrote, so an edit to the text of
+// a few pages is appended to the file as an incremental update of just
+// those pages (see DocumentConverter::Reconvert).
+
+// Changes whenever path is modified or replaced; 0 if it cannot be read
+static std::uint64_t FileVersion(const std::string &path) {
+#ifdef LAYOUT2PDF_HAVE_MMAP
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) {
+        return 0;
+    }
+    std::uint64_t mtime, ctime;
+    FileTimes(st, mtime, ctime);
+    std::uint64_t h = Mix64(static_cast<std::uint64_t>(st.st_size) ^ 0x9e3779b97f4a7c15ULL);
+    h = Mix64(h ^ mtime);
+    h = Mix64(h ^ ctime);
+    h = Mix64(h ^ static_cast<std::uint64_t>(st.st_ino));
+    return h | 1;
+#else
+    (void)path;
     return 0;
+#endif
+}
+
+static int RunWatch(const Options &opts) {
+    const std::string layoutFile = opts.layoutName + ".txt";
+    const std::string outputFile = opts.outputName.empty() ? opts.layoutName + ".pdf" : opts.outputName;
+    const std::chrono::milliseconds pollInterval(25);
+
+    WorkerPool pool(opts.jobs);
+    DocumentConverter converter(opts, pool);
+    std::uint64_t converted = 0;   // version last converted
+    std::uint64_t seen = 0;        // at the previous poll
+    for (bool first = true;; first = false) {
+        // A new version is converted once it has stayed the same for a
+        // poll, so that a save still being written is left alone
+        std::uint64_t version = FileVersion(layoutFile);
+        if (!first && (version == converted || version != seen)) {
+            seen = version;
+            std::this_thread::sleep_for(pollInterval);
+            continue;
+        }
+        converted = version;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::string error;
+        bool updated = false;
+        std::size_t pagesRebuilt = 0;
+        bool ok = first ? converter.ConvertFile(layoutFile, outputFile, error)
+                        : converter.Reconvert(layoutFile, outputFile, updated, pagesRebuilt, error);
+        std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - start;
+        char ms[32];
+        std::snprintf(ms, sizeof(ms), "%.1f ms", took.count());
+        if (!ok) {
+            std::cerr << error << "\n";
+        } else if (updated) {
+            std::cout << "Updated '" << outputFile << "': " << pagesRebuilt
+                      << (pagesRebuilt == 1 ? " page" : " pages") << " rebuilt in " << ms << "\n";
+        } else {
+            std::cout << "Saved to '" << outputFile << "' in " << ms << "\n";
+        }
+        std::cout.flush();
+    }
+}
+
+// --- Main ---
+
+int main(int argc, char **argv) {
+    Options opts;
+    if (!ParseArgs(argc, argv, opts)) {
+        PrintUsage();
+        return 1;
+    }
+
+    if (!opts.cacheDir.empty()) {
+        PageCache cache;
+        if (!cache.Open(opts.cacheDir)) {
+            std::cerr << "Failed to open cache directory: " << opts.cacheDir << "\n";
+            return 1;
+        }
+    }
+
+    if (!opts.fontFile.empty()) {
+        TrueTypeFont font;
+        std::string error;
+        if (!font.Load(opts.fontFile, error)) {
+            std::cerr << error << "\n";
+            return 1;
+        }
+    }
+
+    if (opts.writeMode == FILE_WRITE_URING) {
+#if defined(LAYOUT2PDF_HAVE_IO_URING)
+        const bool haveRing = IoRing::Supported();
+#else
+        const bool haveRing = false;
+#endif
+        if (!haveRing) {
+            std::cerr << "io_uring is not available; use --writer thread or sync\n";
+            return 1;
+        }
+    }
+
+    statsEnabled = opts.stats || opts.statsJson;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    int status;
+    if (!opts.generateName.empty()) {
+        status = RunGenerate(opts);
+    } else if (opts.bench) {
+        status = RunBench(opts);
+    } else if (opts.batch) {
+        status = RunBatch(opts);
+    } else if (opts.serve) {
+        status = RunServer(opts);
+    } else if (opts.watch) {
+        status = RunWatch(opts);
+    } else {
+        status = RunConvert(opts);
+    }
+
+    if (statsEnabled) {
+        std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+        PrintStats(opts.statsJson, wall.count());
+    }
+    return status;
 }